@@ -0,0 +1,75 @@
+#include "ARM7TDMI.h"
+#include "Memory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+/**
+* Measures instructions per second for a loop of block transfers, single transfers, arithmetic, and multiplication
+* running from ram, in each execution mode. Each result is the best of several runs.
+*/
+
+namespace {
+
+const uint64_t kInstructionsPerRun = 20000000;
+const int kRuns = 5;
+
+const uint32_t kLoop[] = {
+	0xe8b8000f, // 0x00: ldmia r8!, {r0-r3}
+	0xe8a9000f, // 0x04: stmia r9!, {r0-r3}
+	0xe2488010, // 0x08: sub r8, r8, #16
+	0xe2499010, // 0x0c: sub r9, r9, #16
+	0xe5984004, // 0x10: ldr r4, [r8, #4]
+	0xe5894008, // 0x14: str r4, [r9, #8]
+	0xe0855004, // 0x18: add r5, r5, r4
+	0xe0060596, // 0x1c: mul r6, r6, r5
+	0xe2577001, // 0x20: subs r7, r7, #1
+	0x1afffff5, // 0x24: bne 0x00
+	0xeafffffe, // 0x28: b 0x28
+};
+
+double run(ARM7TDMI::ExecutionMode mode) {
+	ARM7TDMI cpu;
+	Memory<uint32_t> ram{0x10000};
+	cpu.mmu().attach(0, &ram, 0, ram.size());
+	std::copy(reinterpret_cast<const uint8_t*>(kLoop), reinterpret_cast<const uint8_t*>(kLoop) + sizeof(kLoop), ram.storage());
+
+	cpu.setExecutionMode(mode);
+	cpu.reset();
+	cpu.setRegister(ARM7TDMI::kVirtualRegisterR6, 1);
+	cpu.setRegister(ARM7TDMI::kVirtualRegisterR7, 0x7fffffff);
+	cpu.setRegister(ARM7TDMI::kVirtualRegisterR8, 0x8000);
+	cpu.setRegister(ARM7TDMI::kVirtualRegisterR9, 0x9000);
+
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t instructions = 0; instructions < kInstructionsPerRun; ) {
+		instructions += cpu.step();
+	}
+	auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	return kInstructionsPerRun / seconds;
+}
+
+}
+
+int main() {
+	struct {
+		const char* name;
+		ARM7TDMI::ExecutionMode mode;
+	} modes[] = {
+		{"interpreter", ARM7TDMI::kExecutionModeInterpreter},
+		{"cached interpreter", ARM7TDMI::kExecutionModeCachedInterpreter},
+		{"recompiler", ARM7TDMI::kExecutionModeRecompiler},
+	};
+
+	for (auto& mode : modes) {
+		double best = 0.0;
+		for (int i = 0; i < kRuns; ++i) {
+			best = std::max(best, run(mode.mode));
+		}
+		printf("%-20s %8.2f M instructions/s\n", mode.name, best / 1000000.0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+#include "GameBoyAdvance.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+/**
+* Measures immediate dma3 transfers started through the io registers, in microseconds per transfer. Each result is
+* the best of several runs.
+*/
+
+namespace {
+
+const int kRuns = 20;
+
+void measure(GameBoyAdvance* gba, const char* name, uint32_t source, uint32_t destination, uint16_t count, uint16_t control) {
+	auto& mmu = gba->cpu().mmu();
+
+	double best = 1e18;
+	for (int i = 0; i < kRuns; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		mmu.store32(0x040000d4, source);
+		mmu.store32(0x040000d8, destination);
+		mmu.store16(0x040000dc, count);
+		mmu.store16(0x040000de, control);
+		best = std::min(best, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	printf("%-36s %8.2f us\n", name, best);
+}
+
+}
+
+int main() {
+	std::unique_ptr<GameBoyAdvance> gba(new GameBoyAdvance());
+
+	measure(gba.get(), "copy 0x4000 words ewram -> vram", 0x02000000, 0x06000000, 0x4000, 0x8400);
+	measure(gba.get(), "fill 0x4000 words -> vram", 0x03000000, 0x06000000, 0x4000, 0x8500);
+	measure(gba.get(), "copy 0x100 halfwords -> palette", 0x02000000, 0x05000000, 0x100, 0x8000);
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+#include "MMU.h"
+#include "Memory.h"
+
+#include <chrono>
+#include <cstdio>
+
+/**
+* Measures the typed loads and stores of each width through an mmu to ram, in nanoseconds per access.
+*/
+
+namespace {
+
+const uint32_t kAccesses = 50000000;
+
+template <typename F>
+void measure(const char* name, F access) {
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < kAccesses; ++i) {
+		access(i);
+	}
+	auto nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	printf("%-8s %6.2f ns\n", name, nanoseconds / kAccesses);
+}
+
+}
+
+int main() {
+	MMU<uint32_t> mmu;
+	Memory<uint32_t> ram{0x40000};
+	mmu.attach(0x02000000, &ram, 0, ram.size());
+	mmu.setWatchHandler([](uint32_t, uint32_t) {});
+
+	// the accesses go through a pointer the compiler can't see through, as they would from the cpu
+	MMU<uint32_t>* volatile pointer = &mmu;
+	auto& memory = *pointer;
+
+	uint32_t sum = 0;
+	measure("load8", [&](uint32_t i) { sum += memory.load8(0x02000000 + (i & 0x3ffff)); });
+	measure("load16", [&](uint32_t i) { sum += memory.load16(0x02000000 + ((i * 2) & 0x3fffe)); });
+	measure("load32", [&](uint32_t i) { sum += memory.load32(0x02000000 + ((i * 4) & 0x3fffc)); });
+	measure("store8", [&](uint32_t i) { memory.store8(0x02000000 + (i & 0x3ffff), i); });
+	measure("store16", [&](uint32_t i) { memory.store16(0x02000000 + ((i * 2) & 0x3fffe), i); });
+	measure("store32", [&](uint32_t i) { memory.store32(0x02000000 + ((i * 4) & 0x3fffc), i); });
+
+	// keeps the loads from being optimized out
+	printf("checksum %08x\n", sum);
+
+	return 0;
+}
@@ -1,32 +1,98 @@
 #include "ARM7TDMI.h"
 
+#include "ARM7TDMIRecompiler.h"
 #include "BIT_MACROS.h"
 #include "FixedEndian.h"
 
+#include <algorithm>
 #include <cassert>
 
 #define BITFIELD_REGISTER(opcode, msb, lsb) static_cast<VirtualRegister>(kVirtualRegisterR0 + BITFIELD_UINT32(opcode, msb, lsb))
 
 #define LOG_STEP(...) // printf(__VA_ARGS__)
+#define LOG_IDLE_LOOP(...) // printf(__VA_ARGS__)
 
 ARM7TDMI::ARM7TDMI() {
+	static const bool areInstructionTablesBuilt = _buildARMInstructionHandlers() && _buildThumbInstructionHandlers();
+	(void)areInstructionTablesBuilt;
+
 	for (int i = 0; i <= 15; ++i) {
 		_virtualRegisters[kVirtualRegisterR0 + i] = static_cast<PhysicalRegister>(kPhysicalRegisterR0 + i);
 	}	
 	_virtualRegisters[kVirtualRegisterCPSR] = kPhysicalRegisterCPSR;
+	_virtualRegisters[kVirtualRegisterSPSR] = kPhysicalRegisterInvalid;
+	_mmu.setWatchHandler([this](uint32_t address, uint32_t size) { _invalidateBlockCache(address, size); });
 	reset();
 }
 
-void ARM7TDMI::step() {
+ARM7TDMI::~ARM7TDMI() {}
+
+uint32_t ARM7TDMI::step() {
+	if (_isInterruptPending) {
+		_takeInterrupt();
+	}
+
+	switch (_executionMode) {
+		case kExecutionModeInterpreter:
+			_stepInterpreter();
+			return 1;
+		case kExecutionModeCachedInterpreter:
+			return _runCached(UINT64_MAX);
+		case kExecutionModeRecompiler:
+		case kExecutionModeRecompilerLockstep:
+			return _stepRecompiled();
+	}
+
+	return 0;
+}
+
+uint32_t ARM7TDMI::run(uint32_t cycleBudget) {
+	_isExitRequested = false;
+	_isIdle = false;
+
+	if (_isInterruptPending) {
+		_takeInterrupt();
+	}
+
+	auto start = _cycleCount;
+	auto end = start + cycleBudget;
+
+	switch (_executionMode) {
+		case kExecutionModeInterpreter:
+			while (_cycleCount < end && !_isExitRequested) {
+				_stepInterpreter();
+			}
+			break;
+		case kExecutionModeCachedInterpreter:
+			while (_cycleCount < end && !_isExitRequested) {
+				_runCached(end);
+			}
+			break;
+		case kExecutionModeRecompiler:
+		case kExecutionModeRecompilerLockstep:
+			while (_cycleCount < end && !_isExitRequested) {
+				_stepRecompiled();
+			}
+			break;
+	}
+
+	return static_cast<uint32_t>(_cycleCount - start);
+}
+
+void ARM7TDMI::_stepInterpreter() {
 	bool executedInstruction = false;
 	while (!executedInstruction) {
 		if (_toExecute.isValid) {
 			if (getCPSRFlag(kPSRFlagThumb)) {
 				LOG_STEP("%08x [%08x] ", getRegister(kVirtualRegisterPC) - 4, getRegister(kVirtualRegisterCPSR));
+				_cycleCount += ThumbInstructionCycles(static_cast<uint16_t>(_toExecute.opcode));
 				_executeThumb(_toExecute.opcode);
 			} else if (_toExecute.opcode != kARMNOPCode) {
 				LOG_STEP("%08x [%08x] ", getRegister(kVirtualRegisterPC) - 8, getRegister(kVirtualRegisterCPSR));
+				_cycleCount += ARMInstructionCycles(_toExecute.opcode);
 				_executeARM(_toExecute.opcode);
+			} else {
+				_cycleCount += 1;
 			}
 			executedInstruction = true;
 		}
@@ -36,12 +102,12 @@ void ARM7TDMI::step() {
 		if (getCPSRFlag(kPSRFlagThumb)) {
 			auto pc = getRegister(kVirtualRegisterPC);
 			assert(!(pc & 0x1));
-			_toDecode.opcode = mmu().load<LittleEndian<uint16_t>>(pc);
+			_toDecode.opcode = mmu().load16(pc);
 			setRegister(kVirtualRegisterPC, pc + 2);
 		} else {
 			auto pc = getRegister(kVirtualRegisterPC);
 			assert(!(pc & 0x3));
-			_toDecode.opcode = mmu().load<LittleEndian<uint32_t>>(pc);
+			_toDecode.opcode = mmu().load32(pc);
 			setRegister(kVirtualRegisterPC, pc + 4);
 		}
 		_toDecode.isValid = true;
@@ -53,6 +119,26 @@ void ARM7TDMI::reset() {
 	_updateVirtualRegisters();
 	setRegister(kVirtualRegisterPC, 0);
 	_flushPipeline();
+	_clearBlockCache();
+	_isInterruptPending = false;
+}
+
+void ARM7TDMI::setExecutionMode(ExecutionMode mode) {
+	if (mode == _executionMode) { return; }
+
+	// the cached interpreter doesn't keep the prefetched opcodes up to date, so refill the pipeline
+	auto address = _nextInstructionAddress();
+	_executionMode = mode;
+
+	if (mode == kExecutionModeRecompiler || mode == kExecutionModeRecompilerLockstep) {
+		if (!_recompiler) {
+			_recompiler.reset(new ARM7TDMIRecompiler(this));
+		}
+		_recompiler->setLockstep(mode == kExecutionModeRecompilerLockstep);
+	}
+
+	_clearBlockCache();
+	branch(address);
 }
 
 void ARM7TDMI::branch(uint32_t address) {
@@ -63,6 +149,16 @@ void ARM7TDMI::branch(uint32_t address) {
 void ARM7TDMI::interrupt() {
 	if (getCPSRFlag(kPSRFlagIRQDisable)) { return; }
 
+	// io writes can get here in the middle of an instruction or recompiled block, so wait for the next instruction
+	// boundary. this also gives the caller of run a chance to catch up before the handler runs
+	_isInterruptPending = true;
+	_isExitRequested = true;
+}
+
+void ARM7TDMI::_takeInterrupt() {
+	_isInterruptPending = false;
+	if (getCPSRFlag(kPSRFlagIRQDisable)) { return; }
+
 	setMode(kModeIRQ);
 	setCPSRFlags(kPSRFlagIRQDisable);
 	setRegister(kVirtualRegisterLR, getRegister(kVirtualRegisterPC) - (_toExecute.isValid ? 2 : (_toDecode.isValid ? 1 : 0)) * (getCPSRFlag(kPSRFlagThumb) ? 2 : 4) + 4);
@@ -88,8 +184,21 @@ void ARM7TDMI::setCPSRFlags(uint32_t flags, bool set) {
 }
 
 bool ARM7TDMI::checkCondition(Condition condition) const {
-	auto cspr = getRegister(kVirtualRegisterCPSR);
-	
+	if (_lazyFlags.isNZPending) {
+		// these only need the last result, so there's no need to work out the rest of the flags
+		switch (condition) {
+			case kConditionEqual: return !_lazyFlags.result;
+			case kConditionNotEqual: return _lazyFlags.result;
+			case kConditionNegative: return BIT31(_lazyFlags.result);
+			case kConditionPositiveOrZero: return !BIT31(_lazyFlags.result);
+			default: break;
+		}
+	}
+
+	return CheckCondition(_cpsr(), condition);
+}
+
+bool ARM7TDMI::CheckCondition(uint32_t cspr, Condition condition) {
 	switch (condition) {
 		case kConditionEqual: return (cspr & kPSRFlagZero);
 		case kConditionNotEqual: return !(cspr & kPSRFlagZero);
@@ -118,503 +227,1312 @@ void ARM7TDMI::_executeARM(uint32_t opcode) {
 	if (!checkCondition(static_cast<Condition>(opcode >> 28))) {
 		LOG_STEP("[SKIPPED]\n");
 		return;
-	}	
+	}
 
-	if ((opcode & 0x0f000000) == 0x0f000000) {
-		// SWI
-		LOG_STEP("SWI %08x\n", BITFIELD_UINT32(opcode, 23, 0));
-		setMode(kModeSupervisor);
-		setCPSRFlags(kPSRFlagIRQDisable);
-		_branchWithLink(0x00000008);
-		return;
+	(this->*_armInstructionHandlers[ARMInstructionHandlerIndex(opcode)])(opcode);
+}
+
+ARM7TDMI::ARMInstructionHandler ARM7TDMI::_armInstructionHandlers[kARMInstructionHandlerCount];
+
+bool ARM7TDMI::IsARMBlockTerminator(uint32_t opcode) {
+	auto handler = _armInstructionHandlers[ARMInstructionHandlerIndex(opcode)];
+
+	if (handler == &ARM7TDMI::_executeARMDataProcessing || handler == &ARM7TDMI::_executeARMSingleDataTransfer || handler == &ARM7TDMI::_executeARMHalfwordDataTransfer) {
+		return ARMRd(opcode) == kVirtualRegisterPC;
 	}
-	
-	if ((opcode & 0x0e000000) == 0x0a000000) {
-		// B, BL, or BLX
-		uint32_t offset = opcode & 0xffffff;
-		if (offset & 0x800000) {
-			offset |= 0xff000000;
-		}
-		offset <<= 2;
-		uint32_t address = getRegister(kVirtualRegisterPC) + offset;
-		if ((opcode & 0xf0000000) == 0xf0000000) {
-			// BLX
-			if (BIT24(opcode)) {
-				address += 2;
+
+	if (handler == &ARM7TDMI::_executeARMBlockTransfer) {
+		return BIT20(opcode) && BIT15(opcode);
+	}
+
+	if (handler == &ARM7TDMI::_executeARMMultiplication || handler == &ARM7TDMI::_executeARMPSRTransfer) {
+		return false;
+	}
+
+	// branches, software interrupts, and undefined instructions
+	return true;
+}
+
+bool ARM7TDMI::_buildARMInstructionHandlers() {
+	for (uint32_t index = 0; index < kARMInstructionHandlerCount; ++index) {
+		// reconstruct bits 27-20 and 7-4, which are all the decoder needs to pick a handler
+		uint32_t opcode = ((index & 0xff0) << 16) | ((index & 0xf) << 4);
+		auto& handler = _armInstructionHandlers[index];
+
+		if ((opcode & 0x0f000000) == 0x0f000000) {
+			handler = &ARM7TDMI::_executeARMSoftwareInterrupt;
+		} else if ((opcode & 0x0e000000) == 0x0a000000) {
+			handler = &ARM7TDMI::_executeARMBranch;
+		} else if ((opcode & 0x0e000000) == 0x08000000) {
+			handler = &ARM7TDMI::_executeARMBlockTransfer;
+		} else if ((opcode & 0x0c000000) == 0x04000000) {
+			handler = (BIT25(opcode) && BIT4(opcode)) ? &ARM7TDMI::_executeARMUndefined : &ARM7TDMI::_executeARMSingleDataTransfer;
+		} else if (opcode & 0x0c000000) {
+			// coprocessor instructions
+			handler = &ARM7TDMI::_executeARMUndefined;
+		} else if ((opcode & 0x0ff000d0) == 0x01200010) {
+			handler = &ARM7TDMI::_executeARMBranchAndExchange;
+		} else if (!BIT25(opcode) && BIT7(opcode) && BIT4(opcode)) {
+			if (BIT6(opcode) || BIT5(opcode)) {
+				handler = &ARM7TDMI::_executeARMHalfwordDataTransfer;
+			} else if (!BIT24(opcode)) {
+				handler = &ARM7TDMI::_executeARMMultiplication;
+			} else {
+				// SWP
+				handler = &ARM7TDMI::_executeARMUndefined;
 			}
-			LOG_STEP("BLX %08x\n", address);
-			_branchWithLink(address);
-			setCPSRFlags(kPSRFlagThumb);
-		} else if (BIT24(opcode)) {
-			// BL
-			LOG_STEP("BL %08x\n", address);
-			_branchWithLink(address);
+		} else if ((opcode & 0x01900000) == 0x01000000) {
+			// TST, TEQ, CMP, and CMN without the S bit
+			handler = &ARM7TDMI::_executeARMPSRTransfer;
 		} else {
-			// B
-			LOG_STEP("B %08x\n", address);
-			branch(address);
+			handler = &ARM7TDMI::_executeARMDataProcessing;
+		}
+
+		auto& cycles = _armInstructionCycles[index];
+
+		if (handler == &ARM7TDMI::_executeARMBlockTransfer) {
+			// plus one per register, which ARMInstructionCycles adds
+			cycles = BIT20(opcode) ? 2 : 1;
+		} else if (handler == &ARM7TDMI::_executeARMSingleDataTransfer || handler == &ARM7TDMI::_executeARMHalfwordDataTransfer) {
+			cycles = BIT20(opcode) ? 3 : 2;
+		} else if (handler == &ARM7TDMI::_executeARMMultiplication) {
+			// accumulating and long multiplies take an extra internal cycle each
+			cycles = 2 + (BIT21(opcode) ? 1 : 0) + (BIT23(opcode) ? 1 : 0);
+		} else if (handler == &ARM7TDMI::_executeARMDataProcessing) {
+			// shifts by a register take an extra internal cycle
+			cycles = (!BIT25(opcode) && BIT4(opcode)) ? 2 : 1;
+		} else if (handler == &ARM7TDMI::_executeARMPSRTransfer) {
+			cycles = 1;
+		} else {
+			// branches, software interrupts, and undefined instructions refill the pipeline
+			cycles = 3;
 		}
-		return;
 	}
-	
-	if ((opcode & 0x0fffff00) == 0x12fff00) {
-		// BX or BLX
-		uint32_t address = getRegister(ARMRm(opcode));
-		if ((opcode & 0xf0) == 0x10) {
-			// BX
-			LOG_STEP("BX %08x\n", address);
-			branch(address & 0xfffffffe);
-			if (address & 1) {
-				setCPSRFlags(kPSRFlagThumb);
-			}
-			return;
-		} else if ((opcode & 0xf0) == 0x30) {
-			// BLX
-			LOG_STEP("BLX %08x\n", address);
-			_branchWithLink(address & 0xfffffffe);
-			if (address & 1) {
-				setCPSRFlags(kPSRFlagThumb);
-			}
-			return;
+
+	return true;
+}
+
+uint8_t ARM7TDMI::_armInstructionCycles[kARMInstructionHandlerCount];
+
+uint32_t ARM7TDMI::ARMInstructionCycles(uint32_t opcode) {
+	uint32_t cycles = _armInstructionCycles[ARMInstructionHandlerIndex(opcode)];
+	if ((opcode & 0x0e000000) == 0x08000000) {
+		cycles += __builtin_popcount(opcode & 0xffff);
+	}
+	return cycles;
+}
+
+void ARM7TDMI::_executeARMUndefined(uint32_t opcode) {
+	printf("unknown arm opcode %02x\n", opcode);
+	throw UnknownInstruction();
+}
+
+void ARM7TDMI::_executeARMSoftwareInterrupt(uint32_t opcode) {
+	LOG_STEP("SWI %08x\n", BITFIELD_UINT32(opcode, 23, 0));
+	setMode(kModeSupervisor);
+	setCPSRFlags(kPSRFlagIRQDisable);
+	_branchWithLink(0x00000008);
+}
+
+void ARM7TDMI::_executeARMBranch(uint32_t opcode) {
+	// B, BL, or BLX
+	uint32_t offset = opcode & 0xffffff;
+	if (offset & 0x800000) {
+		offset |= 0xff000000;
+	}
+	offset <<= 2;
+	uint32_t address = getRegister(kVirtualRegisterPC) + offset;
+	if ((opcode & 0xf0000000) == 0xf0000000) {
+		// BLX
+		if (BIT24(opcode)) {
+			address += 2;
 		}
+		LOG_STEP("BLX %08x\n", address);
+		_branchWithLink(address);
+		setCPSRFlags(kPSRFlagThumb);
+	} else if (BIT24(opcode)) {
+		// BL
+		LOG_STEP("BL %08x\n", address);
+		_branchWithLink(address);
+	} else {
+		// B
+		LOG_STEP("B %08x\n", address);
+		branch(address);
 	}
-	
-	if (_executeARMDataProcessing(opcode)) { return; }
-	
-	if ((opcode & 0xd900000) == 0x1000000) {
-		// PSR
-		if (BIT21(opcode)) {
-			// MSR
-			if ((opcode & 0xf000) == 0xf000) {
-				uint32_t mask = 0
-					| (BIT19(opcode) ? kPSRMaskFlags : 0) 
-					| (BIT18(opcode) ? kPSRMaskStatus : 0) 
-					| (BIT17(opcode) ? kPSRMaskExtension : 0) 
-					| (BIT16(opcode) ? kPSRMaskControl : 0)
-				;
-				if (BIT25(opcode)) {
-					// immediate op
-					auto shift = BITFIELD_UINT32(opcode, 11, 8) << 1;
-					auto val = Shift(BITFIELD_UINT32(opcode, 7, 0), kShiftTypeROR, shift);
-					auto psr = BIT22(opcode) ? kVirtualRegisterSPSR : kVirtualRegisterCPSR;
-					LOG_STEP("MSR %08x to %s\n", val, BIT22(opcode) ? "spsr" : "cpsr");
-					setRegister(psr, (getRegister(psr) & ~mask) | (val & mask));
-					if (psr == kVirtualRegisterCPSR && (mask & kPSRMaskControl)) {
-						_updateVirtualRegisters();
-					}
-					return;
-				} else if ((opcode & 0xff0) == 0) {
-					// register op
-					auto val = getRegister(ARMRm(opcode));
-					auto psr = BIT22(opcode) ? kVirtualRegisterSPSR : kVirtualRegisterCPSR;
-					LOG_STEP("MSR r%u (%08x) to %s\n", ARMRm(opcode), val, BIT22(opcode) ? "spsr" : "cpsr");
-					setRegister(psr, (getRegister(psr) & ~mask) | (val & mask));
-					if (psr == kVirtualRegisterCPSR && (mask & kPSRMaskControl)) {
-						_updateVirtualRegisters();
-					}
-					return;
+}
+
+void ARM7TDMI::_executeARMBranchAndExchange(uint32_t opcode) {
+	if ((opcode & 0x000fff00) != 0x000fff00) { return _executeARMUndefined(opcode); }
+
+	uint32_t address = getRegister(ARMRm(opcode));
+	if (BIT5(opcode)) {
+		// BLX
+		LOG_STEP("BLX %08x\n", address);
+		_branchWithLink(address & 0xfffffffe);
+	} else {
+		// BX
+		LOG_STEP("BX %08x\n", address);
+		branch(address & 0xfffffffe);
+	}
+	if (address & 1) {
+		setCPSRFlags(kPSRFlagThumb);
+	}
+}
+
+void ARM7TDMI::_executeARMPSRTransfer(uint32_t opcode) {
+	if (BIT21(opcode)) {
+		// MSR
+		if ((opcode & 0xf000) == 0xf000) {
+			uint32_t mask = 0
+				| (BIT19(opcode) ? kPSRMaskFlags : 0) 
+				| (BIT18(opcode) ? kPSRMaskStatus : 0) 
+				| (BIT17(opcode) ? kPSRMaskExtension : 0) 
+				| (BIT16(opcode) ? kPSRMaskControl : 0)
+			;
+			if (BIT25(opcode)) {
+				// immediate op
+				auto shift = BITFIELD_UINT32(opcode, 11, 8) << 1;
+				auto val = Shift(BITFIELD_UINT32(opcode, 7, 0), kShiftTypeROR, shift);
+				auto psr = BIT22(opcode) ? kVirtualRegisterSPSR : kVirtualRegisterCPSR;
+				LOG_STEP("MSR %08x to %s\n", val, BIT22(opcode) ? "spsr" : "cpsr");
+				setRegister(psr, (getRegister(psr) & ~mask) | (val & mask));
+				if (psr == kVirtualRegisterCPSR && (mask & kPSRMaskControl)) {
+					_updateVirtualRegisters();
 				}
+				return;
+			} else if ((opcode & 0xff0) == 0) {
+				// register op
+				auto val = getRegister(ARMRm(opcode));
+				auto psr = BIT22(opcode) ? kVirtualRegisterSPSR : kVirtualRegisterCPSR;
+				LOG_STEP("MSR r%u (%08x) to %s\n", ARMRm(opcode), val, BIT22(opcode) ? "spsr" : "cpsr");
+				setRegister(psr, (getRegister(psr) & ~mask) | (val & mask));
+				if (psr == kVirtualRegisterCPSR && (mask & kPSRMaskControl)) {
+					_updateVirtualRegisters();
+				}
+				return;
 			}
-		} else if ((opcode & 0xf0fff) == 0xf0000) {
-			// MRS
-			auto psr = BIT22(opcode) ? kVirtualRegisterSPSR : kVirtualRegisterCPSR;
-			LOG_STEP("MRS %s to r%u\n", BIT22(opcode) ? "spsr" : "cpsr", ARMRd(opcode));
-			setRegister(ARMRd(opcode), getRegister(psr));
-			return;
 		}
+	} else if ((opcode & 0xf0fff) == 0xf0000) {
+		// MRS
+		auto psr = BIT22(opcode) ? kVirtualRegisterSPSR : kVirtualRegisterCPSR;
+		LOG_STEP("MRS %s to r%u\n", BIT22(opcode) ? "spsr" : "cpsr", ARMRd(opcode));
+		setRegister(ARMRd(opcode), getRegister(psr));
+		return;
 	}
-	
-	if (_executeARMDataTransfer(opcode)) { return; }
 
-	if (_executeARMBlockTransfer(opcode)) { return; }
-
-	if (_executeARMMultiplication(opcode)) { return; }
-	
-	printf("unknown arm opcode %02x\n", opcode);
-	throw UnknownInstruction();
+	_executeARMUndefined(opcode);
 }
 
 void ARM7TDMI::_executeThumb(uint16_t opcode) {
 	LOG_STEP("    %04x: ", opcode);
 
-	if ((opcode & 0xf600) == 0xb400) {
-		// PUSH or POP
-		LOG_STEP(BIT11(opcode) ? "POP " : "PUSH ");
-		auto stack = getRegister(kVirtualRegisterSP);
-		if (BIT11(opcode)) {
-			// POP
-			for (int i = 0; i <= 7; ++i) {
-				if (!(opcode & (1 << i))) { continue; }
-				LOG_STEP("r%d ", i);
-				setRegister(static_cast<VirtualRegister>(kVirtualRegisterR0 + i), mmu().load<LittleEndian<uint32_t>>(stack));
-				stack += 4;
-			}
-			if (BIT8(opcode)) {
-				LOG_STEP("pc ");
-				setRegister(kVirtualRegisterPC, mmu().load<LittleEndian<uint32_t>>(stack) & ~1);
-				_flushPipeline();
-				stack += 4;
+	(this->*_thumbInstructionHandlers[ThumbInstructionHandlerIndex(opcode)])(opcode);
+}
+
+ARM7TDMI::ThumbInstructionHandler ARM7TDMI::_thumbInstructionHandlers[kThumbInstructionHandlerCount];
+
+bool ARM7TDMI::IsThumbBlockTerminator(uint16_t opcode) {
+	if ((opcode & 0xf000) == 0xd000 || (opcode & 0xf800) == 0xe000 || ((opcode & 0xf000) == 0xf000 && BIT11(opcode)) || (opcode & 0xf800) == 0xe800) {
+		// branches, the second half of long branches, and software interrupts
+		return true;
+	}
+
+	if ((opcode & 0xfc00) == 0x4400) {
+		// high register operations that write pc
+		return BITFIELD_UINT32(opcode, 9, 8) == 3 || (BIT7(opcode) && BITFIELD_UINT32(opcode, 2, 0) == 7);
+	}
+
+	if ((opcode & 0xff00) == 0xbd00) {
+		// POP with pc
+		return true;
+	}
+
+	return _thumbInstructionHandlers[ThumbInstructionHandlerIndex(opcode)] == &ARM7TDMI::_executeThumbUndefined;
+}
+
+bool ARM7TDMI::_buildThumbInstructionHandlers() {
+	static const ThumbInstructionHandler aluOps[] = {
+		&ARM7TDMI::_executeThumbALUOp<0x0>, &ARM7TDMI::_executeThumbALUOp<0x1>, &ARM7TDMI::_executeThumbALUOp<0x2>, &ARM7TDMI::_executeThumbALUOp<0x3>,
+		&ARM7TDMI::_executeThumbALUOp<0x4>, &ARM7TDMI::_executeThumbALUOp<0x5>, &ARM7TDMI::_executeThumbALUOp<0x6>, &ARM7TDMI::_executeThumbALUOp<0x7>,
+		&ARM7TDMI::_executeThumbALUOp<0x8>, &ARM7TDMI::_executeThumbALUOp<0x9>, &ARM7TDMI::_executeThumbALUOp<0xa>, &ARM7TDMI::_executeThumbALUOp<0xb>,
+		&ARM7TDMI::_executeThumbALUOp<0xc>, &ARM7TDMI::_executeThumbALUOp<0xd>, &ARM7TDMI::_executeThumbALUOp<0xe>, &ARM7TDMI::_executeThumbALUOp<0xf>,
+	};
+
+	static const ThumbInstructionHandler registerOffsetTransfers[] = {
+		&ARM7TDMI::_executeThumbLoadStoreRegisterOffset<0>, &ARM7TDMI::_executeThumbLoadStoreRegisterOffset<1>,
+		&ARM7TDMI::_executeThumbLoadStoreRegisterOffset<2>, &ARM7TDMI::_executeThumbLoadStoreRegisterOffset<3>,
+		&ARM7TDMI::_executeThumbLoadStoreRegisterOffset<4>, &ARM7TDMI::_executeThumbLoadStoreRegisterOffset<5>,
+		&ARM7TDMI::_executeThumbLoadStoreRegisterOffset<6>, &ARM7TDMI::_executeThumbLoadStoreRegisterOffset<7>,
+	};
+
+	static const ThumbInstructionHandler conditionalBranches[] = {
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionEqual>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionNotEqual>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionUnsignedHigherOrSame>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionUnsignedLower>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionNegative>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionPositiveOrZero>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionOverflow>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionNoOverflow>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionUnsignedHigher>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionUnsignedLowerOrSame>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionGreaterOrEqual>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionLess>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionGreater>,
+		&ARM7TDMI::_executeThumbConditionalBranch<kConditionLessOrEqual>,
+		&ARM7TDMI::_executeThumbUndefined,
+		&ARM7TDMI::_executeThumbSoftwareInterrupt,
+	};
+
+	for (uint32_t index = 0; index < kThumbInstructionHandlerCount; ++index) {
+		// reconstruct bits 15-6, which are all the decoder needs to pick a handler
+		uint16_t opcode = static_cast<uint16_t>(index << 6);
+		auto& handler = _thumbInstructionHandlers[index];
+
+		if ((opcode & 0xf800) == 0x1800) {
+			handler = &ARM7TDMI::_executeThumbAddSubtract;
+		} else if ((opcode & 0xe000) == 0x0000) {
+			handler = &ARM7TDMI::_executeThumbMoveShiftedRegister;
+		} else if ((opcode & 0xe000) == 0x2000) {
+			switch (BITFIELD_UINT32(opcode, 12, 11)) {
+				case 0: handler = &ARM7TDMI::_executeThumbMoveImmediate; break;
+				case 1: handler = &ARM7TDMI::_executeThumbCompareImmediate; break;
+				case 2: handler = &ARM7TDMI::_executeThumbAddImmediate; break;
+				case 3: handler = &ARM7TDMI::_executeThumbSubtractImmediate; break;
 			}
+		} else if ((opcode & 0xfc00) == 0x4000) {
+			handler = aluOps[BITFIELD_UINT32(opcode, 9, 6)];
+		} else if ((opcode & 0xfc00) == 0x4400) {
+			handler = &ARM7TDMI::_executeThumbHighRegisterOp;
+		} else if ((opcode & 0xf800) == 0x4800) {
+			handler = &ARM7TDMI::_executeThumbLoadPCRelative;
+		} else if ((opcode & 0xf000) == 0x5000) {
+			handler = registerOffsetTransfers[BITFIELD_UINT32(opcode, 11, 9)];
+		} else if ((opcode & 0xe000) == 0x6000) {
+			handler = &ARM7TDMI::_executeThumbLoadStoreImmediateOffset;
+		} else if ((opcode & 0xf000) == 0x8000) {
+			handler = &ARM7TDMI::_executeThumbLoadStoreHalfword;
+		} else if ((opcode & 0xf000) == 0x9000) {
+			handler = &ARM7TDMI::_executeThumbLoadStoreSPRelative;
+		} else if ((opcode & 0xf000) == 0xa000) {
+			handler = &ARM7TDMI::_executeThumbLoadAddress;
+		} else if ((opcode & 0xff00) == 0xb000) {
+			handler = &ARM7TDMI::_executeThumbAddOffsetToSP;
+		} else if ((opcode & 0xf600) == 0xb400) {
+			handler = &ARM7TDMI::_executeThumbPushPop;
+		} else if ((opcode & 0xf000) == 0xc000) {
+			handler = &ARM7TDMI::_executeThumbBlockTransfer;
+		} else if ((opcode & 0xf000) == 0xd000) {
+			handler = conditionalBranches[BITFIELD_UINT32(opcode, 11, 8)];
+		} else if ((opcode & 0xf800) == 0xe000) {
+			handler = &ARM7TDMI::_executeThumbBranch;
+		} else if ((opcode & 0xf800) == 0xe800) {
+			handler = &ARM7TDMI::_executeThumbLongBranchExchangeSecondHalf;
+		} else if ((opcode & 0xf800) == 0xf000) {
+			handler = &ARM7TDMI::_executeThumbLongBranchFirstHalf;
+		} else if ((opcode & 0xf800) == 0xf800) {
+			handler = &ARM7TDMI::_executeThumbLongBranchSecondHalf;
 		} else {
-			// PUSH
-			if (BIT8(opcode)) {
-				LOG_STEP("lr ");
-				stack -= 4;
-				mmu().store<LittleEndian<uint32_t>>(stack, getRegister(kVirtualRegisterLR));
-			}
-			for (int i = 7; i >= 0; --i) {
-				if (!(opcode & (1 << i))) { continue; }
-				LOG_STEP("r%d ", i);
-				stack -= 4;
-				mmu().store<LittleEndian<uint32_t>>(stack, getRegister(static_cast<VirtualRegister>(kVirtualRegisterR0 + i)));
+			handler = &ARM7TDMI::_executeThumbUndefined;
+		}
+
+		auto& cycles = _thumbInstructionCycles[index];
+
+		if ((opcode & 0xf600) == 0xb400 || (opcode & 0xf000) == 0xc000) {
+			// plus one per register, which ThumbInstructionCycles adds
+			cycles = BIT11(opcode) ? 2 : 1;
+		} else if ((opcode & 0xf800) == 0x4800) {
+			cycles = 3;
+		} else if ((opcode & 0xf000) == 0x5000) {
+			// STR, STRH, and STRB are the first three operations
+			cycles = BITFIELD_UINT32(opcode, 11, 9) < 3 ? 2 : 3;
+		} else if ((opcode & 0xe000) == 0x6000 || (opcode & 0xf000) == 0x8000 || (opcode & 0xf000) == 0x9000) {
+			cycles = BIT11(opcode) ? 3 : 2;
+		} else if ((opcode & 0xfc00) == 0x4000) {
+			// shifts by a register and multiplies take an extra internal cycle
+			switch (BITFIELD_UINT32(opcode, 9, 6)) {
+				case 0x2: case 0x3: case 0x4: case 0x7: case 0xd:
+					cycles = 2;
+					break;
+				default:
+					cycles = 1;
 			}
+		} else if ((opcode & 0xfc00) == 0x4400) {
+			cycles = BITFIELD_UINT32(opcode, 9, 8) == 3 ? 3 : 1;
+		} else if ((opcode & 0xf000) == 0xd000 || (opcode & 0xf000) == 0xe000 || (opcode & 0xf800) == 0xf800) {
+			// branches, software interrupts, the second half of long branches, and undefined instructions refill the
+			// pipeline
+			cycles = 3;
+		} else {
+			cycles = 1;
 		}
-		setRegister(kVirtualRegisterSP, stack);
-		LOG_STEP("\n");
-		return;
 	}
-	
-	if ((opcode & 0xf000) == 0xa000) {
-		// get pc or sp + offset
-		auto rd = BITFIELD_REGISTER(opcode, 10, 8);
-		auto offset = BITFIELD_UINT32(opcode, 7, 0) << 2;
-		if (BIT11(opcode)) {
-			auto result = getRegister(kVirtualRegisterSP) + offset;
-			LOG_STEP("ADD r%u = sp + %08x = %08x\n", rd, offset, result);
+
+	return true;
+}
+
+uint8_t ARM7TDMI::_thumbInstructionCycles[kThumbInstructionHandlerCount];
+
+uint32_t ARM7TDMI::ThumbInstructionCycles(uint16_t opcode) {
+	uint32_t cycles = _thumbInstructionCycles[ThumbInstructionHandlerIndex(opcode)];
+	if ((opcode & 0xf600) == 0xb400) {
+		cycles += __builtin_popcount(opcode & 0x1ff);
+	} else if ((opcode & 0xf000) == 0xc000) {
+		cycles += __builtin_popcount(opcode & 0xff);
+	}
+	return cycles;
+}
+
+void ARM7TDMI::_executeThumbUndefined(uint16_t opcode) {
+	printf("unknown thumb opcode %04x\n", opcode);
+	throw UnknownInstruction();
+}
+
+void ARM7TDMI::_executeThumbMoveShiftedRegister(uint16_t opcode) {
+	ShiftType shiftType = kShiftTypeLSL;
+	if (BIT12(opcode)) {
+		shiftType = kShiftTypeASR;
+	} else if (BIT11(opcode)) {
+		shiftType = kShiftTypeLSR;
+	}
+	auto rs = BITFIELD_REGISTER(opcode, 5, 3);
+	auto rd = BITFIELD_REGISTER(opcode, 2, 0);
+	auto n = BITFIELD_UINT32(opcode, 10, 6);
+	LOG_STEP("%s r%u by %08x into r%u\n", shiftType == kShiftTypeLSL ? "LSL" : shiftType == kShiftTypeLSR ? "LSR" : "ASR", rs, n, rd);
+	bool carry = getCPSRFlag(kPSRFlagCarry);
+	auto result = ShiftSpecial(getRegister(rs), shiftType, n, &carry);
+	setRegister(rd, result);
+	setCPSRFlags(kPSRFlagCarry, carry);
+	_updateNZFlags(result);
+}
+
+void ARM7TDMI::_executeThumbAddSubtract(uint16_t opcode) {
+	auto rs = BITFIELD_REGISTER(opcode, 5, 3);
+	auto rd = BITFIELD_REGISTER(opcode, 2, 0);
+	if (BIT10(opcode)) {
+		// immediate
+		auto n = BITFIELD_UINT32(opcode, 8, 6);
+		if (BIT9(opcode)) {
+			auto result = _aluOperation(kALUOperationSUB, getRegister(rs), n);
+			LOG_STEP("SUB r%u = r%u - %08x = %08x\n", rd, rs, n, result);
 			setRegister(rd, result);
 		} else {
-			auto result = (getRegister(kVirtualRegisterPC) & ~2) + offset;
-			LOG_STEP("ADD r%u = (pc & ~2) + %08x = %08x\n", rd, offset, result);
+			auto result = _aluOperation(kALUOperationADD, getRegister(rs), n);
+			LOG_STEP("ADD r%u = r%u + %08x = %08x\n", rd, rs, n, result);
+			setRegister(rd, result);
+		}
+	} else {
+		// register
+		auto r = BITFIELD_REGISTER(opcode, 8, 6);
+		if (BIT9(opcode)) {
+			auto result = _aluOperation(kALUOperationSUB, getRegister(rs), getRegister(r));
+			LOG_STEP("SUB r%u = r%u - r%u = %08x\n", rd, rs, r, result);
+			setRegister(rd, result);
+		} else {
+			auto result = _aluOperation(kALUOperationADD, getRegister(rs), getRegister(r));
+			LOG_STEP("ADD r%u = r%u + r%u = %08x\n", rd, rs, r, result);
 			setRegister(rd, result);
 		}
-		return;
 	}
-	
-	if ((opcode & 0xf800) == 0x4800) {
-		// LDR pc-relative
-		auto r = BITFIELD_UINT32(opcode, 10, 8);
-		auto offset = BITFIELD_UINT32(opcode, 7, 0) << 2;
-		auto address = (getRegister(kVirtualRegisterPC) & ~2) + offset;
-		LOG_STEP("LDR r%u with pc + %08x (%08x)\n", r, offset, address);
-		setRegister(static_cast<VirtualRegister>(kVirtualRegisterR0 + r), mmu().load<uint32_t>(address));
-		return;
+}
+
+void ARM7TDMI::_executeThumbMoveImmediate(uint16_t opcode) {
+	auto rd = BITFIELD_REGISTER(opcode, 10, 8);
+	uint32_t n = BITFIELD_UINT32(opcode, 7, 0);
+	LOG_STEP("MOV %08x to r%u\n", n, rd);
+	setRegister(rd, n);
+	_updateNZFlags(n);
+}
+
+void ARM7TDMI::_executeThumbCompareImmediate(uint16_t opcode) {
+	auto rd = BITFIELD_REGISTER(opcode, 10, 8);
+	uint32_t n = BITFIELD_UINT32(opcode, 7, 0);
+	LOG_STEP("CMP r%u - %08x\n", rd, n);
+	_aluOperation(kALUOperationSUB, getRegister(rd), n);
+}
+
+void ARM7TDMI::_executeThumbAddImmediate(uint16_t opcode) {
+	auto rd = BITFIELD_REGISTER(opcode, 10, 8);
+	uint32_t n = BITFIELD_UINT32(opcode, 7, 0);
+	auto result = _aluOperation(kALUOperationADD, getRegister(rd), n);
+	LOG_STEP("ADD r%u = r%u + %08x = %08x\n", rd, rd, n, result);
+	setRegister(rd, result);
+}
+
+void ARM7TDMI::_executeThumbSubtractImmediate(uint16_t opcode) {
+	auto rd = BITFIELD_REGISTER(opcode, 10, 8);
+	uint32_t n = BITFIELD_UINT32(opcode, 7, 0);
+	auto result = _aluOperation(kALUOperationSUB, getRegister(rd), n);
+	LOG_STEP("SUB r%u = r%u - %08x = %08x\n", rd, rd, n, result);
+	setRegister(rd, result);
+}
+
+void ARM7TDMI::_executeThumbLoadPCRelative(uint16_t opcode) {
+	auto r = BITFIELD_UINT32(opcode, 10, 8);
+	auto offset = BITFIELD_UINT32(opcode, 7, 0) << 2;
+	auto address = (getRegister(kVirtualRegisterPC) & ~2) + offset;
+	LOG_STEP("LDR r%u with pc + %08x (%08x)\n", r, offset, address);
+	setRegister(static_cast<VirtualRegister>(kVirtualRegisterR0 + r), mmu().load32(address));
+}
+
+template <uint32_t operation>
+void ARM7TDMI::_executeThumbLoadStoreRegisterOffset(uint16_t opcode) {
+	auto ro = BITFIELD_REGISTER(opcode, 8, 6);
+	auto rb = BITFIELD_REGISTER(opcode, 5, 3);
+	auto address = getRegister(rb) + getRegister(ro);
+	auto rd = BITFIELD_REGISTER(opcode, 2, 0);
+	switch (operation) {
+		case 0:
+			LOG_STEP("STR r%u to [r%u + r%u] (%08x)\n", rd, rb, ro, address);
+			mmu().store32(address, getRegister(rd));
+			return;
+		case 1:
+			LOG_STEP("STRH r%u to [r%u + r%u] (%08x)\n", rd, rb, ro, address);
+			mmu().store16(address, static_cast<uint16_t>(getRegister(rd)));
+			return;
+		case 2:
+			LOG_STEP("STRB r%u to [r%u + r%u] (%08x)\n", rd, rb, ro, address);
+			mmu().store8(address, static_cast<uint8_t>(getRegister(rd)));
+			return;
+		case 3:
+			LOG_STEP("LDSB r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
+			setRegister(rd, static_cast<uint32_t>(static_cast<int8_t>(mmu().load8(address))));
+			return;
+		case 4:
+			LOG_STEP("LDR r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
+			setRegister(rd, mmu().load32(address));
+			return;
+		case 5:
+			LOG_STEP("LDRH r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
+			setRegister(rd, static_cast<uint32_t>(mmu().load16(address)));
+			return;
+		case 6:
+			LOG_STEP("LDRB r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
+			setRegister(rd, static_cast<uint32_t>(mmu().load8(address)));
+			return;
+		case 7:
+			LOG_STEP("LDSH r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
+			setRegister(rd, static_cast<uint32_t>(static_cast<int16_t>(mmu().load16(address))));
+			return;
 	}
-	
-	if (_executeThumbHighRegisterOp(opcode)) { return; }
+}
 
-	if (_executeThumbALUOp(opcode)) { return; }
-	
-	if ((opcode & 0xe000) == 0x2000) {
-		// immediate operation
-		auto rd = BITFIELD_REGISTER(opcode, 10, 8);
-		uint32_t n  = BITFIELD_UINT32(opcode, 7, 0);
-		if (BIT12(opcode)) {
-			if (BIT11(opcode)) {
-				// SUB
-				auto result = _aluOperation(kALUOperationSUB, getRegister(rd), n);
-				LOG_STEP("SUB r%u = r%u - %08x = %08x\n", rd, rd, n, result);
-				setRegister(rd, result);
-			} else {
-				// ADD
-				auto result = _aluOperation(kALUOperationADD, getRegister(rd), n);
-				LOG_STEP("ADD r%u = r%u + %08x = %08x\n", rd, rd, n, result);
-				setRegister(rd, result);
-			}
-		} else if (BIT11(opcode)) {
-			// CMP
-			LOG_STEP("CMP r%u - %08x\n", rd, n);
-			_aluOperation(kALUOperationSUB, getRegister(rd), n);
+void ARM7TDMI::_executeThumbLoadStoreImmediateOffset(uint16_t opcode) {
+	auto rb = BITFIELD_REGISTER(opcode, 5, 3);
+	auto rd = BITFIELD_REGISTER(opcode, 2, 0);
+	auto offset = BITFIELD_UINT32(opcode, 10, 6);
+	if (!BIT12(opcode)) {
+		// word
+		offset <<= 2;
+		uint32_t address = getRegister(rb) + offset;
+		if (BIT11(opcode)) {
+			LOG_STEP("LDR r%u from [r%u + %08x] (%08x)\n", rd, rb, offset, address);
+			setRegister(rd, mmu().load32(address));
 		} else {
-			// MOV
-			LOG_STEP("MOV %08x to r%u\n", n, rd);
-			setRegister(rd, n);
-			_updateNZFlags(n);
+			LOG_STEP("STR r%u to [r%u + %08x] (%08x)\n", rd, rb, offset, address);
+			mmu().store32(address, getRegister(rd));
+		}
+	} else {
+		// byte
+		uint32_t address = getRegister(rb) + offset;
+		if (BIT11(opcode)) {
+			LOG_STEP("LDRB r%u from [r%u + %08x] (%08x)\n", rd, rb, offset, address);
+			setRegister(rd, static_cast<uint32_t>(mmu().load8(address)));
+		} else {
+			LOG_STEP("STRB r%u to [r%u + %08x] (%08x)\n", rd, rb, offset, address);
+			mmu().store8(address, static_cast<uint8_t>(getRegister(rd)));
 		}
-		return;
 	}
-	
-	if ((opcode & 0xf800) == 0xf000) {
-		// long BL or BLX, first half
-		LOG_STEP("BL or BLX first half\n");
-		uint32_t offset = BITFIELD_UINT32(opcode, 10, 0) << 12;
-		if (offset & 0x400000) {
-			offset |= 0xff800000;
-		}
-		setRegister(kVirtualRegisterLR, getRegister(kVirtualRegisterPC) + offset);
-		return;
+}
+
+void ARM7TDMI::_executeThumbLoadStoreHalfword(uint16_t opcode) {
+	auto rb = BITFIELD_REGISTER(opcode, 5, 3);
+	auto rd = BITFIELD_REGISTER(opcode, 2, 0);
+	auto offset = BITFIELD_UINT32(opcode, 10, 6) << 1;
+	auto address = getRegister(rb) + offset;
+	if (BIT11(opcode)) {
+		LOG_STEP("LDRH r%u from [r%u + %08x] (%08x)\n", rd, rb, offset, address);
+		setRegister(rd, static_cast<uint32_t>(mmu().load16(address)));
+	} else {
+		LOG_STEP("STRH r%u to [r%u + %08x] (%08x)\n", rd, rb, offset, address);
+		mmu().store16(address, static_cast<uint16_t>(getRegister(rd)));
 	}
-	
-	if ((opcode & 0xf800) == 0xf800) {
-		// long BL, second half
-		uint32_t offset = BITFIELD_UINT32(opcode, 10, 0) << 1;
-		uint32_t address = getRegister(kVirtualRegisterLR) + offset;
-		LOG_STEP("BL %08x\n", address);
-		_branchWithLink(address, true);
-		return;
+}
+
+void ARM7TDMI::_executeThumbLoadStoreSPRelative(uint16_t opcode) {
+	auto rd = BITFIELD_REGISTER(opcode, 10, 8);
+	auto offset = BITFIELD_UINT32(opcode, 7, 0) << 2;
+	if (BIT11(opcode)) {
+		LOG_STEP("LDR r%u from sp + %08x\n", rd, offset);
+		setRegister(rd, mmu().load32(getRegister(kVirtualRegisterSP) + offset));
+	} else {
+		LOG_STEP("STR r%u to sp + %08x\n", rd, offset);
+		mmu().store32(getRegister(kVirtualRegisterSP) + offset, getRegister(rd));
 	}
+}
 
-	if ((opcode & 0xf801) == 0xe800) {
-		// long BLX, second half
-		uint32_t address = getRegister(kVirtualRegisterLR) + (BITFIELD_UINT32(opcode, 10, 0) << 1);
-		LOG_STEP("BLX %08x\n", address);
-		_branchWithLink(address, true);
-		clearCPSRFlags(kPSRFlagThumb);
-		return;
+void ARM7TDMI::_executeThumbLoadAddress(uint16_t opcode) {
+	// get pc or sp + offset
+	auto rd = BITFIELD_REGISTER(opcode, 10, 8);
+	auto offset = BITFIELD_UINT32(opcode, 7, 0) << 2;
+	if (BIT11(opcode)) {
+		auto result = getRegister(kVirtualRegisterSP) + offset;
+		LOG_STEP("ADD r%u = sp + %08x = %08x\n", rd, offset, result);
+		setRegister(rd, result);
+	} else {
+		auto result = (getRegister(kVirtualRegisterPC) & ~2) + offset;
+		LOG_STEP("ADD r%u = (pc & ~2) + %08x = %08x\n", rd, offset, result);
+		setRegister(rd, result);
 	}
-	
-	if ((opcode & 0xff00) == 0xdf00) {
-		// SWI
-		LOG_STEP("SWI %08x\n", BITFIELD_UINT32(opcode, 7, 0));
-		setMode(kModeSupervisor);
-		setCPSRFlags(kPSRFlagIRQDisable);
-		_branchWithLink(0x00000008);
-		clearCPSRFlags(kPSRFlagThumb);
-		return;
+}
+
+void ARM7TDMI::_executeThumbAddOffsetToSP(uint16_t opcode) {
+	uint32_t offset = BITFIELD_UINT32(opcode, 6, 0) << 2;
+	if (BIT7(opcode)) {
+		auto result = getRegister(kVirtualRegisterSP) - offset;
+		LOG_STEP("SUB sp = sp - %08x = %08x\n", offset, result);
+		setRegister(kVirtualRegisterSP, result);
+	} else {
+		auto result = getRegister(kVirtualRegisterSP) + offset;
+		LOG_STEP("ADD sp = sp + %08x = %08x\n", offset, result);
+		setRegister(kVirtualRegisterSP, result);
 	}
-	
-	if ((opcode & 0xe000) == 0 && (opcode & 0xf800) != 0x1800) {
-		// move shifted register
-		ShiftType shiftType = kShiftTypeLSL;
-		if (BIT12(opcode)) {
-			shiftType = kShiftTypeASR;
-		} else if (BIT11(opcode)) {
-			shiftType = kShiftTypeLSR;
-		}
-		auto rs = BITFIELD_REGISTER(opcode, 5, 3);
-		auto rd = BITFIELD_REGISTER(opcode, 2, 0);
-		auto n = BITFIELD_UINT32(opcode, 10, 6);
-		LOG_STEP("%s r%u by %08x into r%u\n", shiftType == kShiftTypeLSL ? "LSL" : shiftType == kShiftTypeLSR ? "LSR" : "ASR", rs, n, rd);
-		bool carry = getCPSRFlag(kPSRFlagCarry);
-		auto result = ShiftSpecial(getRegister(rs), shiftType, n, &carry);
-		setRegister(rd, result);
-		_updateNZFlags(result);
-		setCPSRFlags(kPSRFlagCarry, carry);
-		return;
+}
+
+void ARM7TDMI::_executeThumbPushPop(uint16_t opcode) {
+	LOG_STEP(BIT11(opcode) ? "POP " : "PUSH ");
+	auto stack = getRegister(kVirtualRegisterSP);
+	if (BIT11(opcode)) {
+		// POP
+		for (int i = 0; i <= 7; ++i) {
+			if (!(opcode & (1 << i))) { continue; }
+			LOG_STEP("r%d ", i);
+			setRegister(static_cast<VirtualRegister>(kVirtualRegisterR0 + i), mmu().load32(stack));
+			stack += 4;
+		}
+		if (BIT8(opcode)) {
+			LOG_STEP("pc ");
+			setRegister(kVirtualRegisterPC, mmu().load32(stack) & ~1);
+			_flushPipeline();
+			stack += 4;
+		}
+	} else {
+		// PUSH
+		if (BIT8(opcode)) {
+			LOG_STEP("lr ");
+			stack -= 4;
+			mmu().store32(stack, getRegister(kVirtualRegisterLR));
+		}
+		for (int i = 7; i >= 0; --i) {
+			if (!(opcode & (1 << i))) { continue; }
+			LOG_STEP("r%d ", i);
+			stack -= 4;
+			mmu().store32(stack, getRegister(static_cast<VirtualRegister>(kVirtualRegisterR0 + i)));
+		}
 	}
-	
-	if ((opcode & 0xf800) == 0x1800) {
-		// add or subtract
-		auto rs = BITFIELD_REGISTER(opcode, 5, 3);
-		auto rd = BITFIELD_REGISTER(opcode, 2, 0);
-		if (BIT10(opcode)) {
-			// immediate
-			auto n = BITFIELD_UINT32(opcode, 8, 6);
-			if (BIT9(opcode)) {
-				auto result = _aluOperation(kALUOperationSUB, getRegister(rs), n);
-				LOG_STEP("SUB r%u = r%u - %08x = %08x\n", rd, rs, n, result);
-				setRegister(rd, result);
-			} else {
-				auto result = _aluOperation(kALUOperationADD, getRegister(rs), n);
-				LOG_STEP("ADD r%u = r%u + %08x = %08x\n", rd, rs, n, result);
-				setRegister(rd, result);
-			}
+	setRegister(kVirtualRegisterSP, stack);
+	LOG_STEP("\n");
+}
+
+void ARM7TDMI::_executeThumbBlockTransfer(uint16_t opcode) {
+	// STM or LDM
+	auto rb = BITFIELD_REGISTER(opcode, 10, 8);
+	auto address = getRegister(rb);
+	uint32_t rlist = BITFIELD_UINT32(opcode, 7, 0);
+	LOG_STEP("%s r%u (%08x): ", BIT11(opcode) ? "LDMIA" : "STMIA", rb, address);
+	for (int i = 0; i <= 7; ++i) {
+		if (!(rlist & (1 << i))) { continue; }
+		auto r = static_cast<VirtualRegister>(kVirtualRegisterR0 + i);
+		if (BIT11(opcode)) {
+			auto value = static_cast<uint32_t>(mmu().load32(address));
+			LOG_STEP("r%u (%08x) ", r, value);
+			setRegister(r, value);
 		} else {
-			// register
-			auto r = BITFIELD_REGISTER(opcode, 8, 6);
-			if (BIT9(opcode)) {
-				auto result = _aluOperation(kALUOperationSUB, getRegister(rs), getRegister(r));
-				LOG_STEP("SUB r%u = r%u - r%u = %08x\n", rd, rs, r, result);
-				setRegister(rd, result);
+			auto value = getRegister(r);
+			LOG_STEP("r%u (%08x) ", r, value);
+			mmu().store32(address, value);
+		}
+		address += 4;
+	}
+	if (!BIT11(opcode) || !(rlist & (1 << rb))) {
+		setRegister(rb, address);
+	}
+	LOG_STEP("\n");
+}
+
+template <ARM7TDMI::Condition condition>
+void ARM7TDMI::_executeThumbConditionalBranch(uint16_t opcode) {
+	uint32_t offset = static_cast<uint32_t>(static_cast<int8_t>(BITFIELD_UINT32(opcode, 7, 0))) << 1;
+	uint32_t address = getRegister(kVirtualRegisterPC) + offset;
+	LOG_STEP("B %08x (condition = %u)\n", address, condition);
+	if (checkCondition(condition)) {
+		branch(address);
+	}
+}
+
+void ARM7TDMI::_executeThumbSoftwareInterrupt(uint16_t opcode) {
+	LOG_STEP("SWI %08x\n", BITFIELD_UINT32(opcode, 7, 0));
+	setMode(kModeSupervisor);
+	setCPSRFlags(kPSRFlagIRQDisable);
+	_branchWithLink(0x00000008);
+	clearCPSRFlags(kPSRFlagThumb);
+}
+
+void ARM7TDMI::_executeThumbBranch(uint16_t opcode) {
+	uint32_t offset = BITFIELD_UINT32(opcode, 10, 0) << 1;
+	if (offset & 0x800) {
+		offset |= 0xfffff000;
+	}
+	auto address = getRegister(kVirtualRegisterPC) + offset;
+	LOG_STEP("B %08x\n", address);
+	branch(address);
+}
+
+void ARM7TDMI::_executeThumbLongBranchFirstHalf(uint16_t opcode) {
+	// long BL or BLX, first half
+	LOG_STEP("BL or BLX first half\n");
+	uint32_t offset = BITFIELD_UINT32(opcode, 10, 0) << 12;
+	if (offset & 0x400000) {
+		offset |= 0xff800000;
+	}
+	setRegister(kVirtualRegisterLR, getRegister(kVirtualRegisterPC) + offset);
+}
+
+void ARM7TDMI::_executeThumbLongBranchSecondHalf(uint16_t opcode) {
+	// long BL, second half
+	uint32_t offset = BITFIELD_UINT32(opcode, 10, 0) << 1;
+	uint32_t address = getRegister(kVirtualRegisterLR) + offset;
+	LOG_STEP("BL %08x\n", address);
+	_branchWithLink(address, true);
+}
+
+void ARM7TDMI::_executeThumbLongBranchExchangeSecondHalf(uint16_t opcode) {
+	// long BLX, second half
+	if (BIT0(opcode)) { return _executeThumbUndefined(opcode); }
+	uint32_t address = getRegister(kVirtualRegisterLR) + (BITFIELD_UINT32(opcode, 10, 0) << 1);
+	LOG_STEP("BLX %08x\n", address);
+	_branchWithLink(address, true);
+	clearCPSRFlags(kPSRFlagThumb);
+}
+
+void ARM7TDMI::_updateNZFlags(uint32_t n) {
+	_lazyFlags.isNZPending = true;
+	_lazyFlags.result = n;
+}
+
+void ARM7TDMI::_setLazyFlags(LazyCarry carry, uint32_t a, uint32_t b, uint32_t sum) {
+	_lazyFlags.isNZPending = true;
+	_lazyFlags.result = sum;
+	_lazyFlags.carry = carry;
+	_lazyFlags.a = a;
+	_lazyFlags.b = b;
+	_lazyFlags.sum = sum;
+}
+
+uint32_t ARM7TDMI::_resolveLazyCarry(uint32_t cpsr) const {
+	auto a = _lazyFlags.a;
+	auto b = _lazyFlags.b;
+	auto sum = _lazyFlags.sum;
+
+	bool carry = false;
+	bool overflow = false;
+
+	switch (_lazyFlags.carry) {
+		case kLazyCarryNone:
+			return cpsr;
+		case kLazyCarryAdd:
+			carry = sum < a || (sum == a && b != 0);
+			overflow = (a & 0x80000000) == (b & 0x80000000) && (a & 0x80000000) != (sum & 0x80000000);
+			break;
+		case kLazyCarrySubtract:
+			carry = sum <= a;
+			overflow = (a & 0x80000000) != (b & 0x80000000) && (a & 0x80000000) != (sum & 0x80000000);
+			break;
+		case kLazyCarrySubtractWithCarry:
+			carry = sum < a || (sum == a && b != 0);
+			overflow = (a & 0x80000000) != (b & 0x80000000) && (a & 0x80000000) != (sum & 0x80000000);
+			break;
+	}
+
+	return (cpsr & ~(kPSRFlagCarry | kPSRFlagOverflow)) | (carry ? kPSRFlagCarry : 0) | (overflow ? kPSRFlagOverflow : 0);
+}
+
+void ARM7TDMI::_flushLazyFlags() {
+	_registers[kVirtualRegisterCPSR] = _cpsr();
+	_discardLazyFlags();
+}
+
+void ARM7TDMI::_branchWithLink(uint32_t address, bool setThumbBit) {
+	setRegister(kVirtualRegisterLR, (getRegister(kVirtualRegisterPC) - (getCPSRFlag(kPSRFlagThumb) ? 2 : 4)) | ((setThumbBit && getCPSRFlag(kPSRFlagThumb)) ? 1 : 0));
+	branch(address);
+}
+
+void ARM7TDMI::_flushPipeline() {
+	_toExecute.isValid = _toDecode.isValid = false;
+}
+
+uint32_t ARM7TDMI::openBusValue() const {
+	// the opcode at pc was fetched last. if pc itself is unmapped, the bus is treated as empty
+	auto pc = getRegister(kVirtualRegisterPC);
+
+	if (getCPSRFlag(kPSRFlagThumb)) {
+		if (!_mmu.isMapped(pc, 2)) { return 0; }
+		uint32_t opcode = _mmu.load16(pc);
+		return (opcode << 16) | opcode;
+	}
+
+	if (!_mmu.isMapped(pc, 4)) { return 0; }
+	return _mmu.load32(pc);
+}
+
+uint32_t ARM7TDMI::_nextInstructionAddress() const {
+	uint32_t width = getCPSRFlag(kPSRFlagThumb) ? 2 : 4;
+	return getRegister(kVirtualRegisterPC) - (_toExecute.isValid ? 2 * width : (_toDecode.isValid ? width : 0));
+}
+
+void ARM7TDMI::_stepCached() {
+	_runCached(0);
+}
+
+uint32_t ARM7TDMI::_runCached(uint64_t endCycle) {
+	bool isThumb = getCPSRFlag(kPSRFlagThumb);
+	uint32_t width = isThumb ? 2 : 4;
+	uint32_t address = _nextInstructionAddress();
+
+	if (!_isInCurrentBlock(address, isThumb)) {
+		_currentBlock = &_cachedBlock(address, isThumb);
+		_currentBlockIndex = 0;
+		_currentBlockGeneration = _blockCacheGeneration;
+	}
+
+	// stores can invalidate the block, so everything needed from it is copied out before any instruction runs
+	auto generation = _blockCacheGeneration;
+	auto instructions = _currentBlock->instructions.data();
+	auto last = _currentBlock->instructions.size() - 1;
+	auto blockAddress = _currentBlock->address;
+	bool isIdleLoop = _currentBlock->isIdleLoop;
+	auto index = _currentBlockIndex;
+
+	// put the pipeline in the state the interpreter would have it in. only pc changes from one instruction to the next
+	_toExecute.isValid = _toDecode.isValid = true;
+
+	uint32_t count = 0;
+
+	while (true) {
+		auto instruction = instructions[index];
+		uint32_t pc = address + 2 * width;
+		_cycleCount += instruction.cycles;
+		setRegister(kVirtualRegisterPC, pc);
+		++count;
+
+		if (isThumb) {
+			LOG_STEP("%08x [%08x] ", address, getRegister(kVirtualRegisterCPSR));
+			LOG_STEP("    %04x: ", instruction.opcode);
+			(this->*instruction.handler.thumb)(static_cast<uint16_t>(instruction.opcode));
+		} else {
+			LOG_STEP("%08x [%08x] ", address, getRegister(kVirtualRegisterCPSR));
+			LOG_STEP("%08x: ", instruction.opcode);
+			// most instructions are unconditional, and those don't need the lazy flags resolved
+			if (instruction.condition == kConditionAlways || checkCondition(instruction.condition)) {
+				(this->*instruction.handler.arm)(instruction.opcode);
 			} else {
-				auto result = _aluOperation(kALUOperationADD, getRegister(rs), getRegister(r));
-				LOG_STEP("ADD r%u = r%u + r%u = %08x\n", rd, rs, r, result);
-				setRegister(rd, result);
+				LOG_STEP("[SKIPPED]\n");
 			}
 		}
-		return;
+
+		address += width;
+
+		if (index++ == last) {
+			// blocks end at the only instructions that can write pc, so this is the only place one can branch
+			if (!_toExecute.isValid || getRegister(kVirtualRegisterPC) != pc || getCPSRFlag(kPSRFlagThumb) != isThumb) {
+				// the next call will pick up from the new pc
+				_flushPipeline();
+				_currentBlockIndex = index;
+				if (isIdleLoop && getRegister(kVirtualRegisterPC) == blockAddress && getCPSRFlag(kPSRFlagThumb) == isThumb) {
+					_beginIdling();
+				}
+				return count;
+			}
+			break;
+		}
+
+		if (generation != _blockCacheGeneration || _cycleCount >= endCycle || _isExitRequested) {
+			break;
+		}
 	}
-	
-	if ((opcode & 0xf000) == 0x5000) {
-		// load or store
-		auto ro = BITFIELD_REGISTER(opcode, 8, 6);
-		auto rb = BITFIELD_REGISTER(opcode, 5, 3);
-		auto address = getRegister(rb) + getRegister(ro);
-		auto rd = BITFIELD_REGISTER(opcode, 2, 0);
-		auto operation = BITFIELD_UINT32(opcode, 11, 9);
-		switch (operation) {
-			case 0:
-				LOG_STEP("STR r%u to [r%u + r%u] (%08x)\n", rd, rb, ro, address);
-				mmu().store<LittleEndian<uint32_t>>(address, getRegister(rd));
-				return;
-			case 1:
-				LOG_STEP("STRH r%u to [r%u + r%u] (%08x)\n", rd, rb, ro, address);
-				mmu().store<LittleEndian<uint16_t>>(address, static_cast<uint16_t>(getRegister(rd)));
-				return;
-			case 2:
-				LOG_STEP("STRB r%u to [r%u + r%u] (%08x)\n", rd, rb, ro, address);
-				mmu().store<LittleEndian<uint8_t>>(address, static_cast<uint8_t>(getRegister(rd)));
-				return;
-			case 3:
-				LOG_STEP("LDSB r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
-				setRegister(rd, static_cast<uint32_t>(mmu().load<LittleEndian<int8_t>>(address)));
-				return;
-			case 4:
-				LOG_STEP("LDR r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
-				setRegister(rd, mmu().load<LittleEndian<uint32_t>>(address));
-				return;
-			case 5:
-				LOG_STEP("LDRH r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
-				setRegister(rd, static_cast<uint32_t>(mmu().load<LittleEndian<uint16_t>>(address)));
-				return;
-			case 6:
-				LOG_STEP("LDRB r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
-				setRegister(rd, static_cast<uint32_t>(mmu().load<LittleEndian<uint8_t>>(address)));
-				return;
-			case 7:
-				LOG_STEP("LDSH r%u from [r%u + r%u] (%08x)\n", rd, rb, ro, address);
-				setRegister(rd, static_cast<uint32_t>(mmu().load<LittleEndian<int16_t>>(address)));
-				return;
+
+	setRegister(kVirtualRegisterPC, address + 2 * width);
+	_currentBlockIndex = index;
+	return count;
+}
+
+uint32_t ARM7TDMI::_stepRecompiled() {
+	bool isThumb = getCPSRFlag(kPSRFlagThumb);
+	uint32_t address = _nextInstructionAddress();
+
+	if (!_recompiler->isSupported() || _isInCurrentBlock(address, isThumb)) {
+		// finish blocks that the cached interpreter started, such as after an interrupt returns mid-block
+		_stepCached();
+		return 1;
+	}
+
+	auto& block = _cachedBlock(address, isThumb);
+
+	if (!block.recompiledCode) {
+		if (++block.executionCount < kRecompileThreshold && !_recompiler->isLockstep()) {
+			_stepCached();
+			return 1;
+		}
+
+		block.recompiledCode = _recompiler->compile(block);
+
+		if (!block.recompiledCode) {
+			// out of space. start over
+			_clearBlockCache();
+			_stepCached();
+			return 1;
 		}
 	}
-	
-	if ((opcode & 0xf000) == 0x8000) {
-		// load or store halfword
-		auto rb = BITFIELD_REGISTER(opcode, 5, 3);
-		auto rd = BITFIELD_REGISTER(opcode, 2, 0);
-		auto offset = BITFIELD_UINT32(opcode, 10, 6) << 1;
-		auto address = getRegister(rb) + offset;
-		if (BIT11(opcode)) {
-			LOG_STEP("LDRH r%u from [r%u + %08x] (%08x)\n", rd, rb, offset, address);
-			setRegister(rd, static_cast<uint32_t>(mmu().load<LittleEndian<uint16_t>>(address)));
+
+	// stores made by the block can invalidate it, so copy out what's needed afterwards
+	uint8_t cycles[kMaxCachedBlockLength];
+	auto length = block.instructions.size();
+	for (size_t i = 0; i < length; ++i) {
+		cycles[i] = block.instructions[i].cycles;
+	}
+	bool isIdleLoop = block.isIdleLoop;
+
+	// generated code works on the stored cpsr
+	_flushLazyFlags();
+
+	_currentBlock = nullptr;
+	auto instructions = _recompiler->execute(block.recompiledCode);
+
+	for (uint32_t i = 0; i < instructions && i < length; ++i) {
+		_cycleCount += cycles[i];
+	}
+
+	if (isIdleLoop && _nextInstructionAddress() == address && getCPSRFlag(kPSRFlagThumb) == isThumb) {
+		_beginIdling();
+	}
+
+	return instructions;
+}
+
+void ARM7TDMI::_beginIdling() {
+	if (_isInterruptPending) { return; }
+	_isIdle = true;
+	_isExitRequested = true;
+}
+
+bool ARM7TDMI::_isInCurrentBlock(uint32_t address, bool isThumb) const {
+	return _currentBlock && _currentBlockGeneration == _blockCacheGeneration && _currentBlockIndex < _currentBlock->instructions.size()
+		&& _currentBlock->isThumb == isThumb && _currentBlock->address + _currentBlockIndex * (isThumb ? 2 : 4) == address;
+}
+
+ARM7TDMI::CachedBlock& ARM7TDMI::_cachedBlock(uint32_t address, bool isThumb) {
+	uint64_t key = (static_cast<uint64_t>(address) << 1) | (isThumb ? 1 : 0);
+
+	auto& entry = _blockLookup[(address >> (isThumb ? 1 : 2)) % kBlockLookupSize];
+	if (entry.block && entry.key == key && entry.generation == _blockCacheGeneration) {
+		return *entry.block;
+	}
+
+	auto it = _blockCache.find(key);
+	if (it != _blockCache.end()) {
+		entry = BlockLookupEntry{key, &it->second, _blockCacheGeneration};
+		return it->second;
+	}
+
+	auto& block = _blockCache[key];
+	block.address = address;
+	block.isThumb = isThumb;
+
+	uint32_t width = isThumb ? 2 : 4;
+
+	for (size_t i = 0; i < kMaxCachedBlockLength; ++i) {
+		CachedInstruction instruction;
+
+		// decoding ahead can't be allowed to touch io, so the rest of the block is only read from plain memory. the first
+		// instruction is about to run, so it's fetched like any other
+		auto data = mmu().directPointer(address + i * width, width, false);
+		if (data) {
+			instruction.opcode = isThumb ? *reinterpret_cast<const LittleEndian<uint16_t>*>(data) : *reinterpret_cast<const LittleEndian<uint32_t>*>(data);
+		} else if (!i) {
+			instruction.opcode = isThumb ? mmu().load16(address) : mmu().load32(address);
 		} else {
-			LOG_STEP("STRH r%u to [r%u + %08x] (%08x)\n", rd, rb, offset, address);
-			mmu().store<LittleEndian<uint16_t>>(address, static_cast<uint16_t>(getRegister(rd)));
+			// the block runs off the end of plain memory. it'll probably branch before getting there
+			break;
 		}
-		return;
-	}
-	
-	if ((opcode & 0xe000) == 0x6000) {
-		// load or store with immediate offset
-		auto rb = BITFIELD_REGISTER(opcode, 5, 3);
-		auto rd = BITFIELD_REGISTER(opcode, 2, 0);
-		auto offset = BITFIELD_UINT32(opcode, 10, 6);
-		if (!BIT12(opcode)) {
-			// word
-			offset <<= 2;
-			uint32_t address = getRegister(rb) + offset;
-			if (BIT11(opcode)) {
-				LOG_STEP("LDR r%u from [r%u + %08x] (%08x)\n", rd, rb, offset, address);
-				setRegister(rd, mmu().load<LittleEndian<uint32_t>>(address));
-			} else {
-				LOG_STEP("STR r%u to [r%u + %08x] (%08x)\n", rd, rb, offset, address);
-				mmu().store<LittleEndian<uint32_t>>(address, getRegister(rd));
-			}
+
+		if (isThumb) {
+			instruction.handler.thumb = _thumbInstructionHandlers[ThumbInstructionHandlerIndex(instruction.opcode)];
+			instruction.condition = kConditionAlways;
+			instruction.cycles = static_cast<uint8_t>(ThumbInstructionCycles(static_cast<uint16_t>(instruction.opcode)));
 		} else {
-			// byte
-			uint32_t address = getRegister(rb) + offset;
-			if (BIT11(opcode)) {
-				LOG_STEP("LDRB r%u from [r%u + %08x] (%08x)\n", rd, rb, offset, address);
-				setRegister(rd, static_cast<uint32_t>(mmu().load<LittleEndian<uint8_t>>(address)));
-			} else {
-				LOG_STEP("STRB r%u to [r%u + %08x] (%08x)\n", rd, rb, offset, address);
-				mmu().store<LittleEndian<uint8_t>>(address, static_cast<uint8_t>(getRegister(rd)));
-			}
+			instruction.handler.arm = _armInstructionHandlers[ARMInstructionHandlerIndex(instruction.opcode)];
+			instruction.condition = static_cast<Condition>(instruction.opcode >> 28);
+			instruction.cycles = static_cast<uint8_t>(ARMInstructionCycles(instruction.opcode));
+		}
+
+		block.instructions.push_back(instruction);
+
+		if (isThumb ? IsThumbBlockTerminator(instruction.opcode) : IsARMBlockTerminator(instruction.opcode)) {
+			break;
 		}
-		return;
 	}
-	
-	if ((opcode & 0xf000) == 0xd000) {
-		// conditional branch
-		auto condition = static_cast<Condition>((opcode >> 8) & 0xf);
-		if (condition != kConditionAlways && condition != kConditionNever) {
-			uint32_t offset = static_cast<uint32_t>(static_cast<int8_t>(BITFIELD_UINT32(opcode, 7, 0))) << 1;
-			uint32_t address = getRegister(kVirtualRegisterPC) + offset;
-			LOG_STEP("B %08x (condition = %u)\n", address, condition);
-			if (checkCondition(condition)) {
-				branch(address);
-			}
-			return;
+
+	auto override = _idleLoopOverrides.find(address);
+	if (override != _idleLoopOverrides.end()) {
+		block.isIdleLoop = override->second;
+	} else if (_isIdleLoopDetectionEnabled && IsIdleLoop(block)) {
+		block.isIdleLoop = true;
+		if (std::find(_idleLoops.begin(), _idleLoops.end(), address) == _idleLoops.end()) {
+			LOG_IDLE_LOOP("idle loop detected at %08x\n", address);
+			_idleLoops.push_back(address);
 		}
 	}
-	
-	if ((opcode & 0xf800) == 0xe000) {
-		// unconditional branch
-		uint32_t offset = BITFIELD_UINT32(opcode, 10, 0) << 1;
-		if (offset & 0x800) {
-			offset |= 0xfffff000;
+
+	mmu().watch(address, block.instructions.size() * width);
+
+	for (auto page : _blockPages(block)) {
+		_blockCachePages[page].push_back(key);
+	}
+
+	entry = BlockLookupEntry{key, &block, _blockCacheGeneration};
+	return block;
+}
+
+std::vector<uint32_t> ARM7TDMI::_blockPages(const CachedBlock& block) {
+	// the watch handler is given canonical addresses, so blocks running from a mirror are filed under the first copy
+	std::vector<uint32_t> pages;
+	uint32_t size = block.instructions.size() * (block.isThumb ? 2 : 4);
+	for (auto page = block.address / MMU<uint32_t>::kWatchPageSize; page <= (block.address + size - 1) / MMU<uint32_t>::kWatchPageSize; ++page) {
+		pages.push_back(mmu().canonicalAddress(page * MMU<uint32_t>::kWatchPageSize) / MMU<uint32_t>::kWatchPageSize);
+	}
+	return pages;
+}
+
+void ARM7TDMI::_invalidateBlockCache(uint32_t address, uint32_t size) {
+	for (auto page = address / MMU<uint32_t>::kWatchPageSize; page <= (address + size - 1) / MMU<uint32_t>::kWatchPageSize; ++page) {
+		auto it = _blockCachePages.find(page);
+		if (it == _blockCachePages.end()) { continue; }
+
+		auto keys = std::move(it->second);
+		_blockCachePages.erase(it);
+		mmu().unwatch(page * MMU<uint32_t>::kWatchPageSize, MMU<uint32_t>::kWatchPageSize);
+
+		for (auto key : keys) {
+			auto block = _blockCache.find(key);
+			if (block == _blockCache.end()) { continue; }
+
+			// blocks that cross a page boundary are filed under both pages
+			for (auto other : _blockPages(block->second)) {
+				auto otherIt = _blockCachePages.find(other);
+				if (otherIt == _blockCachePages.end()) { continue; }
+
+				auto& otherKeys = otherIt->second;
+				otherKeys.erase(std::remove(otherKeys.begin(), otherKeys.end(), key), otherKeys.end());
+				if (otherKeys.empty()) {
+					_blockCachePages.erase(otherIt);
+					mmu().unwatch(other * MMU<uint32_t>::kWatchPageSize, MMU<uint32_t>::kWatchPageSize);
+				}
+			}
+
+			_blockCache.erase(block);
 		}
-		auto address = getRegister(kVirtualRegisterPC) + offset;
-		LOG_STEP("B %08x\n", address);
-		branch(address);
-		return;
 	}
-	
-	if ((opcode & 0xff00) == 0xb000) {
-		// add offset to SP
-		uint32_t offset = BITFIELD_UINT32(opcode, 6, 0) << 2;
-		if (BIT7(opcode)) {
-			auto result = getRegister(kVirtualRegisterSP) - offset;
-			LOG_STEP("SUB sp = sp - %08x = %08x\n", offset, result);
-			setRegister(kVirtualRegisterSP, result);
-		} else {
-			auto result = getRegister(kVirtualRegisterSP) + offset;
-			LOG_STEP("ADD sp = sp + %08x = %08x\n", offset, result);
-			setRegister(kVirtualRegisterSP, result);
+
+	++_blockCacheGeneration;
+}
+
+void ARM7TDMI::_clearBlockCache() {
+	_blockCache.clear();
+	_blockCachePages.clear();
+	mmu().unwatchAll();
+	++_blockCacheGeneration;
+	_currentBlock = nullptr;
+
+	if (_recompiler) {
+		_recompiler->clear();
+	}
+}
+
+void ARM7TDMI::setIdleLoopOverride(uint32_t address, bool isIdleLoop) {
+	_idleLoopOverrides[address] = isIdleLoop;
+	_clearBlockCache();
+}
+
+void ARM7TDMI::setIdleLoopDetectionEnabled(bool enabled) {
+	_isIdleLoopDetectionEnabled = enabled;
+	_clearBlockCache();
+}
+
+namespace {
+	// registers and flags as bits in a dependency mask
+	const uint32_t kDependencyN = 1 << 16;
+	const uint32_t kDependencyZ = 1 << 17;
+	const uint32_t kDependencyC = 1 << 18;
+	const uint32_t kDependencyV = 1 << 19;
+	const uint32_t kDependencyNZ = kDependencyN | kDependencyZ;
+	const uint32_t kDependencyNZCV = kDependencyNZ | kDependencyC | kDependencyV;
+
+	uint32_t ConditionDependencies(ARM7TDMI::Condition condition) {
+		switch (condition) {
+			case ARM7TDMI::kConditionEqual:
+			case ARM7TDMI::kConditionNotEqual:
+				return kDependencyZ;
+			case ARM7TDMI::kConditionUnsignedHigherOrSame:
+			case ARM7TDMI::kConditionUnsignedLower:
+				return kDependencyC;
+			case ARM7TDMI::kConditionNegative:
+			case ARM7TDMI::kConditionPositiveOrZero:
+				return kDependencyN;
+			case ARM7TDMI::kConditionOverflow:
+			case ARM7TDMI::kConditionNoOverflow:
+				return kDependencyV;
+			case ARM7TDMI::kConditionUnsignedHigher:
+			case ARM7TDMI::kConditionUnsignedLowerOrSame:
+				return kDependencyC | kDependencyZ;
+			case ARM7TDMI::kConditionGreaterOrEqual:
+			case ARM7TDMI::kConditionLess:
+				return kDependencyN | kDependencyV;
+			case ARM7TDMI::kConditionGreater:
+			case ARM7TDMI::kConditionLessOrEqual:
+				return kDependencyNZ | kDependencyV;
+			default:
+				return 0;
 		}
-		return;
 	}
+}
 
-	if ((opcode & 0xf000) == 0x9000) {
-		// load / store SP-relative
-		auto rd = BITFIELD_REGISTER(opcode, 10, 8);
-		auto offset = BITFIELD_UINT32(opcode, 7, 0) << 2;
-		if (BIT11(opcode)) {
-			LOG_STEP("LDR r%u from sp + %08x\n", rd, offset);
-			setRegister(rd, mmu().load<LittleEndian<uint32_t>>(getRegister(kVirtualRegisterSP) + offset));
+bool ARM7TDMI::ARMInstructionDependencies(uint32_t opcode, uint32_t* reads, uint32_t* writes) {
+	auto handler = _armInstructionHandlers[ARMInstructionHandlerIndex(opcode)];
+
+	uint32_t rn = 1 << BITFIELD_UINT32(opcode, 19, 16);
+	uint32_t rd = 1 << BITFIELD_UINT32(opcode, 15, 12);
+	uint32_t rm = 1 << BITFIELD_UINT32(opcode, 3, 0);
+
+	*reads = *writes = 0;
+
+	if (handler == &ARM7TDMI::_executeARMDataProcessing) {
+		auto op = BITFIELD_UINT32(opcode, 24, 21);
+		bool isTest = op >= 0x8 && op <= 0xb;
+		bool isMove = op == 0xd || op == 0xf;
+		bool isLogical = op <= 0x1 || op == 0x8 || op == 0x9 || op >= 0xc;
+
+		if (!isTest && ARMRd(opcode) == kVirtualRegisterPC) { return false; }
+
+		if (!isMove) {
+			*reads |= rn;
+		}
+		if (!isTest) {
+			*writes |= rd;
+		}
+
+		bool shifterWritesCarry = false;
+		if (BIT25(opcode)) {
+			shifterWritesCarry = BITFIELD_UINT32(opcode, 11, 8) != 0;
 		} else {
-			LOG_STEP("STR r%u to sp + %08x\n", rd, offset);
-			mmu().store<LittleEndian<uint32_t>>(getRegister(kVirtualRegisterSP) + offset, getRegister(rd));
+			// shifts by a register would need the shift amount's value
+			if (BIT4(opcode)) { return false; }
+			*reads |= rm;
+			auto type = static_cast<ShiftType>(BITFIELD_UINT32(opcode, 6, 5));
+			auto amount = BITFIELD_UINT32(opcode, 11, 7);
+			if (type == kShiftTypeROR && !amount) {
+				// RRX
+				*reads |= kDependencyC;
+			}
+			shifterWritesCarry = type != kShiftTypeLSL || amount;
 		}
-		return;
-	}
-	
-	if ((opcode & 0xf000) == 0xc000) {
-		// STM or LDM
-		auto rb = BITFIELD_REGISTER(opcode, 10, 8);
-		auto address = getRegister(rb);
-		uint32_t rlist = BITFIELD_UINT32(opcode, 7, 0);
-		LOG_STEP("%s r%u (%08x): ", BIT11(opcode) ? "LDMIA" : "STMIA", rb, address);
-		for (int i = 0; i <= 7; ++i) {
-			if (!(rlist & (1 << i))) { continue; }
-			auto r = static_cast<VirtualRegister>(kVirtualRegisterR0 + i);
-			if (BIT11(opcode)) {
-				auto value = static_cast<uint32_t>(mmu().load<LittleEndian<uint32_t>>(address));
-				LOG_STEP("r%u (%08x) ", r, value);
-				setRegister(r, value);
-			} else {
-				auto value = getRegister(r);
-				LOG_STEP("r%u (%08x) ", r, value);
-				mmu().store<LittleEndian<uint32_t>>(address, value);
+
+		if (op >= 0x5 && op <= 0x7) {
+			// ADC, SBC, and RSC
+			*reads |= kDependencyC;
+		}
+
+		if (BIT20(opcode)) {
+			*writes |= isLogical ? (kDependencyNZ | (shifterWritesCarry ? kDependencyC : 0)) : kDependencyNZCV;
+		}
+	} else if (handler == &ARM7TDMI::_executeARMSingleDataTransfer) {
+		// only loads without writeback
+		if (!BIT20(opcode) || !BIT24(opcode) || BIT21(opcode) || ARMRd(opcode) == kVirtualRegisterPC) { return false; }
+		*reads |= rn;
+		*writes |= rd;
+		if (BIT25(opcode)) {
+			*reads |= rm;
+			if (BITFIELD_UINT32(opcode, 6, 5) == kShiftTypeROR && !BITFIELD_UINT32(opcode, 11, 7)) {
+				*reads |= kDependencyC;
 			}
-			address += 4;
 		}
-		if (!BIT11(opcode) || !(rlist & (1 << rb))) {
-			setRegister(rb, address);
+	} else if (handler == &ARM7TDMI::_executeARMHalfwordDataTransfer) {
+		if (!BIT20(opcode) || !BIT24(opcode) || BIT21(opcode) || ARMRd(opcode) == kVirtualRegisterPC) { return false; }
+		*reads |= rn;
+		*writes |= rd;
+		if (!BIT22(opcode)) {
+			*reads |= rm;
 		}
-		LOG_STEP("\n");
-		return;
+	} else {
+		return false;
 	}
 
-	printf("unknown thumb opcode %04x\n", opcode);
-	throw UnknownInstruction();
-}
+	auto condition = static_cast<Condition>(opcode >> 28);
+	if (condition != kConditionAlways) {
+		// if the instruction is skipped, whatever it would have written keeps its old value
+		*reads |= ConditionDependencies(condition) | *writes;
+	}
 
-void ARM7TDMI::_updateNZFlags(uint32_t n) {
-	setCPSRFlags(kPSRFlagZero, n == 0);
-	setCPSRFlags(kPSRFlagNegative, BIT31(n));
+	return true;
 }
 
-void ARM7TDMI::_branchWithLink(uint32_t address, bool setThumbBit) {
-	setRegister(kVirtualRegisterLR, (getRegister(kVirtualRegisterPC) - (getCPSRFlag(kPSRFlagThumb) ? 2 : 4)) | ((setThumbBit && getCPSRFlag(kPSRFlagThumb)) ? 1 : 0));
-	branch(address);
+bool ARM7TDMI::ThumbInstructionDependencies(uint16_t opcode, uint32_t* reads, uint32_t* writes) {
+	uint32_t low0 = 1 << BITFIELD_UINT32(opcode, 2, 0);
+	uint32_t low3 = 1 << BITFIELD_UINT32(opcode, 5, 3);
+	uint32_t low6 = 1 << BITFIELD_UINT32(opcode, 8, 6);
+	uint32_t low8 = 1 << BITFIELD_UINT32(opcode, 10, 8);
+
+	*reads = *writes = 0;
+
+	if ((opcode & 0xf800) == 0x1800) {
+		// ADD and SUB
+		*reads |= low3 | (BIT10(opcode) ? 0 : low6);
+		*writes |= low0 | kDependencyNZCV;
+	} else if ((opcode & 0xe000) == 0x0000) {
+		// shifts by an immediate. LSR and ASR by 0 mean by 32
+		*reads |= low3;
+		*writes |= low0 | kDependencyNZ | ((BITFIELD_UINT32(opcode, 12, 11) || BITFIELD_UINT32(opcode, 10, 6)) ? kDependencyC : 0);
+	} else if ((opcode & 0xe000) == 0x2000) {
+		switch (BITFIELD_UINT32(opcode, 12, 11)) {
+			case 0: *writes |= low8 | kDependencyNZ; break;
+			case 1: *reads |= low8; *writes |= kDependencyNZCV; break;
+			default: *reads |= low8; *writes |= low8 | kDependencyNZCV; break;
+		}
+	} else if ((opcode & 0xfc00) == 0x4000) {
+		auto op = BITFIELD_UINT32(opcode, 9, 6);
+		switch (op) {
+			case 0x2: case 0x3: case 0x4: case 0x7:
+				// shifts by a register
+				return false;
+			case 0x5: case 0x6:
+				// ADC and SBC
+				*reads |= low0 | low3 | kDependencyC;
+				*writes |= low0 | kDependencyNZCV;
+				break;
+			case 0x9:
+				// NEG
+				*reads |= low3;
+				*writes |= low0 | kDependencyNZCV;
+				break;
+			case 0xa: case 0xb:
+				// CMP and CMN
+				*reads |= low0 | low3;
+				*writes |= kDependencyNZCV;
+				break;
+			case 0x8:
+				// TST
+				*reads |= low0 | low3;
+				*writes |= kDependencyNZ;
+				break;
+			case 0xf:
+				// MVN
+				*reads |= low3;
+				*writes |= low0 | kDependencyNZ;
+				break;
+			default:
+				*reads |= low0 | low3;
+				*writes |= low0 | kDependencyNZ;
+		}
+	} else if ((opcode & 0xfc00) == 0x4400) {
+		auto op = BITFIELD_UINT32(opcode, 9, 8);
+		uint32_t rd = BITFIELD_UINT32(opcode, 2, 0) + (BIT7(opcode) ? 8 : 0);
+		uint32_t rs = 1 << (BITFIELD_UINT32(opcode, 5, 3) + (BIT6(opcode) ? 8 : 0));
+		if (op == 3 || (op != 1 && rd == kVirtualRegisterPC)) { return false; }
+		*reads |= rs | (op != 2 ? (1 << rd) : 0);
+		*writes |= op == 1 ? kDependencyNZCV : (1 << rd);
+	} else if ((opcode & 0xf800) == 0x4800) {
+		*reads |= 1 << kVirtualRegisterPC;
+		*writes |= low8;
+	} else if ((opcode & 0xf000) == 0x5000) {
+		// the first three operations are stores
+		if (BITFIELD_UINT32(opcode, 11, 9) < 3) { return false; }
+		*reads |= low3 | low6;
+		*writes |= low0;
+	} else if ((opcode & 0xe000) == 0x6000 || (opcode & 0xf000) == 0x8000) {
+		if (!BIT11(opcode)) { return false; }
+		*reads |= low3;
+		*writes |= low0;
+	} else if ((opcode & 0xf000) == 0x9000) {
+		if (!BIT11(opcode)) { return false; }
+		*reads |= 1 << kVirtualRegisterSP;
+		*writes |= low8;
+	} else if ((opcode & 0xf000) == 0xa000) {
+		*reads |= 1 << (BIT11(opcode) ? kVirtualRegisterSP : kVirtualRegisterPC);
+		*writes |= low8;
+	} else {
+		return false;
+	}
+
+	return true;
 }
 
-void ARM7TDMI::_flushPipeline() {
-	_toExecute.isValid = _toDecode.isValid = false;
+bool ARM7TDMI::IsIdleLoop(const CachedBlock& block) {
+	if (block.instructions.size() > kMaxIdleLoopLength) { return false; }
+
+	// the block has to end with a branch back to its start
+	auto& branch = block.instructions.back();
+	uint32_t branchAddress = block.address + (block.instructions.size() - 1) * (block.isThumb ? 2 : 4);
+	uint32_t target = 0;
+	uint32_t branchReads = 0;
+
+	if (block.isThumb) {
+		if ((branch.opcode & 0xf000) == 0xd000 && BITFIELD_UINT32(branch.opcode, 11, 8) < 0xe) {
+			target = branchAddress + 4 + (static_cast<int8_t>(branch.opcode & 0xff) << 1);
+			branchReads = ConditionDependencies(static_cast<Condition>(BITFIELD_UINT32(branch.opcode, 11, 8)));
+		} else if ((branch.opcode & 0xf800) == 0xe000) {
+			target = branchAddress + 4 + ((static_cast<int32_t>(branch.opcode << 21) >> 21) << 1);
+		} else {
+			return false;
+		}
+	} else {
+		if ((branch.opcode & 0x0f000000) != 0x0a000000 || branch.condition == kConditionNever) { return false; }
+		target = branchAddress + 8 + ((static_cast<int32_t>(branch.opcode << 8) >> 8) << 2);
+		branchReads = ConditionDependencies(branch.condition);
+	}
+
+	if (target != block.address) { return false; }
+
+	// every iteration has to compute the same thing from the same memory. so anything the loop reads has to either be
+	// left alone by the loop or written by it before being read
+	uint32_t reads[kMaxIdleLoopLength];
+	uint32_t writes[kMaxIdleLoopLength];
+	uint32_t loopWrites = 0;
+
+	for (size_t i = 0; i + 1 < block.instructions.size(); ++i) {
+		auto opcode = block.instructions[i].opcode;
+		if (!(block.isThumb ? ThumbInstructionDependencies(static_cast<uint16_t>(opcode), &reads[i], &writes[i]) : ARMInstructionDependencies(opcode, &reads[i], &writes[i]))) {
+			return false;
+		}
+		loopWrites |= writes[i];
+	}
+
+	uint32_t written = 0;
+	for (size_t i = 0; i + 1 < block.instructions.size(); ++i) {
+		if (reads[i] & loopWrites & ~written) { return false; }
+		written |= writes[i];
+	}
+
+	return !(branchReads & loopWrites & ~written);
 }
 
 void ARM7TDMI::_updateVirtualRegisters() {
 	auto mode = static_cast<Mode>(getRegister(kVirtualRegisterCPSR) & 0x1f);
+
+	// bank out the registers of the mode we're leaving
+	for (int v = kVirtualRegisterR8; v <= kVirtualRegisterSPSR; ++v) {
+		if (v != kVirtualRegisterPC && v != kVirtualRegisterCPSR && _virtualRegisters[v] != kPhysicalRegisterInvalid) {
+			_physicalRegisters[_virtualRegisters[v]] = _registers[v];
+		}
+	}
 	
 	if (mode == kModeFIQ) {
 		for (int i = 0; i <= 4; ++i) {
@@ -657,9 +1575,35 @@ void ARM7TDMI::_updateVirtualRegisters() {
 			_virtualRegisters[kVirtualRegisterLR]   = kPhysicalRegisterLR;
 			_virtualRegisters[kVirtualRegisterSPSR] = kPhysicalRegisterInvalid;
 	}
+
+	for (int v = kVirtualRegisterR8; v <= kVirtualRegisterSPSR; ++v) {
+		if (v != kVirtualRegisterPC && v != kVirtualRegisterCPSR) {
+			_registers[v] = _virtualRegisters[v] != kPhysicalRegisterInvalid ? _physicalRegisters[_virtualRegisters[v]] : 0;
+		}
+	}
 }
 
-bool ARM7TDMI::_getARMDataProcessingOp2(uint32_t opcode, uint32_t* op2) {
+const ARM7TDMI::VirtualRegister ARM7TDMI::_physicalRegisterVirtualRegisters[kPhysicalRegisterCount] = {
+	kVirtualRegisterR0, kVirtualRegisterR1, kVirtualRegisterR2, kVirtualRegisterR3,
+	kVirtualRegisterR4, kVirtualRegisterR5, kVirtualRegisterR6, kVirtualRegisterR7,
+	kVirtualRegisterR8, kVirtualRegisterR9, kVirtualRegisterR10, kVirtualRegisterR11,
+	kVirtualRegisterR12, kVirtualRegisterSP, kVirtualRegisterLR, kVirtualRegisterPC,
+
+	kVirtualRegisterR8, kVirtualRegisterR9, kVirtualRegisterR10, kVirtualRegisterR11,
+	kVirtualRegisterR12, kVirtualRegisterSP, kVirtualRegisterLR, kVirtualRegisterSPSR,
+
+	kVirtualRegisterSP, kVirtualRegisterLR, kVirtualRegisterSPSR,
+
+	kVirtualRegisterSP, kVirtualRegisterLR, kVirtualRegisterSPSR,
+
+	kVirtualRegisterSP, kVirtualRegisterLR, kVirtualRegisterSPSR,
+
+	kVirtualRegisterSP, kVirtualRegisterLR, kVirtualRegisterSPSR,
+
+	kVirtualRegisterCPSR,
+};
+
+uint32_t ARM7TDMI::_getARMDataProcessingOp2(uint32_t opcode) {
 	bool updateFlags = BIT20(opcode);
 	bool carryFlag = getCPSRFlag(kPSRFlagCarry);
 	
@@ -667,39 +1611,32 @@ bool ARM7TDMI::_getARMDataProcessingOp2(uint32_t opcode, uint32_t* op2) {
 		// immediate op 2
 		uint32_t n = opcode & 0xff;
 		uint32_t shift = BITFIELD_UINT32(opcode, 11, 8) << 1;
-		*op2 = Shift(n, kShiftTypeROR, shift);
+		return Shift(n, kShiftTypeROR, shift);
+	}
+
+	// register op 2
+	uint32_t op2 = 0;
+	auto n = getRegister(ARMRm(opcode));
+	auto shiftType = static_cast<ShiftType>(BITFIELD_UINT32(opcode, 6, 5));
+	if (BIT4(opcode)) {
+		// register shift
+		op2 = Shift(n, shiftType, getRegister(ARMRs(opcode)), &carryFlag);
 	} else {
-		// register op 2
-		auto n = getRegister(ARMRm(opcode));
-		auto shiftType = static_cast<ShiftType>(BITFIELD_UINT32(opcode, 6, 5));
-		if (BIT4(opcode)) {
-			// register shift
-			if (BIT7(opcode)) {
-				return false;
-			}
-			*op2 = Shift(n, shiftType, getRegister(ARMRs(opcode)), &carryFlag);
-		} else {
-			// immediate shift
-			uint32_t shift = BITFIELD_UINT32(opcode, 11, 7);
-			*op2 = ShiftSpecial(n, shiftType, shift, &carryFlag);
-		}
-		if (updateFlags) {
-			setCPSRFlags(kPSRFlagCarry, carryFlag);
-		}
+		// immediate shift
+		uint32_t shift = BITFIELD_UINT32(opcode, 11, 7);
+		op2 = ShiftSpecial(n, shiftType, shift, &carryFlag);
+	}
+	if (updateFlags) {
+		setCPSRFlags(kPSRFlagCarry, carryFlag);
 	}
 
-	return true;
+	return op2;
 }
 
-bool ARM7TDMI::_executeARMDataProcessing(uint32_t opcode) {
-	if (opcode & 0xc000000) { return false; }
-	
+void ARM7TDMI::_executeARMDataProcessing(uint32_t opcode) {
 	uint32_t operation = BITFIELD_UINT32(opcode, 24, 21);
 	
-	uint32_t op2 = 0;
-	if (!_getARMDataProcessingOp2(opcode, &op2)) {
-		return false;
-	}
+	uint32_t op2 = _getARMDataProcessingOp2(opcode);
 
 	auto rd = ARMRd(opcode);
 	
@@ -755,22 +1692,22 @@ bool ARM7TDMI::_executeARMDataProcessing(uint32_t opcode) {
 			break;
 		}
 		case 0x8:
-			if (!updateFlags || rd != kVirtualRegisterR0) { return false; }
+			if (rd != kVirtualRegisterR0) { return _executeARMUndefined(opcode); }
 			LOG_STEP("TST r%u & %08x\n", ARMRn(opcode), op2);
 			_aluOperation(kALUOperationAND, getRegister(ARMRn(opcode)), op2, updateFlags);
 			break;
 		case 0x9:
-			if (!updateFlags || rd != kVirtualRegisterR0) { return false; }
+			if (rd != kVirtualRegisterR0) { return _executeARMUndefined(opcode); }
 			LOG_STEP("TEQ r%u ^ %08x\n", ARMRn(opcode), op2);
 			_aluOperation(kALUOperationEOR, getRegister(ARMRn(opcode)), op2, updateFlags);
 			break;
 		case 0xa:
-			if (!updateFlags || rd != kVirtualRegisterR0) { return false; }
+			if (rd != kVirtualRegisterR0) { return _executeARMUndefined(opcode); }
 			LOG_STEP("CMP r%u - %08x\n", ARMRn(opcode), op2);
 			_aluOperation(kALUOperationSUB, getRegister(ARMRn(opcode)), op2, updateFlags);
 			break;
 		case 0xb:
-			if (!updateFlags || rd != kVirtualRegisterR0) { return false; }
+			if (rd != kVirtualRegisterR0) { return _executeARMUndefined(opcode); }
 			LOG_STEP("CMN r%u + %08x\n", ARMRn(opcode), op2);
 			_aluOperation(kALUOperationADD, getRegister(ARMRn(opcode)), op2, updateFlags);
 			break;
@@ -800,8 +1737,6 @@ bool ARM7TDMI::_executeARMDataProcessing(uint32_t opcode) {
 			}
 			break;
 		}
-		default:
-			return false;
 	}
 
 	if (rd == kVirtualRegisterPC) {
@@ -811,44 +1746,25 @@ bool ARM7TDMI::_executeARMDataProcessing(uint32_t opcode) {
 			_updateVirtualRegisters();
 		}
 	}
-	
-	return true;
 }
 
-bool ARM7TDMI::_executeARMDataTransfer(uint32_t opcode) {
-	if ((opcode & 0xc000000) != 0x4000000 && (opcode & 0xe000000) != 0) { return false; }
-
+void ARM7TDMI::_executeARMSingleDataTransfer(uint32_t opcode) {
 	auto rd = ARMRd(opcode);
 	auto rn = ARMRn(opcode);
 
 	uint32_t base = getRegister(rn);
 	uint32_t offset = 0;
 
-	if ((opcode & 0xc000000) == 0x4000000) {
-		if (BIT25(opcode)) {
-			// register offset shifted by immediate
-			if (BIT4(opcode)) { return false; }
-			offset = getRegister(ARMRm(opcode));
-			uint32_t shift = BITFIELD_UINT32(opcode, 11, 7);
-			auto shiftType = static_cast<ShiftType>(BITFIELD_UINT32(opcode, 6, 5));
-			bool carry = getCPSRFlag(kPSRFlagCarry);
-			offset = ShiftSpecial(offset, shiftType, shift, &carry);
-		} else {
-			// immediate offset
-			offset = BITFIELD_UINT32(opcode, 11, 0);
-		}
+	if (BIT25(opcode)) {
+		// register offset shifted by immediate
+		offset = getRegister(ARMRm(opcode));
+		uint32_t shift = BITFIELD_UINT32(opcode, 11, 7);
+		auto shiftType = static_cast<ShiftType>(BITFIELD_UINT32(opcode, 6, 5));
+		bool carry = getCPSRFlag(kPSRFlagCarry);
+		offset = ShiftSpecial(offset, shiftType, shift, &carry);
 	} else {
-		if (!BIT4(opcode) || !BIT7(opcode)) { return false; }
-		if (!BIT24(opcode) && BIT21(opcode)) { return false; }
-
-		if (BIT22(opcode)) {
-			// immediate offset
-			offset = (BITFIELD_UINT32(opcode, 11, 8) << 4) | BITFIELD_UINT32(opcode, 3, 0);
-		} else {
-			// register offset
-			if (BITFIELD_UINT32(opcode, 11, 8)) { return false; }
-			offset = getRegister(ARMRm(opcode));
-		}
+		// immediate offset
+		offset = BITFIELD_UINT32(opcode, 11, 0);
 	}
 
 	uint32_t indexed = BIT23(opcode) ? (base + offset) : (base - offset);
@@ -859,74 +1775,93 @@ bool ARM7TDMI::_executeARMDataTransfer(uint32_t opcode) {
 	
 	uint32_t address = BIT24(opcode) ? indexed : base;
 	
-	if ((opcode & 0xc000000) == 0x4000000) {
-		auto rdp = _physicalRegister(rd, !BIT24(opcode) && BIT21(opcode));
+	bool forceUserMode = !BIT24(opcode) && BIT21(opcode);
 
-		if (BIT20(opcode)) {
-			if (BIT22(opcode)) {
-				auto value = mmu().load<uint8_t>(address);
-				LOG_STEP("LDR r%u from byte at %08x (%02x)\n", rd, address, static_cast<uint32_t>(value));
-				setRegister(rdp, value);
-			} else {
-				LOG_STEP("LDR r%u from %08x\n", rd, address);
-				setRegister(rdp, mmu().load<LittleEndian<uint32_t>>(address));
-				if (rdp == kPhysicalRegisterPC) {
-					_flushPipeline();
-				}
-			}
+	if (BIT20(opcode)) {
+		if (BIT22(opcode)) {
+			auto value = mmu().load8(address);
+			LOG_STEP("LDR r%u from byte at %08x (%02x)\n", rd, address, static_cast<uint32_t>(value));
+			_setRegister(rd, value, forceUserMode);
 		} else {
-			if (BIT22(opcode)) {
-				LOG_STEP("STR r%u to byte at %08x\n", rd, address);
-				mmu().store<uint8_t>(address, static_cast<uint8_t>(getRegister(rdp)));
-			} else {
-				LOG_STEP("STR r%u to %08x\n", rd, address);
-				mmu().store<LittleEndian<uint32_t>>(address, getRegister(rdp));
+			LOG_STEP("LDR r%u from %08x\n", rd, address);
+			_setRegister(rd, mmu().load32(address), forceUserMode);
+			if (rd == kVirtualRegisterPC) {
+				_flushPipeline();
 			}
 		}
 	} else {
-		if (BIT20(opcode)) {
-			if (BIT6(opcode)) {
-				if (BIT5(opcode)) {
-					LOG_STEP("LDR r%u from signed halfword at %08x\n", rd, address);
-					setRegister(rd, static_cast<uint32_t>(mmu().load<LittleEndian<int16_t>>(address)));
-				} else {
-					LOG_STEP("LDR r%u from signed byte at %08x\n", rd, address);
-					setRegister(rd, static_cast<uint32_t>(mmu().load<int8_t>(address)));
-				}
-			} else if (BIT5(opcode)) {
-				LOG_STEP("LDR r%u from halfword at %08x\n", rd, address);
-				setRegister(rd, static_cast<uint32_t>(mmu().load<LittleEndian<uint16_t>>(address)));
-			} else {
-				return false;
-			}
-		} else if (BIT6(opcode)) {
+		if (BIT22(opcode)) {
+			LOG_STEP("STR r%u to byte at %08x\n", rd, address);
+			mmu().store8(address, static_cast<uint8_t>(_getRegister(rd, forceUserMode)));
+		} else {
+			LOG_STEP("STR r%u to %08x\n", rd, address);
+			mmu().store32(address, _getRegister(rd, forceUserMode));
+		}
+	}
+}
+
+void ARM7TDMI::_executeARMHalfwordDataTransfer(uint32_t opcode) {
+	if (!BIT24(opcode) && BIT21(opcode)) { return _executeARMUndefined(opcode); }
+
+	auto rd = ARMRd(opcode);
+	auto rn = ARMRn(opcode);
+
+	uint32_t base = getRegister(rn);
+	uint32_t offset = 0;
+
+	if (BIT22(opcode)) {
+		// immediate offset
+		offset = (BITFIELD_UINT32(opcode, 11, 8) << 4) | BITFIELD_UINT32(opcode, 3, 0);
+	} else {
+		// register offset
+		if (BITFIELD_UINT32(opcode, 11, 8)) { return _executeARMUndefined(opcode); }
+		offset = getRegister(ARMRm(opcode));
+	}
+
+	uint32_t indexed = BIT23(opcode) ? (base + offset) : (base - offset);
+	if (!BIT24(opcode) || BIT21(opcode)) {
+		// writeback
+		setRegister(rn, indexed);
+	}
+	
+	uint32_t address = BIT24(opcode) ? indexed : base;
+
+	if (BIT20(opcode)) {
+		if (BIT6(opcode)) {
 			if (BIT5(opcode)) {
-				LOG_STEP("STR r%u, r%u to doubleword at %08x\n", rd, rd + 1, address);
-				mmu().store<LittleEndian<uint32_t>>(address, getRegister(rd));
-				mmu().store<LittleEndian<uint32_t>>(address, getRegister(static_cast<VirtualRegister>(rd + 1)));
+				LOG_STEP("LDR r%u from signed halfword at %08x\n", rd, address);
+				setRegister(rd, static_cast<uint32_t>(static_cast<int16_t>(mmu().load16(address))));
 			} else {
-				LOG_STEP("LDR r%u, r%u from doubleword at %08x\n", rd, rd + 1, address);
-				setRegister(rd, mmu().load<LittleEndian<uint32_t>>(address));
-				setRegister(static_cast<VirtualRegister>(rd + 1), mmu().load<LittleEndian<uint32_t>>(address + 4));
+				LOG_STEP("LDR r%u from signed byte at %08x\n", rd, address);
+				setRegister(rd, static_cast<uint32_t>(static_cast<int8_t>(mmu().load8(address))));
 			}
-		} else if (BIT5(opcode)) {
-			LOG_STEP("STR r%u to halfword at %08x\n", rd, address);
-			mmu().store<LittleEndian<uint16_t>>(address, static_cast<uint16_t>(getRegister(rd)));
 		} else {
-			return false;
+			LOG_STEP("LDR r%u from halfword at %08x\n", rd, address);
+			setRegister(rd, static_cast<uint32_t>(mmu().load16(address)));
+		}
+	} else if (BIT6(opcode)) {
+		if (BIT5(opcode)) {
+			LOG_STEP("STR r%u, r%u to doubleword at %08x\n", rd, rd + 1, address);
+			mmu().store32(address, getRegister(rd));
+			mmu().store32(address, getRegister(static_cast<VirtualRegister>(rd + 1)));
+		} else {
+			LOG_STEP("LDR r%u, r%u from doubleword at %08x\n", rd, rd + 1, address);
+			setRegister(rd, mmu().load32(address));
+			setRegister(static_cast<VirtualRegister>(rd + 1), mmu().load32(address + 4));
 		}
+	} else {
+		LOG_STEP("STR r%u to halfword at %08x\n", rd, address);
+		mmu().store16(address, static_cast<uint16_t>(getRegister(rd)));
 	}
-	
-	return true;
 }
 
-bool ARM7TDMI::_executeARMBlockTransfer(uint32_t opcode) {
-	if ((opcode & 0x0e000000) != 0x08000000) { return false; }
-	
+void ARM7TDMI::_executeARMBlockTransfer(uint32_t opcode) {
 	auto rn = ARMRn(opcode);
 	uint32_t address = getRegister(rn);
 	
 	LOG_STEP("%s r%u (%08x): ", BIT20(opcode) ? "LDM" : "STM", rn, address);
+
+	bool forceUserMode = BIT22(opcode) && !(BIT20(opcode) && BIT15(opcode));
 	
 	for (int i = BIT23(opcode) ? 0 : 15; i >= 0 && i <= 15; i += BIT23(opcode) ? 1 : -1) {
 		if (!(opcode & (1 << i))) { continue; }
@@ -941,16 +1876,16 @@ bool ARM7TDMI::_executeARMBlockTransfer(uint32_t opcode) {
 			}
 		}
 		
-		auto r = _physicalRegister(static_cast<VirtualRegister>(kVirtualRegisterR0 + i), BIT22(opcode) && !(BIT20(opcode) && BIT15(opcode)));
+		auto r = static_cast<VirtualRegister>(kVirtualRegisterR0 + i);
 
 		if (BIT20(opcode)) {
-			uint32_t value = mmu().load<LittleEndian<uint32_t>>(address);
+			uint32_t value = mmu().load32(address);
 			LOG_STEP("(%08x) ", value);
-			setRegister(r, value);
+			_setRegister(r, value, forceUserMode);
 		} else {
-			auto value = getRegister(r);
+			auto value = _getRegister(r, forceUserMode);
 			LOG_STEP("(%08x) ", value);
-			mmu().store<LittleEndian<uint32_t>>(address, value);
+			mmu().store32(address, value);
 		}
 
 		if (!BIT24(opcode)) {
@@ -971,15 +1906,15 @@ bool ARM7TDMI::_executeARMBlockTransfer(uint32_t opcode) {
 		setRegister(kVirtualRegisterCPSR, getRegister(kVirtualRegisterSPSR));
 		_updateVirtualRegisters();
 	}
+
+	if (BIT20(opcode) && BIT15(opcode)) {
+		_flushPipeline();
+	}
 	
 	LOG_STEP("\n");
-	
-	return true;
 }
 
-bool ARM7TDMI::_executeARMMultiplication(uint32_t opcode) {
-	if ((opcode & 0x0e000000) != 0) { return false; }
-
+void ARM7TDMI::_executeARMMultiplication(uint32_t opcode) {
 	auto updateFlags = BIT20(opcode);
 
 	uint32_t operation = BITFIELD_UINT32(opcode, 23, 21);
@@ -990,53 +1925,43 @@ bool ARM7TDMI::_executeARMMultiplication(uint32_t opcode) {
 	auto& rd = rdHigh;
 	auto& rn = rdLow;
 
-	if (BIT24(opcode)) {
-		// half word multiplication
-		if (!BIT7(opcode) || BIT4(opcode)) { return false; }
-		// TODO
-	} else if ((opcode & 0xf0) != 0x90) {
-		return false;
-	} else {
-		switch (operation) {
-			case 0: {
-				uint32_t result = getRegister(rm) * getRegister(rs);
-				LOG_STEP("MUL r%u = r%u * r%u = %08x\n", rd, rm, rs, result);
-				setRegister(rd, result);
-				if (updateFlags) {
-					_updateNZFlags(result);
-				}
-				return true;
+	switch (operation) {
+		case 0: {
+			uint32_t result = getRegister(rm) * getRegister(rs);
+			LOG_STEP("MUL r%u = r%u * r%u = %08x\n", rd, rm, rs, result);
+			setRegister(rd, result);
+			if (updateFlags) {
+				_updateNZFlags(result);
 			}
-			case 1: {
-				uint32_t result = getRegister(rm) * getRegister(rs) + getRegister(rn);
-				LOG_STEP("MLA r%u = r%u * r%u + r%u = %08x\n", rd, rm, rs, rn, result);
-				setRegister(rd, result);
-				if (updateFlags) {
-					_updateNZFlags(result);
-				}
-				return true;
+			return;
+		}
+		case 1: {
+			uint32_t result = getRegister(rm) * getRegister(rs) + getRegister(rn);
+			LOG_STEP("MLA r%u = r%u * r%u + r%u = %08x\n", rd, rm, rs, rn, result);
+			setRegister(rd, result);
+			if (updateFlags) {
+				_updateNZFlags(result);
 			}
-			case 4: {
-				uint64_t result = static_cast<uint64_t>(getRegister(rm)) * static_cast<uint64_t>(getRegister(rs));
-				LOG_STEP("UMULL r%u, r%u = r%u * r%u = %016llx\n", rdHigh, rdLow, rm, rs, result);
-				setRegister(rdHigh, static_cast<uint32_t>(result >> 32));
-				setRegister(rdLow, static_cast<uint32_t>(result));
-				if (updateFlags) {
-					setCPSRFlags(kPSRFlagZero, result == 0);
-					setCPSRFlags(kPSRFlagNegative, result & (1ll << 63));
-				}
-				return true;
+			return;
+		}
+		case 4: {
+			uint64_t result = static_cast<uint64_t>(getRegister(rm)) * static_cast<uint64_t>(getRegister(rs));
+			LOG_STEP("UMULL r%u, r%u = r%u * r%u = %016llx\n", rdHigh, rdLow, rm, rs, result);
+			setRegister(rdHigh, static_cast<uint32_t>(result >> 32));
+			setRegister(rdLow, static_cast<uint32_t>(result));
+			if (updateFlags) {
+				setCPSRFlags(kPSRFlagZero, result == 0);
+				setCPSRFlags(kPSRFlagNegative, result & (1ll << 63));
 			}
+			return;
 		}
 	}
 
-	return false;
+	_executeARMUndefined(opcode);
 }
 
-bool ARM7TDMI::_executeThumbALUOp(uint16_t opcode) {
-	if ((opcode & 0xfc00) != 0x4000) { return false; }
-
-	uint32_t op = BITFIELD_UINT32(opcode, 9, 6);
+template <uint32_t op>
+void ARM7TDMI::_executeThumbALUOp(uint16_t opcode) {
 	auto rs = BITFIELD_REGISTER(opcode, 5, 3);
 	auto rd = BITFIELD_REGISTER(opcode, 2, 0);
 
@@ -1045,105 +1970,101 @@ bool ARM7TDMI::_executeThumbALUOp(uint16_t opcode) {
 			auto result = _aluOperation(kALUOperationAND, getRegister(rd), getRegister(rs));
 			LOG_STEP("AND r%u = r%u & r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0x1: {
 			auto result = _aluOperation(kALUOperationEOR, getRegister(rd), getRegister(rs));
 			LOG_STEP("EOR r%u = r%u ^ r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0x2: {
 			auto result = _aluOperation(kALUOperationLSL, getRegister(rd), getRegister(rs));
 			LOG_STEP("LSL r%u = r%u lsl r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0x3: {
 			auto result = _aluOperation(kALUOperationLSR, getRegister(rd), getRegister(rs));
 			LOG_STEP("LSR r%u = r%u lsr r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0x4: {
 			auto result = _aluOperation(kALUOperationASR, getRegister(rd), getRegister(rs));
 			LOG_STEP("ASR r%u = r%u asr r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0x5: {
 			auto result = _aluOperation(kALUOperationADC, getRegister(rd), getRegister(rs));
 			LOG_STEP("ADC r%u = r%u + r%u + c = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0x6: {
 			auto result = _aluOperation(kALUOperationSBC, getRegister(rd), getRegister(rs));
 			LOG_STEP("SBC r%u = r%u - r%u + c - 1 = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0x7: {
 			auto result = _aluOperation(kALUOperationROR, getRegister(rd), getRegister(rs));
 			LOG_STEP("ROR r%u = r%u ror r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0x8:
 			LOG_STEP("TST r%u & r%u\n", rd, rs);
 			_aluOperation(kALUOperationAND, getRegister(rd), getRegister(rs));
-			return true;
+			return;
 		case 0x9: {
 			auto result = _aluOperation(kALUOperationSUB, 0, getRegister(rs));
 			LOG_STEP("NEG r%u = 0 - r%u = %08x\n", rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0xa:
 			LOG_STEP("CMP r%u - r%u\n", rd, rs);
 			_aluOperation(kALUOperationSUB, getRegister(rd), getRegister(rs));
-			return true;
+			return;
 		case 0xb:
 			LOG_STEP("CMN r%u + r%u\n", rd, rs);
 			_aluOperation(kALUOperationADD, getRegister(rd), getRegister(rs));
-			return true;
+			return;
 		case 0xc: {
 			auto result = _aluOperation(kALUOperationORR, getRegister(rd), getRegister(rs));
 			LOG_STEP("ORR r%u = r%u | r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0xd: {
 			auto result = _aluOperation(kALUOperationMUL, getRegister(rd), getRegister(rs));
 			LOG_STEP("MUL r%u = r%u * r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0xe: {
 			auto result = _aluOperation(kALUOperationBIC, getRegister(rd), getRegister(rs));
 			LOG_STEP("BIC r%u = r%u & ~r%u = %08x\n", rd, rd, rs, result);
 			setRegister(rd, result);
-			return true;
+			return;
 		}
 		case 0xf:
 			LOG_STEP("MVN r%u = ~r%u\n", rd, rs);
 			setRegister(rd, _aluOperation(kALUOperationMVN, getRegister(rs), 0));
-			return true;
+			return;
 	}
-
-	return false;
 }
 
-bool ARM7TDMI::_executeThumbHighRegisterOp(uint16_t opcode) {
-	if ((opcode & 0xfc00) != 0x4400) { return false; }
-		
+void ARM7TDMI::_executeThumbHighRegisterOp(uint16_t opcode) {
 	auto rs = static_cast<VirtualRegister>(BITFIELD_UINT32(opcode, 5, 3) | (BIT6(opcode) ? 0x8 : 0));
 	auto rd = static_cast<VirtualRegister>(BITFIELD_UINT32(opcode, 2, 0) | (BIT7(opcode) ? 0x8 : 0));
 
 	if (BIT9(opcode)) {
 		if (BIT8(opcode)) {
 			// BX or BLX
-			if (opcode & 0x7) { return false; }
+			if (opcode & 0x7) { return _executeThumbUndefined(opcode); }
 			uint32_t address = getRegister(rs);
 			bool switchToARM = !(address & 1);
 			if (switchToARM) {
@@ -1162,7 +2083,7 @@ bool ARM7TDMI::_executeThumbHighRegisterOp(uint16_t opcode) {
 				clearCPSRFlags(kPSRFlagThumb);
 			}
 		} else {
-			if (!BIT6(opcode) && !BIT7(opcode)) { return false; }
+			if (!BIT6(opcode) && !BIT7(opcode)) { return _executeThumbUndefined(opcode); }
 
 			// MOV
 			auto value = getRegister(rs);
@@ -1176,18 +2097,21 @@ bool ARM7TDMI::_executeThumbHighRegisterOp(uint16_t opcode) {
 		}
 	} else if (BIT8(opcode)) {
 		// CMP
-		if (!BIT6(opcode) && !BIT7(opcode)) { return false; }
+		if (!BIT6(opcode) && !BIT7(opcode)) { return _executeThumbUndefined(opcode); }
 		LOG_STEP("CMP r%u - r%u\n", rd, rs);
 		_aluOperation(kALUOperationSUB, getRegister(rd), getRegister(rs));
 	} else {
 		// ADD
-		if (!BIT6(opcode) && !BIT7(opcode)) { return false; }
+		if (!BIT6(opcode) && !BIT7(opcode)) { return _executeThumbUndefined(opcode); }
 		auto result = _aluOperation(kALUOperationADD, getRegister(rd), getRegister(rs), false);
 		LOG_STEP("ADD r%u = r%u + r%u = %08x\n", rd, rd, rs, result);
-		setRegister(rd, result);
+		if (rd == kVirtualRegisterPC) {
+			setRegister(rd, result & ~1);
+			_flushPipeline();
+		} else {
+			setRegister(rd, result);
+		}
 	}
-	
-	return true;
 }
 
 uint32_t ARM7TDMI::_aluOperation(ALUOperation op, uint32_t a, uint32_t b, bool updateFlags) {
@@ -1209,36 +2133,28 @@ uint32_t ARM7TDMI::_aluOperation(ALUOperation op, uint32_t a, uint32_t b, bool u
 		case kALUOperationSUB: {
 			uint32_t result = a - b;
 			if (updateFlags) {
-				setCPSRFlags(kPSRFlagCarry, result <= a);
-				setCPSRFlags(kPSRFlagOverflow, (a & 0x80000000) != (b & 0x80000000) && (a & 0x80000000) != (result & 0x80000000));
-				_updateNZFlags(result);
+				_setLazyFlags(kLazyCarrySubtract, a, b, result);
 			}
 			return result;
 		}
 		case kALUOperationSBC: {
 			uint32_t result = a - b - (getCPSRFlag(kPSRFlagCarry) ? 0 : 1);
 			if (updateFlags) {
-				setCPSRFlags(kPSRFlagCarry, result < a || (result == a && b != 0));
-				setCPSRFlags(kPSRFlagOverflow, (a & 0x80000000) != (b & 0x80000000) && (a & 0x80000000) != (result & 0x80000000));
-				_updateNZFlags(result);
+				_setLazyFlags(kLazyCarrySubtractWithCarry, a, b, result);
 			}
 			return result;
 		}
 		case kALUOperationADD: {
 			uint32_t result = a + b;
 			if (updateFlags) {
-				setCPSRFlags(kPSRFlagCarry, result < a);
-				setCPSRFlags(kPSRFlagOverflow, (a & 0x80000000) == (b & 0x80000000) && (a & 0x80000000) != (result & 0x80000000));
-				_updateNZFlags(result);
+				_setLazyFlags(kLazyCarryAdd, a, b, result);
 			}
 			return result;
 		}
 		case kALUOperationADC: {
 			uint32_t result = a + b + (getCPSRFlag(kPSRFlagCarry) ? 1 : 0);
 			if (updateFlags) {
-				setCPSRFlags(kPSRFlagCarry, result < a || (result == a && b != 0));
-				setCPSRFlags(kPSRFlagOverflow, (a & 0x80000000) == (b & 0x80000000) && (a & 0x80000000) != (result & 0x80000000));
-				_updateNZFlags(result);
+				_setLazyFlags(kLazyCarryAdd, a, b, result);
 			}
 			return result;
 		}
@@ -1275,8 +2191,8 @@ uint32_t ARM7TDMI::_aluOperation(ALUOperation op, uint32_t a, uint32_t b, bool u
 			bool carry = getCPSRFlag(kPSRFlagCarry);
 			uint32_t result = Shift(a, kShiftTypeROR, b, &carry);
 			if (updateFlags) {
-				_updateNZFlags(result);
 				setCPSRFlags(kPSRFlagCarry, carry);
+				_updateNZFlags(result);
 			}
 			return result;
 		}
@@ -1284,8 +2200,8 @@ uint32_t ARM7TDMI::_aluOperation(ALUOperation op, uint32_t a, uint32_t b, bool u
 			bool carry = getCPSRFlag(kPSRFlagCarry);
 			uint32_t result = Shift(a, kShiftTypeLSL, b, &carry);
 			if (updateFlags) {
-				_updateNZFlags(result);
 				setCPSRFlags(kPSRFlagCarry, carry);
+				_updateNZFlags(result);
 			}
 			return result;
 		}
@@ -1293,8 +2209,8 @@ uint32_t ARM7TDMI::_aluOperation(ALUOperation op, uint32_t a, uint32_t b, bool u
 			bool carry = getCPSRFlag(kPSRFlagCarry);
 			uint32_t result = Shift(a, kShiftTypeLSR, b, &carry);
 			if (updateFlags) {
-				_updateNZFlags(result);
 				setCPSRFlags(kPSRFlagCarry, carry);
+				_updateNZFlags(result);
 			}
 			return result;
 		}
@@ -1302,8 +2218,8 @@ uint32_t ARM7TDMI::_aluOperation(ALUOperation op, uint32_t a, uint32_t b, bool u
 			bool carry = getCPSRFlag(kPSRFlagCarry);
 			uint32_t result = Shift(a, kShiftTypeASR, b, &carry);
 			if (updateFlags) {
-				_updateNZFlags(result);
 				setCPSRFlags(kPSRFlagCarry, carry);
+				_updateNZFlags(result);
 			}
 			return result;
 		}
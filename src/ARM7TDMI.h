@@ -2,6 +2,12 @@
 
 #include "MMU.h"
 
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class ARM7TDMIRecompiler;
+
 class ARM7TDMI {
 	public:
 		enum VirtualRegister {
@@ -143,39 +149,136 @@ class ARM7TDMI {
 			kALUOperationSBC,
 		};
 		
+		enum ExecutionMode {
+			kExecutionModeInterpreter,
+			kExecutionModeCachedInterpreter,
+			kExecutionModeRecompiler,
+			kExecutionModeRecompilerLockstep,
+		};
+
 		struct UnknownInstruction {};
 		
 		ARM7TDMI();
+		~ARM7TDMI();
 		
-		void step();
+		/**
+		* Executes at least one instruction and returns the number executed.
+		*/
+		uint32_t step();
+
+		/**
+		* Executes instructions until cycleBudget cycles have been used, an interrupt is taken, or requestExit is
+		* called, and returns the number of cycles used. Instructions and recompiled blocks aren't split, so the result
+		* can go over the budget.
+		*/
+		uint32_t run(uint32_t cycleBudget);
+
+		/**
+		* Makes run return after the current instruction or block.
+		*/
+		void requestExit() { _isExitRequested = true; }
+
+		/**
+		* The total number of cycles executed, as estimated from the instruction cycle tables.
+		*/
+		uint64_t cycleCount() const { return _cycleCount; }
+
+		/**
+		* The cached interpreter and recompiler look for short loops that can't make progress until something outside
+		* the cpu changes memory, like a loop polling an IO register or a flag set by an interrupt handler. When one
+		* goes around, run returns early and isIdle returns true so the caller can skip ahead to the next event.
+		*/
+		bool isIdle() const { return _isIdle; }
+
+		void setIdleLoopDetectionEnabled(bool enabled);
+
+		/**
+		* Forces the loop that starts at the given address to be treated as idle or not, regardless of detection.
+		*/
+		void setIdleLoopOverride(uint32_t address, bool isIdleLoop);
+
+		/**
+		* The start addresses of the idle loops detected so far.
+		*/
+		const std::vector<uint32_t>& idleLoops() const { return _idleLoops; }
+
+		/**
+		* The cached interpreter decodes basic blocks once and replays them from a cache keyed by address and
+		* instruction set. Blocks are dropped when memory they were decoded from is written.
+		*
+		* The recompiler translates blocks that have run often enough into host code, and runs a whole block per step.
+		* In lockstep mode, every block is compiled and checked against the interpreter as it runs. Hosts that can't
+		* run generated code fall back to the cached interpreter.
+		*/
+		void setExecutionMode(ExecutionMode mode);
+		ExecutionMode executionMode() const { return _executionMode; }
 		
 		void reset();
 
 		void branch(uint32_t address);
 
+		/**
+		* Raises an IRQ if they're enabled. It's taken before the next instruction, and run returns first.
+		*/
 		void interrupt();
 
 		void setMode(Mode mode);
 
-		uint32_t getRegister(VirtualRegister r) const { return _physicalRegisters[_virtualRegisters[r]]; }
-		void setRegister(VirtualRegister r, uint32_t value) { _physicalRegisters[_virtualRegisters[r]] = value; }
+		uint32_t getRegister(VirtualRegister r) const { return r == kVirtualRegisterCPSR ? _cpsr() : _registers[r]; }
+		void setRegister(VirtualRegister r, uint32_t value) {
+			if (r == kVirtualRegisterCPSR) { _discardLazyFlags(); }
+			_registers[r] = value;
+		}
 
-		uint32_t getRegister(PhysicalRegister r) const { return _physicalRegisters[r]; }
-		void setRegister(PhysicalRegister r, uint32_t value) { _physicalRegisters[r] = value; }
+		/**
+		* Physical registers give access to every bank, regardless of the current mode.
+		*/
+		uint32_t getRegister(PhysicalRegister r) const {
+			auto v = PhysicalRegisterVirtualRegister(r);
+			return _virtualRegisters[v] == r ? getRegister(v) : _physicalRegisters[r];
+		}
 
-		bool getCPSRFlag(PSRFlag flag) const { return getRegister(kVirtualRegisterCPSR) & flag; }
+		void setRegister(PhysicalRegister r, uint32_t value) {
+			auto v = PhysicalRegisterVirtualRegister(r);
+			if (_virtualRegisters[v] == r) {
+				setRegister(v, value);
+			} else {
+				_physicalRegisters[r] = value;
+			}
+		}
+
+		bool getCPSRFlag(PSRFlag flag) const { return ((flag & kPSRMaskFlags) ? _cpsr() : _registers[kVirtualRegisterCPSR]) & flag; }
 		void setCPSRFlags(uint32_t flags, bool set = true);
 		void clearCPSRFlags(uint32_t flags) { setRegister(kVirtualRegisterCPSR, getRegister(kVirtualRegisterCPSR) & ~flags); }
 
 		MMU<uint32_t>& mmu() { return _mmu; }
+
+		/**
+		* Returns the value left on the bus by the most recent opcode fetch, which is what unmapped loads see.
+		*/
+		uint32_t openBusValue() const;
 		
 		bool checkCondition(Condition condition) const;
+		static bool CheckCondition(uint32_t cpsr, Condition condition);
 
 	private:	
+		friend class ARM7TDMIRecompiler;
+
+
 		MMU<uint32_t> _mmu;
+
+		/**
+		* The registers visible in the current mode live in _registers. Banked registers are swapped in and out of
+		* _physicalRegisters by _updateVirtualRegisters, which keeps _virtualRegisters as the current mapping. The entries
+		* of _physicalRegisters that are currently mapped are stale.
+		*/
+		uint32_t _registers[kVirtualRegisterCount]{0};
 		PhysicalRegister _virtualRegisters[kVirtualRegisterCount];
 		uint32_t _physicalRegisters[kPhysicalRegisterCount]{0};
 
+		static const VirtualRegister _physicalRegisterVirtualRegisters[kPhysicalRegisterCount];
+		static VirtualRegister PhysicalRegisterVirtualRegister(PhysicalRegister r) { return _physicalRegisterVirtualRegisters[r]; }
+
 		static const uint32_t kARMNOPCode = 0xe1a00000;
 
 		struct Instruction {
@@ -186,6 +289,46 @@ class ARM7TDMI {
 		Instruction _toDecode;
 		Instruction _toExecute;
 
+		enum LazyCarry : uint8_t {
+			kLazyCarryNone,
+			kLazyCarryAdd,
+			kLazyCarrySubtract,
+			kLazyCarrySubtractWithCarry,
+		};
+
+		/**
+		* Flag-setting operations record their result and operands here instead of updating CPSR. The stored CPSR's
+		* condition flags are stale while anything is pending, and the accessors above compute the real ones on demand.
+		*/
+		struct LazyFlags {
+			bool isNZPending = false;
+			uint32_t result = 0;
+
+			LazyCarry carry = kLazyCarryNone;
+			uint32_t a = 0;
+			uint32_t b = 0;
+			uint32_t sum = 0;
+		};
+
+		LazyFlags _lazyFlags;
+
+		uint32_t _cpsr() const {
+			auto cpsr = _registers[kVirtualRegisterCPSR];
+			if (_lazyFlags.isNZPending) {
+				cpsr = (cpsr & ~(kPSRFlagNegative | kPSRFlagZero)) | (_lazyFlags.result & kPSRFlagNegative) | (_lazyFlags.result ? 0 : kPSRFlagZero);
+			}
+			return _lazyFlags.carry == kLazyCarryNone ? cpsr : _resolveLazyCarry(cpsr);
+		}
+
+		uint32_t _resolveLazyCarry(uint32_t cpsr) const;
+		void _setLazyFlags(LazyCarry carry, uint32_t a, uint32_t b, uint32_t sum);
+		void _discardLazyFlags() { _lazyFlags.isNZPending = false; _lazyFlags.carry = kLazyCarryNone; }
+
+		/**
+		* Writes pending flags to the stored CPSR, for code that reads the register file directly.
+		*/
+		void _flushLazyFlags();
+
 		void _executeARM(uint32_t opcode);
 		void _executeThumb(uint16_t opcode);
 
@@ -196,20 +339,185 @@ class ARM7TDMI {
 
 		void _updateVirtualRegisters();
 
-		bool _getARMDataProcessingOp2(uint32_t opcode, uint32_t* op2);
+		uint32_t _getARMDataProcessingOp2(uint32_t opcode);
+
+		typedef void (ARM7TDMI::*ARMInstructionHandler)(uint32_t opcode);
+
+		/**
+		* ARM instructions are dispatched through a table indexed by opcode bits 27-20 and 7-4.
+		*/
+		static const size_t kARMInstructionHandlerCount = 0x1000;
+		static ARMInstructionHandler _armInstructionHandlers[kARMInstructionHandlerCount];
+		static bool _buildARMInstructionHandlers();
+		static uint32_t ARMInstructionHandlerIndex(uint32_t opcode) { return ((opcode >> 16) & 0xff0) | ((opcode >> 4) & 0xf); }
 
-		bool _executeARMDataProcessing(uint32_t opcode);
-		bool _executeARMDataTransfer(uint32_t opcode);
-		bool _executeARMBlockTransfer(uint32_t opcode);
-		bool _executeARMMultiplication(uint32_t opcode);
+		/**
+		* Cycle costs are indexed the same way as the handlers. They assume no wait states, taken branches, and the
+		* fastest multiplier timing.
+		*/
+		static uint8_t _armInstructionCycles[kARMInstructionHandlerCount];
+		static uint32_t ARMInstructionCycles(uint32_t opcode);
+
+		void _executeARMUndefined(uint32_t opcode);
+		void _executeARMSoftwareInterrupt(uint32_t opcode);
+		void _executeARMBranch(uint32_t opcode);
+		void _executeARMBranchAndExchange(uint32_t opcode);
+		void _executeARMPSRTransfer(uint32_t opcode);
+		void _executeARMDataProcessing(uint32_t opcode);
+		void _executeARMSingleDataTransfer(uint32_t opcode);
+		void _executeARMHalfwordDataTransfer(uint32_t opcode);
+		void _executeARMBlockTransfer(uint32_t opcode);
+		void _executeARMMultiplication(uint32_t opcode);
 		
-		bool _executeThumbALUOp(uint16_t opcode);
-		bool _executeThumbHighRegisterOp(uint16_t opcode);
+		typedef void (ARM7TDMI::*ThumbInstructionHandler)(uint16_t opcode);
+
+		/**
+		* Thumb instructions are dispatched through a table indexed by opcode bits 15-6.
+		*/
+		static const size_t kThumbInstructionHandlerCount = 0x400;
+		static ThumbInstructionHandler _thumbInstructionHandlers[kThumbInstructionHandlerCount];
+		static bool _buildThumbInstructionHandlers();
+		static uint32_t ThumbInstructionHandlerIndex(uint16_t opcode) { return opcode >> 6; }
+
+		static uint8_t _thumbInstructionCycles[kThumbInstructionHandlerCount];
+		static uint32_t ThumbInstructionCycles(uint16_t opcode);
+
+		void _executeThumbUndefined(uint16_t opcode);
+		void _executeThumbMoveShiftedRegister(uint16_t opcode);
+		void _executeThumbAddSubtract(uint16_t opcode);
+		void _executeThumbMoveImmediate(uint16_t opcode);
+		void _executeThumbCompareImmediate(uint16_t opcode);
+		void _executeThumbAddImmediate(uint16_t opcode);
+		void _executeThumbSubtractImmediate(uint16_t opcode);
+		template <uint32_t op> void _executeThumbALUOp(uint16_t opcode);
+		void _executeThumbHighRegisterOp(uint16_t opcode);
+		void _executeThumbLoadPCRelative(uint16_t opcode);
+		template <uint32_t operation> void _executeThumbLoadStoreRegisterOffset(uint16_t opcode);
+		void _executeThumbLoadStoreImmediateOffset(uint16_t opcode);
+		void _executeThumbLoadStoreHalfword(uint16_t opcode);
+		void _executeThumbLoadStoreSPRelative(uint16_t opcode);
+		void _executeThumbLoadAddress(uint16_t opcode);
+		void _executeThumbAddOffsetToSP(uint16_t opcode);
+		void _executeThumbPushPop(uint16_t opcode);
+		void _executeThumbBlockTransfer(uint16_t opcode);
+		template <Condition condition> void _executeThumbConditionalBranch(uint16_t opcode);
+		void _executeThumbSoftwareInterrupt(uint16_t opcode);
+		void _executeThumbBranch(uint16_t opcode);
+		void _executeThumbLongBranchFirstHalf(uint16_t opcode);
+		void _executeThumbLongBranchSecondHalf(uint16_t opcode);
+		void _executeThumbLongBranchExchangeSecondHalf(uint16_t opcode);
+
+		ExecutionMode _executionMode = kExecutionModeInterpreter;
+
+		struct CachedInstruction {
+			union {
+				ARMInstructionHandler arm;
+				ThumbInstructionHandler thumb;
+			} handler;
+			uint32_t opcode;
+			Condition condition;
+			uint8_t cycles;
+		};
+
+		struct CachedBlock {
+			uint32_t address = 0;
+			bool isThumb = false;
+			std::vector<CachedInstruction> instructions;
+
+			uint32_t executionCount = 0;
+			const void* recompiledCode = nullptr;
+
+			bool isIdleLoop = false;
+		};
+
+		static const size_t kMaxCachedBlockLength = 64;
+		static const uint32_t kRecompileThreshold = 16;
+
+		std::unordered_map<uint64_t, CachedBlock> _blockCache;
+		std::unordered_map<uint32_t, std::vector<uint64_t>> _blockCachePages;
+		uint32_t _blockCacheGeneration = 0;
+
+		/**
+		* A direct-mapped cache of recently used blocks in front of _blockCache. Entries from an earlier generation may
+		* point at blocks that have since been invalidated, so they're ignored.
+		*/
+		struct BlockLookupEntry {
+			uint64_t key;
+			CachedBlock* block;
+			uint32_t generation;
+		};
+
+		static const size_t kBlockLookupSize = 0x1000;
+		BlockLookupEntry _blockLookup[kBlockLookupSize] = {};
+
+		const CachedBlock* _currentBlock = nullptr;
+		size_t _currentBlockIndex = 0;
+		uint32_t _currentBlockGeneration = 0;
+
+		std::unique_ptr<ARM7TDMIRecompiler> _recompiler;
+
+		uint64_t _cycleCount = 0;
+		bool _isExitRequested = false;
+		bool _isInterruptPending = false;
+
+		void _takeInterrupt();
+
+		static const size_t kMaxIdleLoopLength = 8;
+
+		bool _isIdle = false;
+		bool _isIdleLoopDetectionEnabled = true;
+		std::unordered_map<uint32_t, bool> _idleLoopOverrides;
+		std::vector<uint32_t> _idleLoops;
+
+		void _beginIdling();
+
+		/**
+		* Gets the registers and flags an instruction depends on and writes as masks, with registers in the low bits and
+		* flags above them. Returns false for instructions that can't be part of an idle loop.
+		*/
+		static bool ARMInstructionDependencies(uint32_t opcode, uint32_t* reads, uint32_t* writes);
+		static bool ThumbInstructionDependencies(uint16_t opcode, uint32_t* reads, uint32_t* writes);
+		static bool IsIdleLoop(const CachedBlock& block);
+
+		void _stepInterpreter();
+		void _stepCached();
+
+		/**
+		* Runs the current block from the next instruction until it ends or branches, the block is invalidated, exit is
+		* requested, or the cycle count reaches endCycle. At least one instruction is always run. Returns the number of
+		* instructions run.
+		*/
+		uint32_t _runCached(uint64_t endCycle);
+		uint32_t _stepRecompiled();
+		uint32_t _nextInstructionAddress() const;
+		bool _isInCurrentBlock(uint32_t address, bool isThumb) const;
+		CachedBlock& _cachedBlock(uint32_t address, bool isThumb);
+		std::vector<uint32_t> _blockPages(const CachedBlock& block);
+		void _invalidateBlockCache(uint32_t address, uint32_t size);
+		void _clearBlockCache();
+
+		static bool IsARMBlockTerminator(uint32_t opcode);
+		static bool IsThumbBlockTerminator(uint16_t opcode);
 		
 		uint32_t _aluOperation(ALUOperation op, uint32_t a, uint32_t b, bool updateFlags = true);
 
 		PhysicalRegister _physicalRegister(VirtualRegister r, bool forceUserMode = false) const;
 
+		/**
+		* Accesses a register as seen by the current mode, or as seen by user mode if forceUserMode is set.
+		*/
+		uint32_t _getRegister(VirtualRegister r, bool forceUserMode) const {
+			return forceUserMode ? getRegister(_physicalRegister(r, true)) : getRegister(r);
+		}
+
+		void _setRegister(VirtualRegister r, uint32_t value, bool forceUserMode) {
+			if (forceUserMode) {
+				setRegister(_physicalRegister(r, true), value);
+			} else {
+				setRegister(r, value);
+			}
+		}
+
 		static VirtualRegister ARMRn(uint32_t opcode);
 		static VirtualRegister ARMRd(uint32_t opcode);
 		static VirtualRegister ARMRs(uint32_t opcode);
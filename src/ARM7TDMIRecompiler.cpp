@@ -0,0 +1,1501 @@
+#include "ARM7TDMIRecompiler.h"
+
+#include "BIT_MACROS.h"
+#include "FixedEndian.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#if !defined(__APPLE__)
+#include <ucontext.h>
+#endif
+#define ARM7TDMI_RECOMPILER_SUPPORTED 1
+#else
+#define ARM7TDMI_RECOMPILER_SUPPORTED 0
+#endif
+
+typedef X86Assembler X86;
+
+namespace {
+	const size_t kCodeBufferSize = 32 * 1024 * 1024;
+
+	const X86::Register kCacheRegisters[] = { X86::kRBX, X86::kRBP, X86::kR12, X86::kR13 };
+	const size_t kCacheRegisterCount = sizeof(kCacheRegisters) / sizeof(*kCacheRegisters);
+
+	// while a block runs, r15 points to the physical registers and r14 points to the context
+	const X86::Register kRegisterFile = X86::kR15;
+	const X86::Register kContext = X86::kR14;
+
+	// fastmem accesses are padded to at least this many bytes so that they can be replaced by a jmp rel32
+	const size_t kFastmemPatchSize = 5;
+
+	struct sigaction gPreviousSIGSEGVAction;
+	struct sigaction gPreviousSIGBUSAction;
+}
+
+thread_local ARM7TDMIRecompiler* ARM7TDMIRecompiler::_runningRecompiler = nullptr;
+
+ARM7TDMIRecompiler::ARM7TDMIRecompiler(ARM7TDMI* cpu) : _cpu(cpu), _context(new Context()) {
+	static_assert(sizeof(Region) == 16, "generated code assumes 16 byte regions");
+
+	_context->watchedPages = cpu->mmu().watchedPages();
+	_context->recompiler = this;
+
+	for (uint32_t flags = 0; flags < 16; ++flags) {
+		for (uint32_t condition = 0; condition < 16; ++condition) {
+			if (ARM7TDMI::CheckCondition(flags << 28, static_cast<ARM7TDMI::Condition>(condition))) {
+				_context->conditionTable[flags] |= (1 << condition);
+			}
+		}
+	}
+
+#if ARM7TDMI_RECOMPILER_SUPPORTED
+	auto buffer = mmap(nullptr, kCodeBufferSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer != MAP_FAILED) {
+		_codeBuffer = reinterpret_cast<uint8_t*>(buffer);
+		_codeBufferSize = kCodeBufferSize;
+	}
+#endif
+}
+
+ARM7TDMIRecompiler::~ARM7TDMIRecompiler() {
+#if ARM7TDMI_RECOMPILER_SUPPORTED
+	if (_codeBuffer) {
+		munmap(_codeBuffer, _codeBufferSize);
+	}
+#endif
+}
+
+void ARM7TDMIRecompiler::clear() {
+	_codeBufferUsed = 0;
+	_fallbackInstructions.clear();
+	_fastmemSlowPaths.clear();
+}
+
+const void* ARM7TDMIRecompiler::compile(const ARM7TDMI::CachedBlock& block) {
+	if (!_codeBuffer) { return nullptr; }
+
+	// lockstep mode needs every store to go through the region checks so that it can log them
+	_isFastmem = !_isLockstep && _cpu->mmu().fastmemBase();
+	if (_isFastmem) {
+		static std::once_flag faultHandlerFlag;
+		std::call_once(faultHandlerFlag, InstallFaultHandler);
+	}
+
+	// the first pass counts register uses so that the second can keep the busiest registers in host registers
+	std::fill(std::begin(_hostRegisters), std::end(_hostRegisters), X86::kRegisterNone);
+	std::fill(std::begin(_registerUses), std::end(_registerUses), 0);
+	auto fallbackCount = _fallbackInstructions.size();
+	_compile(block);
+	_fallbackInstructions.resize(fallbackCount);
+
+	for (size_t i = 0; i < kCacheRegisterCount; ++i) {
+		int busiest = -1;
+		for (int r = 0; r < ARM7TDMI::kVirtualRegisterCount; ++r) {
+			if (r == ARM7TDMI::kVirtualRegisterPC || r == ARM7TDMI::kVirtualRegisterCPSR || _hostRegisters[r] != X86::kRegisterNone) { continue; }
+			if (_registerUses[r] > 1 && (busiest < 0 || _registerUses[r] > _registerUses[busiest])) {
+				busiest = r;
+			}
+		}
+		if (busiest < 0) { break; }
+		_hostRegisters[busiest] = kCacheRegisters[i];
+	}
+
+	_compile(block);
+
+	auto& code = _assembler->code();
+	if (_codeBufferUsed + code.size() > _codeBufferSize) {
+		return nullptr;
+	}
+
+	auto ret = _codeBuffer + _codeBufferUsed;
+	memcpy(ret, code.data(), code.size());
+	_codeBufferUsed += (code.size() + 15) & ~15;
+
+	for (auto& access : _fastmemAccesses) {
+		_fastmemSlowPaths[ret + access.position] = ret + access.slowPath->position;
+	}
+
+	return ret;
+}
+
+uint32_t ARM7TDMIRecompiler::execute(const void* code) {
+	if (_isLockstep) {
+		return _executeLockstep(code);
+	}
+
+	ExitReason reason;
+	auto count = _execute(code, &reason);
+	if (reason == kExitReasonInterpret) {
+		_interpret(1);
+		++count;
+	}
+	return count;
+}
+
+uint32_t ARM7TDMIRecompiler::_execute(const void* code, ExitReason* reason) {
+	if (_regionGeneration != _cpu->mmu().attachmentGeneration()) {
+		_updateRegions();
+	}
+
+	_context->exitRequested = 0;
+
+	auto previousRecompiler = _runningRecompiler;
+	_runningRecompiler = this;
+	auto result = reinterpret_cast<BlockFunction>(const_cast<void*>(code))(_cpu->_registers, _context.get());
+	_runningRecompiler = previousRecompiler;
+
+	*reason = static_cast<ExitReason>(result >> 32);
+
+	switch (*reason) {
+		case kExitReasonContinue:
+		case kExitReasonInterpret:
+			_cpu->_toExecute.isValid = _cpu->_toDecode.isValid = true;
+			break;
+		case kExitReasonBranch:
+			_cpu->_flushPipeline();
+			break;
+		case kExitReasonKeepState:
+			break;
+		case kExitReasonException: {
+			auto exception = _exception;
+			_exception = nullptr;
+			std::rethrow_exception(exception);
+		}
+	}
+
+	return static_cast<uint32_t>(result);
+}
+
+uint32_t ARM7TDMIRecompiler::_executeLockstep(const void* code) {
+	// run the block, undo its stores, then run the interpreter over the same instructions and compare
+	uint32_t registers[ARM7TDMI::kVirtualRegisterCount];
+	uint32_t physicalRegisters[ARM7TDMI::kPhysicalRegisterCount];
+	ARM7TDMI::PhysicalRegister virtualRegisters[ARM7TDMI::kVirtualRegisterCount];
+	memcpy(registers, _cpu->_registers, sizeof(registers));
+	memcpy(physicalRegisters, _cpu->_physicalRegisters, sizeof(physicalRegisters));
+	memcpy(virtualRegisters, _cpu->_virtualRegisters, sizeof(virtualRegisters));
+	auto toExecute = _cpu->_toExecute;
+	auto toDecode = _cpu->_toDecode;
+	auto address = _cpu->_nextInstructionAddress();
+	bool isThumb = _cpu->getCPSRFlag(ARM7TDMI::kPSRFlagThumb);
+
+	_storeLog.clear();
+
+	ExitReason reason;
+	auto count = _execute(code, &reason);
+
+	uint32_t recompiledRegisters[ARM7TDMI::kPhysicalRegisterCount];
+	for (int i = 0; i < ARM7TDMI::kPhysicalRegisterCount; ++i) {
+		recompiledRegisters[i] = _cpu->getRegister(static_cast<ARM7TDMI::PhysicalRegister>(i));
+	}
+	auto recompiledNextAddress = _cpu->_nextInstructionAddress();
+
+	for (auto& store : _storeLog) {
+		_cpu->mmu().load(&store.newValue, store.address, store.size);
+	}
+
+	for (auto it = _storeLog.rbegin(); it != _storeLog.rend(); ++it) {
+		_cpu->mmu().store(it->address, &it->oldValue, it->size);
+	}
+
+	memcpy(_cpu->_registers, registers, sizeof(registers));
+	memcpy(_cpu->_physicalRegisters, physicalRegisters, sizeof(physicalRegisters));
+	memcpy(_cpu->_virtualRegisters, virtualRegisters, sizeof(virtualRegisters));
+	_cpu->_toExecute = toExecute;
+	_cpu->_toDecode = toDecode;
+
+	_interpret(count);
+	_cpu->_flushLazyFlags();
+
+	bool isMismatched = false;
+
+	for (int i = 0; i < ARM7TDMI::kPhysicalRegisterCount; ++i) {
+		// pc depends on the pipeline state, so it's compared below by way of the next instruction's address
+		auto expected = _cpu->getRegister(static_cast<ARM7TDMI::PhysicalRegister>(i));
+		if (i != ARM7TDMI::kPhysicalRegisterPC && recompiledRegisters[i] != expected) {
+			printf("lockstep: register %d is %08x, expected %08x\n", i, recompiledRegisters[i], expected);
+			isMismatched = true;
+		}
+	}
+
+	if (recompiledNextAddress != _cpu->_nextInstructionAddress()) {
+		printf("lockstep: next instruction is at %08x, expected %08x\n", recompiledNextAddress, _cpu->_nextInstructionAddress());
+		isMismatched = true;
+	}
+
+	for (auto& store : _storeLog) {
+		uint32_t value = 0;
+		_cpu->mmu().load(&value, store.address, store.size);
+		if (value != store.newValue) {
+			printf("lockstep: %u byte(s) at %08x are %08x, expected %08x\n", store.size, store.address, store.newValue, value);
+			isMismatched = true;
+		}
+	}
+
+	if (isMismatched) {
+		printf("lockstep: mismatch after %u instruction(s) of the %s block at %08x\n", count, isThumb ? "thumb" : "arm", address);
+		throw LockstepMismatch();
+	}
+
+	if (reason == kExitReasonInterpret) {
+		_interpret(1);
+		++count;
+	}
+
+	return count;
+}
+
+void ARM7TDMIRecompiler::_interpret(uint32_t count) {
+	// the cpu adds the cycles for every instruction execute returns, including these
+	auto cycleCount = _cpu->_cycleCount;
+	for (uint32_t i = 0; i < count; ++i) {
+		_cpu->_stepCached();
+	}
+	_cpu->_cycleCount = cycleCount;
+}
+
+void ARM7TDMIRecompiler::_updateRegions() {
+	memset(_context->loadRegions, 0, sizeof(_context->loadRegions));
+	memset(_context->storeRegions, 0, sizeof(_context->storeRegions));
+
+	for (auto& region : _cpu->mmu().directRegions()) {
+		if (!region.size) { continue; }
+
+		Region entry;
+		entry.base = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(region.storage) - region.address);
+		entry.start = region.address;
+		entry.length = region.size;
+
+		uint64_t end = static_cast<uint64_t>(region.address) + region.size;
+
+		for (uint64_t i = region.address >> kRegionShift; i <= (end - 1) >> kRegionShift; ++i) {
+			// only one region per entry. anything else sharing the entry takes the slow path
+			if (!_context->loadRegions[i].length) {
+				_context->loadRegions[i] = entry;
+			}
+			if (region.isWritable && !_context->storeRegions[i].length) {
+				_context->storeRegions[i] = entry;
+			}
+		}
+	}
+
+	_context->fastmemBase = _cpu->mmu().fastmemBase();
+	_regionGeneration = _cpu->mmu().attachmentGeneration();
+}
+
+void ARM7TDMIRecompiler::_compile(const ARM7TDMI::CachedBlock& block) {
+	_assembler.reset(new X86Assembler());
+	_exits.clear();
+	_slowPaths.clear();
+	_labels.clear();
+	_fastmemAccesses.clear();
+	_isThumb = block.isThumb;
+
+	auto& epilogue = _newLabel();
+	_epilogue = &epilogue;
+
+	_emitPrologue();
+
+	for (size_t i = 0; i < block.instructions.size(); ++i) {
+		_index = static_cast<uint32_t>(i);
+		_address = block.address + _index * _width();
+		_compileInstruction(block.instructions[i]);
+	}
+
+	// fell off the end of the block
+	_index = static_cast<uint32_t>(block.instructions.size());
+	_address = block.address + _index * _width();
+	_assembler->jmp(_exit(_index, kExitReasonContinue, _pc()));
+
+	for (auto& slowPath : _slowPaths) {
+		_assembler->bind(slowPath.label);
+
+		// scratch registers r8-r11 may be live across memory accesses
+		_assembler->push(X86::kR8);
+		_assembler->push(X86::kR9);
+		_assembler->push(X86::kR10);
+		_assembler->push(X86::kR11);
+
+		if (slowPath.isStore) {
+			_assembler->mov(X86::kRDX, X86::kRDI);
+			_assembler->mov(X86::kRCX, slowPath.size);
+			_assembler->mov64(X86::kRDI, kContext);
+			_emitCall(reinterpret_cast<const void*>(&StoreSlow));
+		} else {
+			_assembler->mov(X86::kRDX, slowPath.size | (slowPath.isSigned ? 0x100 : 0));
+			_assembler->mov64(X86::kRDI, kContext);
+			_emitCall(reinterpret_cast<const void*>(&LoadSlow));
+		}
+
+		_assembler->pop(X86::kR11);
+		_assembler->pop(X86::kR10);
+		_assembler->pop(X86::kR9);
+		_assembler->pop(X86::kR8);
+
+		if (slowPath.isStore) {
+			_assembler->test(X86::kRAX, X86::kRAX);
+			_assembler->jcc(X86::kConditionNotZero, *slowPath.fault);
+		} else {
+			_assembler->bt64(X86::kRAX, 32);
+			_assembler->jcc(X86::kConditionCarry, *slowPath.fault);
+		}
+
+		_assembler->jmp(*slowPath.resume);
+	}
+
+	for (auto& exit : _exits) {
+		_assembler->bind(exit.label);
+		if (exit.hasPC) {
+			_assembler->mov(_registerAddress(ARM7TDMI::kVirtualRegisterPC), exit.pc);
+		}
+		if (exit.hasDynamicReason) {
+			_assembler->mov(X86::kRDX, X86::kRAX);
+		} else {
+			_assembler->mov(X86::kRDX, static_cast<uint32_t>(exit.reason));
+		}
+		_assembler->mov(X86::kRAX, exit.count);
+		_assembler->jmp(epilogue);
+	}
+
+	_emitEpilogue(epilogue);
+}
+
+void ARM7TDMIRecompiler::_compileInstruction(const ARM7TDMI::CachedInstruction& instruction) {
+	_fault = nullptr;
+	_hasStore = false;
+
+	auto& next = _newLabel();
+
+	if (!_isThumb && instruction.condition != ARM7TDMI::kConditionAlways) {
+		_emitConditionCheck(instruction.condition, next);
+	}
+
+	bool isCompiled = _isThumb ? _compileThumb(static_cast<uint16_t>(instruction.opcode), instruction.handler.thumb) : _compileARM(instruction.opcode, instruction.handler.arm);
+	if (!isCompiled) {
+		_compileFallback(instruction);
+	}
+
+	if (_hasStore) {
+		// stores that took the slow path may have hit io or code, so give control back to the cpu
+		_assembler->cmp8(X86::Address(kContext, static_cast<int32_t>(offsetof(Context, exitRequested))), 0);
+		_assembler->jcc(X86::kConditionNotZero, _exit(_index + 1, kExitReasonContinue, _pc() + _width()));
+	}
+
+	_assembler->bind(next);
+}
+
+void ARM7TDMIRecompiler::_compileFallback(const ARM7TDMI::CachedInstruction& instruction) {
+	if (_isLockstep) {
+		// lockstep only checks generated code, so let the interpreter run this between blocks
+		_assembler->jmp(_exit(_index, kExitReasonInterpret, _pc()));
+		return;
+	}
+
+	_fallbackInstructions.push_back(instruction);
+
+	_spillRegisters();
+	_assembler->mov64(X86::kRDI, kContext);
+	_assembler->mov64(X86::kRSI, reinterpret_cast<uint64_t>(&_fallbackInstructions.back()));
+	_assembler->mov(X86::kRDX, _address);
+	_emitCall(reinterpret_cast<const void*>(&ExecuteFallback));
+	_reloadRegisters();
+
+	_assembler->test(X86::kRAX, X86::kRAX);
+	_assembler->jcc(X86::kConditionNotZero, _dynamicExit(_index + 1));
+}
+
+bool ARM7TDMIRecompiler::_compileARM(uint32_t opcode, ARM7TDMI::ARMInstructionHandler handler) {
+	if (handler == &ARM7TDMI::_executeARMDataProcessing) {
+		return _compileARMDataProcessing(opcode);
+	} else if (handler == &ARM7TDMI::_executeARMSingleDataTransfer) {
+		return _compileARMSingleDataTransfer(opcode);
+	} else if (handler == &ARM7TDMI::_executeARMHalfwordDataTransfer) {
+		return _compileARMHalfwordDataTransfer(opcode);
+	} else if (handler == &ARM7TDMI::_executeARMMultiplication) {
+		return _compileARMMultiplication(opcode);
+	} else if (handler == &ARM7TDMI::_executeARMBranch) {
+		return _compileARMBranch(opcode);
+	}
+	return false;
+}
+
+bool ARM7TDMIRecompiler::_compileARMDataProcessing(uint32_t opcode) {
+	uint32_t operation = BITFIELD_UINT32(opcode, 24, 21);
+	bool updateFlags = BIT20(opcode);
+	auto rd = ARM7TDMI::ARMRd(opcode);
+	auto rn = ARM7TDMI::ARMRn(opcode);
+
+	bool isTest = operation >= 0x8 && operation <= 0xb;
+	bool isLogical = operation <= 0x1 || operation == 0x8 || operation == 0x9 || operation >= 0xc;
+
+	if (rd == ARM7TDMI::kVirtualRegisterPC) { return false; }
+	if (isTest && rd != ARM7TDMI::kVirtualRegisterR0) { return false; }
+
+	// the interpreter's carry out of SBC and RSC doesn't match the host's
+	if (updateFlags && (operation == 0x6 || operation == 0x7)) { return false; }
+
+	if (BIT25(opcode)) {
+		uint32_t n = opcode & 0xff;
+		uint32_t rotation = BITFIELD_UINT32(opcode, 11, 8) << 1;
+		_assembler->mov(X86::kRDI, ARM7TDMI::Shift(n, ARM7TDMI::kShiftTypeROR, rotation));
+	} else {
+		// register shifts and RRX aren't worth translating
+		if (BIT4(opcode)) { return false; }
+
+		auto shiftType = static_cast<ARM7TDMI::ShiftType>(BITFIELD_UINT32(opcode, 6, 5));
+		uint32_t shift = BITFIELD_UINT32(opcode, 11, 7);
+
+		if (shiftType == ARM7TDMI::kShiftTypeROR && !shift) { return false; }
+
+		// the shifter's carry is visible to ADC, and arithmetic operations overwrite it afterwards
+		_loadRegister(X86::kRDI, ARM7TDMI::ARMRm(opcode));
+		_emitShiftByImmediate(X86::kRDI, shiftType, shift, updateFlags);
+	}
+
+	if (operation != 0xd && operation != 0xf) {
+		_loadRegister(X86::kRSI, rn);
+	}
+
+	switch (operation) {
+		case 0x0:
+		case 0x8:
+			_assembler->alu(X86::kALUOperationAND, X86::kRSI, X86::kRDI);
+			break;
+		case 0x1:
+		case 0x9:
+			_assembler->alu(X86::kALUOperationXOR, X86::kRSI, X86::kRDI);
+			break;
+		case 0x2:
+		case 0xa:
+			_assembler->alu(X86::kALUOperationSUB, X86::kRSI, X86::kRDI);
+			break;
+		case 0x3:
+			_assembler->alu(X86::kALUOperationSUB, X86::kRDI, X86::kRSI);
+			_assembler->mov(X86::kRSI, X86::kRDI);
+			break;
+		case 0x4:
+		case 0xb:
+			_assembler->alu(X86::kALUOperationADD, X86::kRSI, X86::kRDI);
+			break;
+		case 0x5:
+			_assembler->bt(_cpsrAddress(), 29);
+			_assembler->alu(X86::kALUOperationADC, X86::kRSI, X86::kRDI);
+			break;
+		case 0x6:
+			_assembler->bt(_cpsrAddress(), 29);
+			_assembler->cmc();
+			_assembler->alu(X86::kALUOperationSBB, X86::kRSI, X86::kRDI);
+			break;
+		case 0x7:
+			_assembler->bt(_cpsrAddress(), 29);
+			_assembler->cmc();
+			_assembler->alu(X86::kALUOperationSBB, X86::kRDI, X86::kRSI);
+			_assembler->mov(X86::kRSI, X86::kRDI);
+			break;
+		case 0xc:
+			_assembler->alu(X86::kALUOperationOR, X86::kRSI, X86::kRDI);
+			break;
+		case 0xd:
+			_assembler->mov(X86::kRSI, X86::kRDI);
+			break;
+		case 0xe:
+			_assembler->not_(X86::kRDI);
+			_assembler->alu(X86::kALUOperationAND, X86::kRSI, X86::kRDI);
+			break;
+		case 0xf:
+			_assembler->not_(X86::kRDI);
+			_assembler->mov(X86::kRSI, X86::kRDI);
+			break;
+	}
+
+	if (!isTest) {
+		_storeRegister(rd, X86::kRSI);
+	}
+
+	if (updateFlags) {
+		if (isLogical) {
+			_emitUpdateNZ(X86::kRSI);
+		} else {
+			_emitUpdateNZCV(operation == 0x2 || operation == 0x3 || operation == 0xa);
+		}
+	}
+
+	return true;
+}
+
+bool ARM7TDMIRecompiler::_compileARMSingleDataTransfer(uint32_t opcode) {
+	auto rd = ARM7TDMI::ARMRd(opcode);
+	auto rn = ARM7TDMI::ARMRn(opcode);
+	bool isWriteback = !BIT24(opcode) || BIT21(opcode);
+
+	if (rd == ARM7TDMI::kVirtualRegisterPC) { return false; }
+	if (rn == ARM7TDMI::kVirtualRegisterPC && isWriteback) { return false; }
+
+	// the user mode registers of LDRT and STRT may be banked out
+	if (!BIT24(opcode) && BIT21(opcode)) { return false; }
+
+	_loadRegister(X86::kRSI, rn);
+	_assembler->mov(X86::kR8, X86::kRSI);
+
+	if (BIT25(opcode)) {
+		auto shiftType = static_cast<ARM7TDMI::ShiftType>(BITFIELD_UINT32(opcode, 6, 5));
+		uint32_t shift = BITFIELD_UINT32(opcode, 11, 7);
+		if (shiftType == ARM7TDMI::kShiftTypeROR && !shift) { return false; }
+		_loadRegister(X86::kRDI, ARM7TDMI::ARMRm(opcode));
+		_emitShiftByImmediate(X86::kRDI, shiftType, shift, false);
+		_assembler->alu(BIT23(opcode) ? X86::kALUOperationADD : X86::kALUOperationSUB, X86::kR8, X86::kRDI);
+	} else if (uint32_t offset = BITFIELD_UINT32(opcode, 11, 0)) {
+		_assembler->alu(BIT23(opcode) ? X86::kALUOperationADD : X86::kALUOperationSUB, X86::kR8, offset);
+	}
+
+	if (BIT24(opcode)) {
+		_assembler->mov(X86::kRSI, X86::kR8);
+	}
+
+	if (BIT20(opcode)) {
+		_emitLoad(BIT22(opcode) ? 1 : 4, false);
+		if (isWriteback) {
+			_storeRegister(rn, X86::kR8);
+		}
+		_storeRegister(rd, X86::kRAX);
+	} else {
+		// the interpreter writes back before reading the register to store
+		if (isWriteback && rd == rn) {
+			_assembler->mov(X86::kRDI, X86::kR8);
+		} else {
+			_loadRegister(X86::kRDI, rd);
+		}
+		_emitStore(BIT22(opcode) ? 1 : 4);
+		if (isWriteback) {
+			_storeRegister(rn, X86::kR8);
+		}
+	}
+
+	return true;
+}
+
+bool ARM7TDMIRecompiler::_compileARMHalfwordDataTransfer(uint32_t opcode) {
+	auto rd = ARM7TDMI::ARMRd(opcode);
+	auto rn = ARM7TDMI::ARMRn(opcode);
+	bool isWriteback = !BIT24(opcode) || BIT21(opcode);
+
+	if (!BIT24(opcode) && BIT21(opcode)) { return false; }
+	if (!BIT22(opcode) && BITFIELD_UINT32(opcode, 11, 8)) { return false; }
+	if (!BIT20(opcode) && BIT6(opcode)) { return false; }
+	if (rd == ARM7TDMI::kVirtualRegisterPC) { return false; }
+	if (rn == ARM7TDMI::kVirtualRegisterPC && isWriteback) { return false; }
+
+	_loadRegister(X86::kRSI, rn);
+	_assembler->mov(X86::kR8, X86::kRSI);
+
+	if (BIT22(opcode)) {
+		if (uint32_t offset = (BITFIELD_UINT32(opcode, 11, 8) << 4) | BITFIELD_UINT32(opcode, 3, 0)) {
+			_assembler->alu(BIT23(opcode) ? X86::kALUOperationADD : X86::kALUOperationSUB, X86::kR8, offset);
+		}
+	} else {
+		_loadRegister(X86::kRDI, ARM7TDMI::ARMRm(opcode));
+		_assembler->alu(BIT23(opcode) ? X86::kALUOperationADD : X86::kALUOperationSUB, X86::kR8, X86::kRDI);
+	}
+
+	if (BIT24(opcode)) {
+		_assembler->mov(X86::kRSI, X86::kR8);
+	}
+
+	if (BIT20(opcode)) {
+		if (BIT6(opcode)) {
+			_emitLoad(BIT5(opcode) ? 2 : 1, true);
+		} else {
+			_emitLoad(2, false);
+		}
+		if (isWriteback) {
+			_storeRegister(rn, X86::kR8);
+		}
+		_storeRegister(rd, X86::kRAX);
+	} else {
+		if (isWriteback && rd == rn) {
+			_assembler->mov(X86::kRDI, X86::kR8);
+		} else {
+			_loadRegister(X86::kRDI, rd);
+		}
+		_emitStore(2);
+		if (isWriteback) {
+			_storeRegister(rn, X86::kR8);
+		}
+	}
+
+	return true;
+}
+
+bool ARM7TDMIRecompiler::_compileARMMultiplication(uint32_t opcode) {
+	uint32_t operation = BITFIELD_UINT32(opcode, 23, 21);
+	auto rd = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 19, 16));
+	auto rn = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 15, 12));
+	auto rs = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 11, 8));
+	auto rm = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 3, 0));
+
+	if (operation > 1 || rd == ARM7TDMI::kVirtualRegisterPC) { return false; }
+
+	_loadRegister(X86::kRSI, rm);
+	_loadRegister(X86::kRDI, rs);
+	_assembler->imul(X86::kRSI, X86::kRDI);
+	if (operation == 1) {
+		_loadRegister(X86::kRDI, rn);
+		_assembler->alu(X86::kALUOperationADD, X86::kRSI, X86::kRDI);
+	}
+	_storeRegister(rd, X86::kRSI);
+
+	if (BIT20(opcode)) {
+		_emitUpdateNZ(X86::kRSI);
+	}
+
+	return true;
+}
+
+bool ARM7TDMIRecompiler::_compileARMBranch(uint32_t opcode) {
+	if ((opcode & 0xf0000000) == 0xf0000000) { return false; }
+
+	uint32_t offset = opcode & 0xffffff;
+	if (offset & 0x800000) {
+		offset |= 0xff000000;
+	}
+	uint32_t address = _pc() + (offset << 2);
+
+	if (BIT24(opcode)) {
+		_assembler->mov(X86::kRAX, _address + 4);
+		_storeRegister(ARM7TDMI::kVirtualRegisterLR, X86::kRAX);
+	}
+
+	_assembler->jmp(_exit(_index + 1, kExitReasonBranch, address));
+	return true;
+}
+
+bool ARM7TDMIRecompiler::_compileThumb(uint16_t opcode, ARM7TDMI::ThumbInstructionHandler handler) {
+	if (handler == &ARM7TDMI::_executeThumbUndefined) { return false; }
+
+	if ((opcode & 0xf800) == 0x1800) {
+		// add / subtract
+		auto rs = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 5, 3));
+		auto rd = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 2, 0));
+		_loadRegister(X86::kRSI, rs);
+		if (BIT10(opcode)) {
+			_assembler->mov(X86::kRDI, BITFIELD_UINT32(opcode, 8, 6));
+		} else {
+			_loadRegister(X86::kRDI, static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 8, 6)));
+		}
+		_assembler->alu(BIT9(opcode) ? X86::kALUOperationSUB : X86::kALUOperationADD, X86::kRSI, X86::kRDI);
+		_storeRegister(rd, X86::kRSI);
+		_emitUpdateNZCV(BIT9(opcode));
+		return true;
+	} else if ((opcode & 0xe000) == 0x0000) {
+		// move shifted register
+		auto shiftType = BIT12(opcode) ? ARM7TDMI::kShiftTypeASR : BIT11(opcode) ? ARM7TDMI::kShiftTypeLSR : ARM7TDMI::kShiftTypeLSL;
+		_loadRegister(X86::kRDI, static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 5, 3)));
+		_emitShiftByImmediate(X86::kRDI, shiftType, BITFIELD_UINT32(opcode, 10, 6), true);
+		_storeRegister(static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 2, 0)), X86::kRDI);
+		_emitUpdateNZ(X86::kRDI);
+		return true;
+	} else if ((opcode & 0xe000) == 0x2000) {
+		// move / compare / add / subtract immediate
+		auto rd = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 10, 8));
+		uint32_t n = BITFIELD_UINT32(opcode, 7, 0);
+		switch (BITFIELD_UINT32(opcode, 12, 11)) {
+			case 0:
+				_assembler->mov(X86::kRSI, n);
+				_storeRegister(rd, X86::kRSI);
+				_emitUpdateNZ(X86::kRSI);
+				break;
+			case 1:
+				_loadRegister(X86::kRSI, rd);
+				_assembler->alu(X86::kALUOperationCMP, X86::kRSI, n);
+				_emitUpdateNZCV(true);
+				break;
+			case 2:
+				_loadRegister(X86::kRSI, rd);
+				_assembler->alu(X86::kALUOperationADD, X86::kRSI, n);
+				_storeRegister(rd, X86::kRSI);
+				_emitUpdateNZCV(false);
+				break;
+			case 3:
+				_loadRegister(X86::kRSI, rd);
+				_assembler->alu(X86::kALUOperationSUB, X86::kRSI, n);
+				_storeRegister(rd, X86::kRSI);
+				_emitUpdateNZCV(true);
+				break;
+		}
+		return true;
+	} else if ((opcode & 0xfc00) == 0x4000) {
+		return _compileThumbALUOp(opcode);
+	} else if ((opcode & 0xfc00) == 0x4400) {
+		return _compileThumbHighRegisterOp(opcode);
+	} else if ((opcode & 0xf800) == 0x4800) {
+		// pc relative load
+		_assembler->mov(X86::kRSI, (_pc() & ~2) + (BITFIELD_UINT32(opcode, 7, 0) << 2));
+		_emitLoad(4, false);
+		_storeRegister(static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 10, 8)), X86::kRAX);
+		return true;
+	} else if ((opcode & 0xf000) == 0x5000) {
+		// load / store with register offset
+		auto rd = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 2, 0));
+		_loadRegister(X86::kRSI, static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 5, 3)));
+		_loadRegister(X86::kRDI, static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 8, 6)));
+		_assembler->alu(X86::kALUOperationADD, X86::kRSI, X86::kRDI);
+		switch (BITFIELD_UINT32(opcode, 11, 9)) {
+			case 0: _loadRegister(X86::kRDI, rd); _emitStore(4); return true;
+			case 1: _loadRegister(X86::kRDI, rd); _emitStore(2); return true;
+			case 2: _loadRegister(X86::kRDI, rd); _emitStore(1); return true;
+			case 3: _emitLoad(1, true); break;
+			case 4: _emitLoad(4, false); break;
+			case 5: _emitLoad(2, false); break;
+			case 6: _emitLoad(1, false); break;
+			case 7: _emitLoad(2, true); break;
+		}
+		_storeRegister(rd, X86::kRAX);
+		return true;
+	} else if ((opcode & 0xe000) == 0x6000 || (opcode & 0xf000) == 0x8000) {
+		// load / store with immediate offset
+		auto rd = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 2, 0));
+		uint32_t size = (opcode & 0xf000) == 0x8000 ? 2 : BIT12(opcode) ? 1 : 4;
+		_loadRegister(X86::kRSI, static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 5, 3)));
+		if (uint32_t offset = BITFIELD_UINT32(opcode, 10, 6) * size) {
+			_assembler->alu(X86::kALUOperationADD, X86::kRSI, offset);
+		}
+		if (BIT11(opcode)) {
+			_emitLoad(size, false);
+			_storeRegister(rd, X86::kRAX);
+		} else {
+			_loadRegister(X86::kRDI, rd);
+			_emitStore(size);
+		}
+		return true;
+	} else if ((opcode & 0xf000) == 0x9000) {
+		// sp relative load / store
+		auto rd = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 10, 8));
+		_loadRegister(X86::kRSI, ARM7TDMI::kVirtualRegisterSP);
+		if (uint32_t offset = BITFIELD_UINT32(opcode, 7, 0) << 2) {
+			_assembler->alu(X86::kALUOperationADD, X86::kRSI, offset);
+		}
+		if (BIT11(opcode)) {
+			_emitLoad(4, false);
+			_storeRegister(rd, X86::kRAX);
+		} else {
+			_loadRegister(X86::kRDI, rd);
+			_emitStore(4);
+		}
+		return true;
+	} else if ((opcode & 0xf000) == 0xa000) {
+		// load address
+		uint32_t offset = BITFIELD_UINT32(opcode, 7, 0) << 2;
+		if (BIT11(opcode)) {
+			_loadRegister(X86::kRSI, ARM7TDMI::kVirtualRegisterSP);
+			if (offset) {
+				_assembler->alu(X86::kALUOperationADD, X86::kRSI, offset);
+			}
+		} else {
+			_assembler->mov(X86::kRSI, (_pc() & ~2) + offset);
+		}
+		_storeRegister(static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 10, 8)), X86::kRSI);
+		return true;
+	} else if ((opcode & 0xff00) == 0xb000) {
+		// add offset to sp
+		_loadRegister(X86::kRSI, ARM7TDMI::kVirtualRegisterSP);
+		_assembler->alu(BIT7(opcode) ? X86::kALUOperationSUB : X86::kALUOperationADD, X86::kRSI, BITFIELD_UINT32(opcode, 6, 0) << 2);
+		_storeRegister(ARM7TDMI::kVirtualRegisterSP, X86::kRSI);
+		return true;
+	} else if ((opcode & 0xf600) == 0xb400) {
+		return _compileThumbPushPop(opcode);
+	} else if ((opcode & 0xf000) == 0xd000) {
+		// conditional branch. the undefined and swi encodings were handled above or fall back
+		auto condition = static_cast<ARM7TDMI::Condition>(BITFIELD_UINT32(opcode, 11, 8));
+		if (condition >= ARM7TDMI::kConditionAlways) { return false; }
+		uint32_t offset = static_cast<uint32_t>(static_cast<int8_t>(BITFIELD_UINT32(opcode, 7, 0))) << 1;
+		auto& notTaken = _newLabel();
+		_emitConditionCheck(condition, notTaken);
+		_assembler->jmp(_exit(_index + 1, kExitReasonBranch, _pc() + offset));
+		_assembler->bind(notTaken);
+		return true;
+	} else if ((opcode & 0xf800) == 0xe000) {
+		uint32_t offset = BITFIELD_UINT32(opcode, 10, 0) << 1;
+		if (offset & 0x800) {
+			offset |= 0xfffff000;
+		}
+		_assembler->jmp(_exit(_index + 1, kExitReasonBranch, _pc() + offset));
+		return true;
+	} else if ((opcode & 0xf800) == 0xf000) {
+		// long branch, first half
+		uint32_t offset = BITFIELD_UINT32(opcode, 10, 0) << 12;
+		if (offset & 0x400000) {
+			offset |= 0xff800000;
+		}
+		_assembler->mov(X86::kRAX, _pc() + offset);
+		_storeRegister(ARM7TDMI::kVirtualRegisterLR, X86::kRAX);
+		return true;
+	} else if ((opcode & 0xf800) == 0xf800) {
+		// long branch, second half
+		_loadRegister(X86::kRAX, ARM7TDMI::kVirtualRegisterLR);
+		_assembler->alu(X86::kALUOperationADD, X86::kRAX, BITFIELD_UINT32(opcode, 10, 0) << 1);
+		_assembler->mov(_registerAddress(ARM7TDMI::kVirtualRegisterPC), X86::kRAX);
+		_assembler->mov(X86::kRAX, (_pc() - 2) | 1);
+		_storeRegister(ARM7TDMI::kVirtualRegisterLR, X86::kRAX);
+		_assembler->jmp(_exit(_index + 1, kExitReasonBranch));
+		return true;
+	}
+
+	return false;
+}
+
+bool ARM7TDMIRecompiler::_compileThumbALUOp(uint16_t opcode) {
+	uint32_t operation = BITFIELD_UINT32(opcode, 9, 6);
+	auto rs = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 5, 3));
+	auto rd = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 2, 0));
+
+	switch (operation) {
+		case 0x2: // LSL
+		case 0x3: // LSR
+		case 0x4: // ASR
+		case 0x6: // SBC
+		case 0x7: // ROR
+			return false;
+	}
+
+	_loadRegister(X86::kRSI, rd);
+	_loadRegister(X86::kRDI, rs);
+
+	switch (operation) {
+		case 0x0:
+		case 0x8:
+			_assembler->alu(X86::kALUOperationAND, X86::kRSI, X86::kRDI);
+			break;
+		case 0x1:
+			_assembler->alu(X86::kALUOperationXOR, X86::kRSI, X86::kRDI);
+			break;
+		case 0x5:
+			_assembler->bt(_cpsrAddress(), 29);
+			_assembler->alu(X86::kALUOperationADC, X86::kRSI, X86::kRDI);
+			break;
+		case 0x9:
+			_assembler->alu(X86::kALUOperationXOR, X86::kRSI, X86::kRSI);
+			_assembler->alu(X86::kALUOperationSUB, X86::kRSI, X86::kRDI);
+			break;
+		case 0xa:
+			_assembler->alu(X86::kALUOperationCMP, X86::kRSI, X86::kRDI);
+			break;
+		case 0xb:
+			_assembler->alu(X86::kALUOperationADD, X86::kRSI, X86::kRDI);
+			break;
+		case 0xc:
+			_assembler->alu(X86::kALUOperationOR, X86::kRSI, X86::kRDI);
+			break;
+		case 0xd:
+			_assembler->imul(X86::kRSI, X86::kRDI);
+			break;
+		case 0xe:
+			_assembler->not_(X86::kRDI);
+			_assembler->alu(X86::kALUOperationAND, X86::kRSI, X86::kRDI);
+			break;
+		case 0xf:
+			_assembler->not_(X86::kRDI);
+			_assembler->mov(X86::kRSI, X86::kRDI);
+			break;
+	}
+
+	if (operation != 0x8 && operation != 0xa && operation != 0xb) {
+		_storeRegister(rd, X86::kRSI);
+	}
+
+	switch (operation) {
+		case 0x5:
+		case 0xb:
+			_emitUpdateNZCV(false);
+			break;
+		case 0x9:
+		case 0xa:
+			_emitUpdateNZCV(true);
+			break;
+		default:
+			_emitUpdateNZ(X86::kRSI);
+	}
+
+	return true;
+}
+
+bool ARM7TDMIRecompiler::_compileThumbHighRegisterOp(uint16_t opcode) {
+	auto rs = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 5, 3) | (BIT6(opcode) ? 0x8 : 0));
+	auto rd = static_cast<ARM7TDMI::VirtualRegister>(BITFIELD_UINT32(opcode, 2, 0) | (BIT7(opcode) ? 0x8 : 0));
+	uint32_t operation = BITFIELD_UINT32(opcode, 9, 8);
+
+	// BX and BLX, encodings the interpreter rejects, and anything that writes pc
+	if (operation == 3 || (!BIT6(opcode) && !BIT7(opcode))) { return false; }
+	if (operation != 1 && rd == ARM7TDMI::kVirtualRegisterPC) { return false; }
+
+	_loadRegister(X86::kRDI, rs);
+
+	switch (operation) {
+		case 0:
+			_loadRegister(X86::kRSI, rd);
+			_assembler->alu(X86::kALUOperationADD, X86::kRSI, X86::kRDI);
+			_storeRegister(rd, X86::kRSI);
+			break;
+		case 1:
+			_loadRegister(X86::kRSI, rd);
+			_assembler->alu(X86::kALUOperationCMP, X86::kRSI, X86::kRDI);
+			_emitUpdateNZCV(true);
+			break;
+		case 2:
+			_storeRegister(rd, X86::kRDI);
+			break;
+	}
+
+	return true;
+}
+
+bool ARM7TDMIRecompiler::_compileThumbPushPop(uint16_t opcode) {
+	// r10 walks the stack. the stack pointer itself is only written once every access has succeeded
+	_loadRegister(X86::kR10, ARM7TDMI::kVirtualRegisterSP);
+
+	if (BIT11(opcode)) {
+		for (int i = 0; i <= 7; ++i) {
+			if (!(opcode & (1 << i))) { continue; }
+			_assembler->mov(X86::kRSI, X86::kR10);
+			_emitLoad(4, false);
+			_storeRegister(static_cast<ARM7TDMI::VirtualRegister>(ARM7TDMI::kVirtualRegisterR0 + i), X86::kRAX);
+			_assembler->alu(X86::kALUOperationADD, X86::kR10, 4);
+		}
+		if (BIT8(opcode)) {
+			_assembler->mov(X86::kRSI, X86::kR10);
+			_emitLoad(4, false);
+			_assembler->alu(X86::kALUOperationAND, X86::kRAX, ~1u);
+			_assembler->mov(_registerAddress(ARM7TDMI::kVirtualRegisterPC), X86::kRAX);
+			_assembler->alu(X86::kALUOperationADD, X86::kR10, 4);
+		}
+	} else {
+		if (BIT8(opcode)) {
+			_assembler->alu(X86::kALUOperationSUB, X86::kR10, 4);
+			_assembler->mov(X86::kRSI, X86::kR10);
+			_loadRegister(X86::kRDI, ARM7TDMI::kVirtualRegisterLR);
+			_emitStore(4);
+		}
+		for (int i = 7; i >= 0; --i) {
+			if (!(opcode & (1 << i))) { continue; }
+			_assembler->alu(X86::kALUOperationSUB, X86::kR10, 4);
+			_assembler->mov(X86::kRSI, X86::kR10);
+			_loadRegister(X86::kRDI, static_cast<ARM7TDMI::VirtualRegister>(ARM7TDMI::kVirtualRegisterR0 + i));
+			_emitStore(4);
+		}
+	}
+
+	_storeRegister(ARM7TDMI::kVirtualRegisterSP, X86::kR10);
+
+	if (BIT11(opcode) && BIT8(opcode)) {
+		_assembler->jmp(_exit(_index + 1, kExitReasonBranch));
+	}
+
+	return true;
+}
+
+X86Assembler::Label& ARM7TDMIRecompiler::_newLabel() {
+	_labels.emplace_back();
+	return _labels.back();
+}
+
+X86Assembler::Label& ARM7TDMIRecompiler::_exit(uint32_t count, ExitReason reason) {
+	_exits.emplace_back();
+	auto& exit = _exits.back();
+	exit.count = count;
+	exit.reason = reason;
+	exit.hasDynamicReason = false;
+	exit.hasPC = false;
+	exit.pc = 0;
+	return exit.label;
+}
+
+X86Assembler::Label& ARM7TDMIRecompiler::_exit(uint32_t count, ExitReason reason, uint32_t pc) {
+	auto& label = _exit(count, reason);
+	_exits.back().hasPC = true;
+	_exits.back().pc = pc;
+	return label;
+}
+
+X86Assembler::Label& ARM7TDMIRecompiler::_dynamicExit(uint32_t count) {
+	auto& label = _exit(count, kExitReasonContinue);
+	_exits.back().hasDynamicReason = true;
+	return label;
+}
+
+X86Assembler::Label& ARM7TDMIRecompiler::_faultLabel() {
+	// faults leave the registers as they were before the instruction, so the interpreter can run it and throw
+	if (!_fault) {
+		_fault = &_exit(_index, kExitReasonInterpret, _pc());
+	}
+	return *_fault;
+}
+
+X86Assembler::Address ARM7TDMIRecompiler::_registerAddress(ARM7TDMI::VirtualRegister r) const {
+	return X86::Address(kRegisterFile, static_cast<int32_t>(r * sizeof(uint32_t)));
+}
+
+void ARM7TDMIRecompiler::_loadRegister(Register dst, ARM7TDMI::VirtualRegister r) {
+	if (r == ARM7TDMI::kVirtualRegisterPC) {
+		_assembler->mov(dst, _pc());
+		return;
+	}
+
+	++_registerUses[r];
+	if (_hostRegisters[r] != X86::kRegisterNone) {
+		_assembler->mov(dst, _hostRegisters[r]);
+	} else {
+		_assembler->mov(dst, _registerAddress(r));
+	}
+}
+
+void ARM7TDMIRecompiler::_storeRegister(ARM7TDMI::VirtualRegister r, Register src) {
+	assert(r != ARM7TDMI::kVirtualRegisterPC);
+	++_registerUses[r];
+	if (_hostRegisters[r] != X86::kRegisterNone) {
+		_assembler->mov(_hostRegisters[r], src);
+	} else {
+		_assembler->mov(_registerAddress(r), src);
+	}
+}
+
+void ARM7TDMIRecompiler::_spillRegisters() {
+	for (int r = 0; r < ARM7TDMI::kVirtualRegisterCount; ++r) {
+		if (_hostRegisters[r] != X86::kRegisterNone) {
+			_assembler->mov(_registerAddress(static_cast<ARM7TDMI::VirtualRegister>(r)), _hostRegisters[r]);
+		}
+	}
+}
+
+void ARM7TDMIRecompiler::_reloadRegisters() {
+	for (int r = 0; r < ARM7TDMI::kVirtualRegisterCount; ++r) {
+		if (_hostRegisters[r] != X86::kRegisterNone) {
+			_assembler->mov(_hostRegisters[r], _registerAddress(static_cast<ARM7TDMI::VirtualRegister>(r)));
+		}
+	}
+}
+
+void ARM7TDMIRecompiler::_emitConditionCheck(ARM7TDMI::Condition condition, X86Assembler::Label& skip) {
+	_assembler->mov(X86::kRAX, _cpsrAddress());
+	_assembler->shift(X86::kShiftOperationSHR, X86::kRAX, 28);
+	_assembler->movzx16(X86::kRAX, X86::Address(kContext, X86::kRAX, 2, static_cast<int32_t>(offsetof(Context, conditionTable))));
+	_assembler->bt(X86::kRAX, condition);
+	_assembler->jcc(X86::kConditionNoCarry, skip);
+}
+
+void ARM7TDMIRecompiler::_emitUpdateNZCV(bool invertCarry) {
+	// eflags has carry in bit 0, zero in bit 6, sign in bit 7, and overflow in bit 11
+	_assembler->pushfq();
+	_assembler->pop(X86::kRAX);
+	_assembler->mov(X86::kRCX, X86::kRAX);
+	_assembler->shift(X86::kShiftOperationSHL, X86::kRCX, 24);
+	_assembler->alu(X86::kALUOperationAND, X86::kRCX, ARM7TDMI::kPSRFlagNegative | ARM7TDMI::kPSRFlagZero);
+	_assembler->mov(X86::kRDX, X86::kRAX);
+	_assembler->shift(X86::kShiftOperationSHL, X86::kRDX, 29);
+	_assembler->alu(X86::kALUOperationAND, X86::kRDX, ARM7TDMI::kPSRFlagCarry);
+	if (invertCarry) {
+		// arm's carry after a subtraction means no borrow
+		_assembler->alu(X86::kALUOperationXOR, X86::kRDX, ARM7TDMI::kPSRFlagCarry);
+	}
+	_assembler->shift(X86::kShiftOperationSHL, X86::kRAX, 17);
+	_assembler->alu(X86::kALUOperationAND, X86::kRAX, ARM7TDMI::kPSRFlagOverflow);
+	_assembler->alu(X86::kALUOperationOR, X86::kRCX, X86::kRDX);
+	_assembler->alu(X86::kALUOperationOR, X86::kRCX, X86::kRAX);
+	_assembler->mov(X86::kRDX, _cpsrAddress());
+	_assembler->alu(X86::kALUOperationAND, X86::kRDX, ~(ARM7TDMI::kPSRFlagNegative | ARM7TDMI::kPSRFlagZero | ARM7TDMI::kPSRFlagCarry | ARM7TDMI::kPSRFlagOverflow));
+	_assembler->alu(X86::kALUOperationOR, X86::kRDX, X86::kRCX);
+	_assembler->mov(_cpsrAddress(), X86::kRDX);
+}
+
+void ARM7TDMIRecompiler::_emitUpdateNZ(Register result) {
+	_assembler->test(result, result);
+	_assembler->pushfq();
+	_assembler->pop(X86::kRAX);
+	_assembler->shift(X86::kShiftOperationSHL, X86::kRAX, 24);
+	_assembler->alu(X86::kALUOperationAND, X86::kRAX, ARM7TDMI::kPSRFlagNegative | ARM7TDMI::kPSRFlagZero);
+	_assembler->mov(X86::kRCX, _cpsrAddress());
+	_assembler->alu(X86::kALUOperationAND, X86::kRCX, ~(ARM7TDMI::kPSRFlagNegative | ARM7TDMI::kPSRFlagZero));
+	_assembler->alu(X86::kALUOperationOR, X86::kRCX, X86::kRAX);
+	_assembler->mov(_cpsrAddress(), X86::kRCX);
+}
+
+void ARM7TDMIRecompiler::_emitUpdateCarry(Register value, uint8_t bit) {
+	_assembler->bt(value, bit);
+	_assembler->setcc(X86::kConditionCarry, X86::kRAX);
+	_assembler->movzx8(X86::kRAX, X86::kRAX);
+	_assembler->shift(X86::kShiftOperationSHL, X86::kRAX, 29);
+	_assembler->mov(X86::kRCX, _cpsrAddress());
+	_assembler->alu(X86::kALUOperationAND, X86::kRCX, ~ARM7TDMI::kPSRFlagCarry);
+	_assembler->alu(X86::kALUOperationOR, X86::kRCX, X86::kRAX);
+	_assembler->mov(_cpsrAddress(), X86::kRCX);
+}
+
+void ARM7TDMIRecompiler::_emitShiftByImmediate(Register value, ARM7TDMI::ShiftType type, uint32_t amount, bool updateCarry) {
+	// mirrors ShiftSpecial, where a shift of 0 means 32 for LSR and ASR
+	switch (type) {
+		case ARM7TDMI::kShiftTypeLSL:
+			if (amount) {
+				if (updateCarry) {
+					_emitUpdateCarry(value, static_cast<uint8_t>(32 - amount));
+				}
+				_assembler->shift(X86::kShiftOperationSHL, value, static_cast<uint8_t>(amount));
+			}
+			break;
+		case ARM7TDMI::kShiftTypeLSR:
+			if (updateCarry) {
+				_emitUpdateCarry(value, static_cast<uint8_t>(amount ? amount - 1 : 31));
+			}
+			if (amount) {
+				_assembler->shift(X86::kShiftOperationSHR, value, static_cast<uint8_t>(amount));
+			} else {
+				_assembler->mov(value, 0u);
+			}
+			break;
+		case ARM7TDMI::kShiftTypeASR:
+			if (updateCarry) {
+				_emitUpdateCarry(value, static_cast<uint8_t>(amount ? amount - 1 : 31));
+			}
+			_assembler->shift(X86::kShiftOperationSAR, value, static_cast<uint8_t>(amount ? amount : 31));
+			break;
+		case ARM7TDMI::kShiftTypeROR:
+			assert(amount);
+			if (updateCarry) {
+				// matches the interpreter, which takes the carry from bit (amount & 0x1e)
+				_emitUpdateCarry(value, static_cast<uint8_t>(amount & 0x1e));
+			}
+			_assembler->shift(X86::kShiftOperationROR, value, static_cast<uint8_t>(amount));
+			break;
+	}
+}
+
+void ARM7TDMIRecompiler::_emitLoad(uint32_t size, bool isSigned) {
+	// address in esi, result in eax
+	_slowPaths.emplace_back();
+	auto& slowPath = _slowPaths.back();
+	slowPath.resume = &_newLabel();
+	slowPath.fault = &_faultLabel();
+	slowPath.isStore = false;
+	slowPath.size = size;
+	slowPath.isSigned = isSigned;
+
+	X86::Address address(X86::kRCX, X86::kRSI, 1);
+
+	if (_isFastmem) {
+		address = _emitFastmemAddress(slowPath.label);
+	} else {
+		int32_t regions = static_cast<int32_t>(offsetof(Context, loadRegions));
+
+		_assembler->mov(X86::kRAX, X86::kRSI);
+		_assembler->shift(X86::kShiftOperationSHR, X86::kRAX, 16);
+		_assembler->alu(X86::kALUOperationAND, X86::kRAX, (kRegionCount - 1) << 4);
+		_assembler->mov(X86::kRCX, X86::kRSI);
+		_assembler->mov(X86::kRDX, X86::Address(kContext, X86::kRAX, 1, regions + static_cast<int32_t>(offsetof(Region, start))));
+		_assembler->alu64(X86::kALUOperationSUB, X86::kRCX, X86::kRDX);
+		if (size > 1) {
+			_assembler->alu64(X86::kALUOperationADD, X86::kRCX, size - 1);
+		}
+		_assembler->mov(X86::kRDX, X86::Address(kContext, X86::kRAX, 1, regions + static_cast<int32_t>(offsetof(Region, length))));
+		_assembler->alu64(X86::kALUOperationCMP, X86::kRCX, X86::kRDX);
+		_assembler->jcc(X86::kConditionNoCarry, slowPath.label);
+		_assembler->mov64(X86::kRCX, X86::Address(kContext, X86::kRAX, 1, regions + static_cast<int32_t>(offsetof(Region, base))));
+	}
+
+	switch (size) {
+		case 1:
+			if (isSigned) {
+				_assembler->movsx8(X86::kRAX, address);
+			} else {
+				_assembler->movzx8(X86::kRAX, address);
+			}
+			break;
+		case 2:
+			if (isSigned) {
+				_assembler->movsx16(X86::kRAX, address);
+			} else {
+				_assembler->movzx16(X86::kRAX, address);
+			}
+			break;
+		default:
+			_assembler->mov(X86::kRAX, address);
+	}
+
+	if (_isFastmem) {
+		_endFastmemAccess();
+	}
+
+	_assembler->bind(*slowPath.resume);
+}
+
+void ARM7TDMIRecompiler::_emitStore(uint32_t size) {
+	// address in esi, value in edi
+	_hasStore = true;
+
+	_slowPaths.emplace_back();
+	auto& slowPath = _slowPaths.back();
+	slowPath.resume = &_newLabel();
+	slowPath.fault = &_faultLabel();
+	slowPath.isStore = true;
+	slowPath.size = size;
+	slowPath.isSigned = false;
+
+	if (_isLockstep) {
+		_assembler->push(X86::kR8);
+		_assembler->push(X86::kR9);
+		_assembler->push(X86::kR10);
+		_assembler->push(X86::kR11);
+		_assembler->push(X86::kRSI);
+		_assembler->push(X86::kRDI);
+		_assembler->mov(X86::kRDX, size);
+		_assembler->mov64(X86::kRDI, kContext);
+		_emitCall(reinterpret_cast<const void*>(&LogStore));
+		_assembler->pop(X86::kRDI);
+		_assembler->pop(X86::kRSI);
+		_assembler->pop(X86::kR11);
+		_assembler->pop(X86::kR10);
+		_assembler->pop(X86::kR9);
+		_assembler->pop(X86::kR8);
+	}
+
+	// stores to pages holding cached code take the slow path so the cpu can invalidate it
+	_assembler->mov(X86::kRAX, X86::kRSI);
+	_assembler->shift(X86::kShiftOperationSHR, X86::kRAX, 10);
+	_assembler->mov64(X86::kRCX, X86::Address(kContext, static_cast<int32_t>(offsetof(Context, watchedPages))));
+	_assembler->cmp8(X86::Address(X86::kRCX, X86::kRAX, 1), 0);
+	_assembler->jcc(X86::kConditionNotZero, slowPath.label);
+
+	X86::Address address(X86::kRCX, X86::kRSI, 1);
+
+	if (_isFastmem) {
+		address = _emitFastmemAddress(slowPath.label);
+	} else {
+		int32_t regions = static_cast<int32_t>(offsetof(Context, storeRegions));
+
+		_assembler->mov(X86::kRAX, X86::kRSI);
+		_assembler->shift(X86::kShiftOperationSHR, X86::kRAX, 16);
+		_assembler->alu(X86::kALUOperationAND, X86::kRAX, (kRegionCount - 1) << 4);
+		_assembler->mov(X86::kRCX, X86::kRSI);
+		_assembler->mov(X86::kRDX, X86::Address(kContext, X86::kRAX, 1, regions + static_cast<int32_t>(offsetof(Region, start))));
+		_assembler->alu64(X86::kALUOperationSUB, X86::kRCX, X86::kRDX);
+		if (size > 1) {
+			_assembler->alu64(X86::kALUOperationADD, X86::kRCX, size - 1);
+		}
+		_assembler->mov(X86::kRDX, X86::Address(kContext, X86::kRAX, 1, regions + static_cast<int32_t>(offsetof(Region, length))));
+		_assembler->alu64(X86::kALUOperationCMP, X86::kRCX, X86::kRDX);
+		_assembler->jcc(X86::kConditionNoCarry, slowPath.label);
+		_assembler->mov64(X86::kRCX, X86::Address(kContext, X86::kRAX, 1, regions + static_cast<int32_t>(offsetof(Region, base))));
+	}
+
+	switch (size) {
+		case 1:
+			_assembler->mov8(address, X86::kRDI);
+			break;
+		case 2:
+			_assembler->mov16(address, X86::kRDI);
+			break;
+		default:
+			_assembler->mov(address, X86::kRDI);
+	}
+
+	if (_isFastmem) {
+		_endFastmemAccess();
+	}
+
+	_assembler->bind(*slowPath.resume);
+}
+
+X86Assembler::Address ARM7TDMIRecompiler::_emitFastmemAddress(X86Assembler::Label& slowPath) {
+	// the address is zero-extended, so this can reach anywhere in the arena
+	_assembler->mov64(X86::kRCX, X86::Address(kContext, static_cast<int32_t>(offsetof(Context, fastmemBase))));
+	_fastmemAccesses.push_back(FastmemAccess{_assembler->size(), &slowPath});
+	return X86::Address(X86::kRCX, X86::kRSI, 1);
+}
+
+void ARM7TDMIRecompiler::_endFastmemAccess() {
+	while (_assembler->size() - _fastmemAccesses.back().position < kFastmemPatchSize) {
+		_assembler->nop();
+	}
+}
+
+void ARM7TDMIRecompiler::_emitCall(const void* function) {
+	_assembler->mov64(X86::kRAX, reinterpret_cast<uint64_t>(function));
+	_assembler->call(X86::kRAX);
+}
+
+void ARM7TDMIRecompiler::_emitPrologue() {
+	_assembler->push(X86::kRBX);
+	_assembler->push(X86::kRBP);
+	_assembler->push(X86::kR12);
+	_assembler->push(X86::kR13);
+	_assembler->push(X86::kR14);
+	_assembler->push(X86::kR15);
+	// keep the stack 16 byte aligned for calls
+	_assembler->alu64(X86::kALUOperationSUB, X86::kRSP, 8);
+	_assembler->mov64(kRegisterFile, X86::kRDI);
+	_assembler->mov64(kContext, X86::kRSI);
+	_reloadRegisters();
+}
+
+void ARM7TDMIRecompiler::_emitEpilogue(X86Assembler::Label& epilogue) {
+	// exits put the instruction count in eax and the exit reason in edx
+	_assembler->bind(epilogue);
+	_spillRegisters();
+	_assembler->shift64(X86::kShiftOperationSHL, X86::kRDX, 32);
+	_assembler->alu64(X86::kALUOperationOR, X86::kRAX, X86::kRDX);
+	_assembler->alu64(X86::kALUOperationADD, X86::kRSP, 8);
+	_assembler->pop(X86::kR15);
+	_assembler->pop(X86::kR14);
+	_assembler->pop(X86::kR13);
+	_assembler->pop(X86::kR12);
+	_assembler->pop(X86::kRBP);
+	_assembler->pop(X86::kRBX);
+	_assembler->ret();
+}
+
+void ARM7TDMIRecompiler::InstallFaultHandler() {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = &FaultHandler;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+
+	// depending on the host, touching a PROT_NONE page raises either of these
+	sigaction(SIGSEGV, &action, &gPreviousSIGSEGVAction);
+	sigaction(SIGBUS, &action, &gPreviousSIGBUSAction);
+}
+
+void ARM7TDMIRecompiler::FaultHandler(int signal, siginfo_t* info, void* context) {
+#if ARM7TDMI_RECOMPILER_SUPPORTED
+	if (auto recompiler = _runningRecompiler) {
+#if defined(__APPLE__)
+		auto pc = reinterpret_cast<uint8_t*>(static_cast<ucontext_t*>(context)->uc_mcontext->__ss.__rip);
+#else
+		auto pc = reinterpret_cast<uint8_t*>(static_cast<ucontext_t*>(context)->uc_mcontext.gregs[REG_RIP]);
+#endif
+		auto it = recompiler->_fastmemSlowPaths.find(pc);
+		if (it != recompiler->_fastmemSlowPaths.end()) {
+			// replace the access with a jump to its slow path. returning retries the instruction, which takes the jump
+			auto displacement = static_cast<int32_t>(it->second - (pc + kFastmemPatchSize));
+			pc[0] = 0xe9;
+			memcpy(pc + 1, &displacement, sizeof(displacement));
+			recompiler->_fastmemSlowPaths.erase(it);
+			return;
+		}
+	}
+#endif
+
+	// not one of ours. pass it on to whatever was installed before
+	auto& previous = signal == SIGBUS ? gPreviousSIGBUSAction : gPreviousSIGSEGVAction;
+	if (previous.sa_flags & SA_SIGINFO) {
+		previous.sa_sigaction(signal, info, context);
+	} else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+		previous.sa_handler(signal);
+	} else {
+		// the faulting instruction runs again when this returns and gets the default behavior this time
+		sigaction(signal, &previous, nullptr);
+	}
+}
+
+uint64_t ARM7TDMIRecompiler::LoadSlow(Context* context, uint32_t address, uint32_t sizeAndSign) {
+	auto& mmu = context->recompiler->_cpu->mmu();
+
+	try {
+		switch (sizeAndSign) {
+			case 0x001: return mmu.load8(address);
+			case 0x002: return mmu.load16(address);
+			case 0x101: return static_cast<uint32_t>(static_cast<int32_t>(static_cast<int8_t>(mmu.load8(address))));
+			case 0x102: return static_cast<uint32_t>(static_cast<int32_t>(static_cast<int16_t>(mmu.load16(address))));
+			default: return mmu.load32(address);
+		}
+	} catch (...) {
+		// the interpreter will repeat the access and throw
+	}
+
+	return 1ull << 32;
+}
+
+uint32_t ARM7TDMIRecompiler::StoreSlow(Context* context, uint32_t address, uint32_t value, uint32_t size) {
+	auto recompiler = context->recompiler;
+	auto& mmu = recompiler->_cpu->mmu();
+
+	context->exitRequested = 1;
+
+	if (recompiler->_isLockstep) {
+		// stores to plain memory were logged and can be undone. anything else is left to the interpreter
+		auto& region = context->storeRegions[address >> kRegionShift];
+		if (static_cast<uint64_t>(address) - region.start + size > region.length) {
+			return 0;
+		}
+	}
+
+	try {
+		switch (size) {
+			case 1: mmu.store8(address, static_cast<uint8_t>(value)); break;
+			case 2: mmu.store16(address, static_cast<uint16_t>(value)); break;
+			default: mmu.store32(address, value);
+		}
+	} catch (...) {
+		return 1;
+	}
+
+	return 0;
+}
+
+void ARM7TDMIRecompiler::LogStore(Context* context, uint32_t address, uint32_t size) {
+	auto recompiler = context->recompiler;
+	auto& region = context->storeRegions[address >> kRegionShift];
+	if (static_cast<uint64_t>(address) - region.start + size > region.length) {
+		return;
+	}
+
+	LoggedStore store;
+	store.address = address;
+	store.size = size;
+	store.oldValue = 0;
+	store.newValue = 0;
+	memcpy(&store.oldValue, region.base + address, size);
+	recompiler->_storeLog.push_back(store);
+}
+
+uint32_t ARM7TDMIRecompiler::ExecuteFallback(Context* context, const ARM7TDMI::CachedInstruction* instruction, uint32_t address) {
+	auto cpu = context->recompiler->_cpu;
+
+	bool isThumb = cpu->getCPSRFlag(ARM7TDMI::kPSRFlagThumb);
+	uint32_t width = isThumb ? 2 : 4;
+	uint32_t pc = address + 2 * width;
+	auto generation = cpu->_blockCacheGeneration;
+
+	cpu->setRegister(ARM7TDMI::kVirtualRegisterPC, pc);
+	cpu->_toExecute.isValid = cpu->_toDecode.isValid = true;
+
+	try {
+		if (isThumb) {
+			(cpu->*instruction->handler.thumb)(static_cast<uint16_t>(instruction->opcode));
+		} else {
+			(cpu->*instruction->handler.arm)(instruction->opcode);
+		}
+	} catch (...) {
+		cpu->_flushLazyFlags();
+		context->recompiler->_exception = std::current_exception();
+		return kExitReasonException;
+	}
+
+	cpu->_flushLazyFlags();
+
+	if (!cpu->_toExecute.isValid || cpu->getRegister(ARM7TDMI::kVirtualRegisterPC) != pc || cpu->getCPSRFlag(ARM7TDMI::kPSRFlagThumb) != isThumb) {
+		cpu->_flushPipeline();
+		return kExitReasonKeepState;
+	}
+
+	if (cpu->_blockCacheGeneration != generation) {
+		// the block's code may have changed
+		cpu->setRegister(ARM7TDMI::kVirtualRegisterPC, pc + width);
+		return kExitReasonKeepState;
+	}
+
+	return kExitReasonContinue;
+}
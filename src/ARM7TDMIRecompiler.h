@@ -0,0 +1,218 @@
+#pragma once
+
+#include "ARM7TDMI.h"
+#include "X86Assembler.h"
+
+#include <deque>
+#include <exception>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <signal.h>
+
+/**
+* Translates cached ARM7TDMI blocks into x86-64 code.
+*
+* Guest registers that a block uses heavily live in host registers for the duration of the block. Loads and stores
+* that hit RAM or ROM are done inline, and everything else goes through the MMU. Instructions that aren't translated
+* are run by calling the interpreter's handler from the generated code.
+*
+* If the MMU has fastmem enabled, loads and stores go straight to the arena without any checks. When one faults, the
+* fault handler rewrites it into a jump to its slow path.
+*
+* In lockstep mode, each block's results are checked against the interpreter before execution continues.
+*/
+class ARM7TDMIRecompiler {
+	public:
+		struct LockstepMismatch {};
+
+		explicit ARM7TDMIRecompiler(ARM7TDMI* cpu);
+		~ARM7TDMIRecompiler();
+
+		/**
+		* Returns false if the host can't run generated code, in which case compile always returns nullptr.
+		*/
+		bool isSupported() const { return _codeBuffer; }
+
+		void setLockstep(bool lockstep) { _isLockstep = lockstep; }
+		bool isLockstep() const { return _isLockstep; }
+
+		/**
+		* Returns nullptr if the code buffer is full. Compiled code stays valid until clear is called.
+		*/
+		const void* compile(const ARM7TDMI::CachedBlock& block);
+
+		/**
+		* Runs a compiled block and returns the number of instructions executed. The caller counts their cycles.
+		*/
+		uint32_t execute(const void* code);
+
+		void clear();
+
+	private:
+		/**
+		* Everything generated code needs to reach. A pointer to this is kept in r14 while a block runs.
+		*/
+		struct Region {
+			uint8_t* base;
+			uint32_t start;
+			uint32_t length;
+		};
+
+		static const size_t kRegionShift = 20;
+		static const size_t kRegionCount = 1 << (32 - kRegionShift);
+
+		struct Context {
+			Region loadRegions[kRegionCount];
+			Region storeRegions[kRegionCount];
+			uint8_t* fastmemBase;
+			const uint8_t* watchedPages;
+			uint16_t conditionTable[16];
+			uint8_t exitRequested;
+			ARM7TDMIRecompiler* recompiler;
+		};
+
+		enum ExitReason : uint32_t {
+			kExitReasonContinue,
+			kExitReasonBranch,
+			kExitReasonKeepState,
+			kExitReasonInterpret,
+			kExitReasonException,
+		};
+
+		typedef uint64_t (*BlockFunction)(uint32_t* registers, Context* context);
+
+		ARM7TDMI* const _cpu;
+		std::unique_ptr<Context> _context;
+		uint32_t _regionGeneration = ~0u;
+
+		uint8_t* _codeBuffer = nullptr;
+		size_t _codeBufferSize = 0;
+		size_t _codeBufferUsed = 0;
+
+		std::deque<ARM7TDMI::CachedInstruction> _fallbackInstructions;
+		std::exception_ptr _exception;
+
+		bool _isLockstep = false;
+
+		struct LoggedStore {
+			uint32_t address;
+			uint32_t size;
+			uint32_t oldValue;
+			uint32_t newValue;
+		};
+
+		std::vector<LoggedStore> _storeLog;
+
+		/**
+		* Maps the address of each fastmem access in the code buffer to its slow path. Entries are removed once the access
+		* has been patched.
+		*/
+		std::unordered_map<uint8_t*, uint8_t*> _fastmemSlowPaths;
+
+		static thread_local ARM7TDMIRecompiler* _runningRecompiler;
+
+		static void InstallFaultHandler();
+		static void FaultHandler(int signal, siginfo_t* info, void* context);
+
+		// compilation state
+		typedef X86Assembler::Register Register;
+
+		struct Exit {
+			X86Assembler::Label label;
+			uint32_t count;
+			ExitReason reason;
+			bool hasDynamicReason;
+			bool hasPC;
+			uint32_t pc;
+		};
+
+		struct SlowPath {
+			X86Assembler::Label label;
+			X86Assembler::Label* resume;
+			X86Assembler::Label* fault;
+			bool isStore;
+			uint32_t size;
+			bool isSigned;
+		};
+
+		std::unique_ptr<X86Assembler> _assembler;
+		std::deque<Exit> _exits;
+		std::deque<SlowPath> _slowPaths;
+		std::deque<X86Assembler::Label> _labels;
+		Register _hostRegisters[ARM7TDMI::kVirtualRegisterCount];
+		uint32_t _registerUses[ARM7TDMI::kVirtualRegisterCount];
+		bool _isThumb = false;
+		uint32_t _address = 0;
+		uint32_t _index = 0;
+		X86Assembler::Label* _fault = nullptr;
+		X86Assembler::Label* _epilogue = nullptr;
+		bool _hasStore = false;
+		bool _isFastmem = false;
+
+		struct FastmemAccess {
+			size_t position;
+			X86Assembler::Label* slowPath;
+		};
+
+		std::vector<FastmemAccess> _fastmemAccesses;
+
+		void _updateRegions();
+
+		void _compile(const ARM7TDMI::CachedBlock& block);
+		void _compileInstruction(const ARM7TDMI::CachedInstruction& instruction);
+		bool _compileARM(uint32_t opcode, ARM7TDMI::ARMInstructionHandler handler);
+		bool _compileARMDataProcessing(uint32_t opcode);
+		bool _compileARMSingleDataTransfer(uint32_t opcode);
+		bool _compileARMHalfwordDataTransfer(uint32_t opcode);
+		bool _compileARMMultiplication(uint32_t opcode);
+		bool _compileARMBranch(uint32_t opcode);
+		bool _compileThumb(uint16_t opcode, ARM7TDMI::ThumbInstructionHandler handler);
+		bool _compileThumbALUOp(uint16_t opcode);
+		bool _compileThumbHighRegisterOp(uint16_t opcode);
+		bool _compileThumbPushPop(uint16_t opcode);
+		void _compileFallback(const ARM7TDMI::CachedInstruction& instruction);
+
+		X86Assembler::Label& _newLabel();
+		X86Assembler::Label& _exit(uint32_t count, ExitReason reason);
+		X86Assembler::Label& _exit(uint32_t count, ExitReason reason, uint32_t pc);
+		X86Assembler::Label& _dynamicExit(uint32_t count);
+		X86Assembler::Label& _faultLabel();
+
+		uint32_t _width() const { return _isThumb ? 2 : 4; }
+		uint32_t _pc() const { return _address + 2 * _width(); }
+
+		X86Assembler::Address _registerAddress(ARM7TDMI::VirtualRegister r) const;
+		X86Assembler::Address _cpsrAddress() const { return _registerAddress(ARM7TDMI::kVirtualRegisterCPSR); }
+		void _loadRegister(Register dst, ARM7TDMI::VirtualRegister r);
+		void _storeRegister(ARM7TDMI::VirtualRegister r, Register src);
+		void _spillRegisters();
+		void _reloadRegisters();
+
+		void _emitConditionCheck(ARM7TDMI::Condition condition, X86Assembler::Label& skip);
+		void _emitUpdateNZCV(bool invertCarry);
+		void _emitUpdateNZ(Register result);
+		void _emitUpdateCarry(Register value, uint8_t bit);
+		void _emitShiftByImmediate(Register value, ARM7TDMI::ShiftType type, uint32_t amount, bool updateCarry);
+		void _emitLoad(uint32_t size, bool isSigned);
+		void _emitStore(uint32_t size);
+		X86Assembler::Address _emitFastmemAddress(X86Assembler::Label& slowPath);
+		void _endFastmemAccess();
+		void _emitCall(const void* function);
+		void _emitPrologue();
+		void _emitEpilogue(X86Assembler::Label& epilogue);
+
+		static uint64_t LoadSlow(Context* context, uint32_t address, uint32_t sizeAndSign);
+		static uint32_t StoreSlow(Context* context, uint32_t address, uint32_t value, uint32_t size);
+		static void LogStore(Context* context, uint32_t address, uint32_t size);
+		static uint32_t ExecuteFallback(Context* context, const ARM7TDMI::CachedInstruction* instruction, uint32_t address);
+
+		uint32_t _execute(const void* code, ExitReason* reason);
+		uint32_t _executeLockstep(const void* code);
+
+		/**
+		* Runs instructions with the cached interpreter without counting their cycles.
+		*/
+		void _interpret(uint32_t count);
+};
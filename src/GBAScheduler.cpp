@@ -0,0 +1,51 @@
+#include "GBAScheduler.h"
+
+#include <algorithm>
+
+void GBAScheduler::schedule(Event event, uint64_t time) {
+	auto& state = _events[event];
+	state.isScheduled = true;
+	state.time = time;
+	state.sequence = _nextSequence++;
+
+	_queue.push_back({time, state.sequence, event});
+	std::push_heap(_queue.begin(), _queue.end());
+
+	_dropStaleEntries();
+}
+
+void GBAScheduler::cancel(Event event) {
+	_events[event].isScheduled = false;
+	_dropStaleEntries();
+}
+
+void GBAScheduler::advance(uint64_t cycles) {
+	auto end = _now + cycles;
+
+	while (!_queue.empty() && _queue.front().time <= end) {
+		auto entry = _queue.front();
+		std::pop_heap(_queue.begin(), _queue.end());
+		_queue.pop_back();
+
+		if (_isStale(entry)) { continue; }
+
+		_now = std::max(_now, entry.time);
+		_events[entry.event].isScheduled = false;
+		_events[entry.event].handler(entry.time);
+	}
+
+	_now = end;
+	_dropStaleEntries();
+}
+
+bool GBAScheduler::_isStale(const QueueEntry& entry) const {
+	auto& state = _events[entry.event];
+	return !state.isScheduled || state.sequence != entry.sequence;
+}
+
+void GBAScheduler::_dropStaleEntries() {
+	while (!_queue.empty() && _isStale(_queue.front())) {
+		std::pop_heap(_queue.begin(), _queue.end());
+		_queue.pop_back();
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+/**
+* Keeps track of when the next piece of hardware needs attention so that the cpu can run uninterrupted until then.
+*
+* Times are absolute cycle counts. Each event can be pending at most once, so scheduling an event that's already pending
+* moves it.
+*/
+class GBAScheduler {
+	public:
+		enum Event {
+			kEventHBlank,
+			kEventVBlank,
+			kEventVCounterMatch,
+			kEventScanline,
+			kEventHBlankDMA,
+			kEventVBlankDMA,
+			kEventTimer0Overflow,
+			kEventTimer1Overflow,
+			kEventTimer2Overflow,
+			kEventTimer3Overflow,
+			kEventCount
+		};
+
+		/**
+		* Handlers are given the time the event was scheduled for, which can be earlier than now() if the cpu ran over.
+		*/
+		typedef std::function<void(uint64_t time)> Handler;
+
+		void setHandler(Event event, Handler handler) { _events[event].handler = std::move(handler); }
+
+		void schedule(Event event, uint64_t time);
+		void cancel(Event event);
+
+		bool isScheduled(Event event) const { return _events[event].isScheduled; }
+		uint64_t scheduledTime(Event event) const { return _events[event].time; }
+
+		uint64_t now() const { return _now; }
+
+		/**
+		* Returns the time of the earliest pending event, or UINT64_MAX if there are none.
+		*/
+		uint64_t nextEventTime() const { return _queue.empty() ? UINT64_MAX : _queue.front().time; }
+
+		/**
+		* Moves time forward, running the handlers of the events that come due in order.
+		*/
+		void advance(uint64_t cycles);
+
+	private:
+		struct EventState {
+			Handler handler;
+			bool isScheduled = false;
+			uint64_t time = 0;
+			uint64_t sequence = 0;
+		};
+
+		EventState _events[kEventCount];
+
+		/**
+		* A min-heap ordered by time. Cancelled and moved events leave their entries behind, and they're dropped when they
+		* reach the front.
+		*/
+		struct QueueEntry {
+			uint64_t time;
+			uint64_t sequence;
+			Event event;
+
+			bool operator<(const QueueEntry& other) const {
+				return time != other.time ? time > other.time : sequence > other.sequence;
+			}
+		};
+
+		std::vector<QueueEntry> _queue;
+		uint64_t _now = 0;
+		uint64_t _nextSequence = 0;
+
+		bool _isStale(const QueueEntry& entry) const;
+		void _dropStaleEntries();
+};
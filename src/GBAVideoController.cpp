@@ -5,104 +5,166 @@
 #include "FixedEndian.h"
 #include "BIT_MACROS.h"
 
+#include <algorithm>
+#include <cmath>
+
 GBAVideoController::GBAVideoController(GameBoyAdvance* gba) : _gba(gba) {
-	_gba->cpu().mmu().attach(0x05000000, &_paletteRAM, 0, _paletteRAM.size());
-	_gba->cpu().mmu().attach(0x06000000, &_videoRAM, 0, _videoRAM.size());
-	_gba->cpu().mmu().attach(0x07000000, &_objectAttributeRAM, 0, _objectAttributeRAM.size());
-	
-	glGenTextures(1, &_texture);
-	
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, _texture);
-	
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 240, 160, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	_gba->cpu().mmu().attach(0x05000000, &_paletteRAM, 0, 0x01000000, _paletteRAM.size() - 1);
+	_gba->cpu().mmu().attach(0x07000000, &_objectAttributeRAM, 0, 0x01000000, _objectAttributeRAM.size() - 1);
+
+	// video ram repeats every 128k, and the last 32k of each repetition is a second copy of the 32k before it
+	for (uint32_t address = 0x06000000; address < 0x07000000; address += 0x20000) {
+		_gba->cpu().mmu().attach(address, &_videoRAM, 0, 0x18000);
+		_gba->cpu().mmu().attach(address + 0x18000, &_videoRAM, 0x10000, 0x8000);
+	}
 	
 	_pixelBufferA = reinterpret_cast<Pixel*>(calloc(240 * 160, sizeof(Pixel)));
 	_pixelBufferB = reinterpret_cast<Pixel*>(calloc(240 * 160, sizeof(Pixel)));
 	_pixelBufferC = reinterpret_cast<Pixel*>(calloc(240 * 160, sizeof(Pixel)));
 	
+	_tileCache[0] = reinterpret_cast<uint8_t*>(calloc(kTileCacheEntries, 128));
+	_tileCache[1] = reinterpret_cast<uint8_t*>(calloc(kTileCacheEntries, 128));
+	std::fill(&_isTileCached[0][0], &_isTileCached[0][0] + sizeof(_isTileCached), 0);
+	setGamma(1.0);
+
 	_renderPixelBuffer  = _pixelBufferA;
 	_drawPixelBuffer  = _pixelBufferB;
 	_readyPixelBuffer = _pixelBufferC;
+
+	auto& scheduler = _gba->scheduler();
+	_startTime = scheduler.now();
+	scheduler.setHandler(GBAScheduler::kEventHBlank, [this](uint64_t time) { _beginHBlank(time); });
+	scheduler.setHandler(GBAScheduler::kEventVBlank, [this](uint64_t time) { _beginVBlank(time); });
+	scheduler.setHandler(GBAScheduler::kEventVCounterMatch, [this](uint64_t time) { _beginVCounterMatch(time); });
+	scheduler.setHandler(GBAScheduler::kEventScanline, [this](uint64_t time) { _drawScanline(time); });
+	scheduler.schedule(GBAScheduler::kEventVBlank, nextVBlankTime());
+	scheduler.schedule(GBAScheduler::kEventScanline, nextHBlankTime());
 }
 
 GBAVideoController::~GBAVideoController() {
-	glDeleteTextures(1, &_texture);
+	if (_texture != GL_INVALID_VALUE) {
+		glDeleteTextures(1, &_texture);
+	}
 	free(_pixelBufferA);
 	free(_pixelBufferB);
 	free(_pixelBufferC);
+	free(_tileCache[0]);
+	free(_tileCache[1]);
 }
 
-void GBAVideoController::cycle() {
-	if (++_cycleCounter < 4) {
-		return;
-	} else {
-		_cycleCounter = 0;
+uint16_t GBAVideoController::currentScanline() const {
+	return static_cast<uint16_t>(_frameCycle() / kCyclesPerScanline);
+}
+
+uint16_t GBAVideoController::statusRegister() const {
+	auto frameCycle = _frameCycle();
+	auto scanline = frameCycle / kCyclesPerScanline;
+
+	uint16_t status = _statusRegister;
+
+	if (frameCycle % kCyclesPerScanline >= kCyclesPerScanlineDraw) {
+		status |= kStatusFlagHBlank;
 	}
-	
-	// refresh
-	
-	if (_refreshCoordinate.x >= 240 || _refreshCoordinate.y >= 160 || (_controlRegister & kControlFlagForcedBlank)) {
-		// blank
-	} else if (_refreshCoordinate.x == 239 && _refreshCoordinate.y == 159) {
-		// cheat and just refresh the entire display at once
-		_updateDisplay();
+
+	if (scanline >= 160 && scanline < 227) {
+		status |= kStatusFlagVBlank;
 	}
-	
-	// increment the coordinate
-	
-	if (++_refreshCoordinate.x >= 308) {
-		_refreshCoordinate.x = 0;
-		if (++_refreshCoordinate.y >= 228) {
-			_refreshCoordinate.y = 0;
-		}
+
+	if ((_statusRegister >> 8) == scanline) {
+		status |= kStatusFlagVCounter;
 	}
 
-	// update flags
+	return status;
+}
 
-	if (_refreshCoordinate.x >= 240) {
-		_statusRegister |= kStatusFlagHBlank;
+uint64_t GBAVideoController::nextStatusChangeTime() const {
+	auto scanlineCycle = _frameCycle() % kCyclesPerScanline;
+	return _gba->currentCycle() + (scanlineCycle < kCyclesPerScanlineDraw ? kCyclesPerScanlineDraw : kCyclesPerScanline) - scanlineCycle;
+}
+
+uint64_t GBAVideoController::nextHBlankTime() const {
+	auto time = _nextTime(kCyclesPerScanlineDraw, kCyclesPerScanline);
+	if ((time - _startTime) % kCyclesPerFrame >= 160 * kCyclesPerScanline) {
+		// skip the scanlines in v-blank
+		time = _nextTime(kCyclesPerScanlineDraw, kCyclesPerFrame);
 	}
+	return time;
+}
+
+uint64_t GBAVideoController::nextVBlankTime() const {
+	return _nextTime(160 * kCyclesPerScanline, kCyclesPerFrame);
+}
+
+uint32_t GBAVideoController::_frameCycle() const {
+	return static_cast<uint32_t>((_gba->currentCycle() - _startTime) % kCyclesPerFrame);
+}
+
+uint64_t GBAVideoController::_nextTime(uint32_t offset, uint32_t period) const {
+	auto now = _gba->currentCycle();
+	auto position = static_cast<uint32_t>((now - _startTime) % period);
+	return now + (offset > position ? offset - position : offset + period - position);
+}
 
-	if (_refreshCoordinate.y >= 160) {
-		_statusRegister |= kStatusFlagVBlank;
+void GBAVideoController::_scheduleInterrupts() {
+	auto& scheduler = _gba->scheduler();
+
+	if (_statusRegister & kStatusFlagHBlankIRQEnable) {
+		if (!scheduler.isScheduled(GBAScheduler::kEventHBlank)) {
+			scheduler.schedule(GBAScheduler::kEventHBlank, _nextTime(kCyclesPerScanlineDraw, kCyclesPerScanline));
+		}
+	} else {
+		scheduler.cancel(GBAScheduler::kEventHBlank);
 	}
-	
-	if (((_statusRegister & 0xf0) >> 8) == _refreshCoordinate.y) {
-		_statusRegister |= kStatusFlagVCounter;
+
+	uint32_t vCountSetting = _statusRegister >> 8;
+	if ((_statusRegister & kStatusFlagVCounterMatchIRQEnable) && vCountSetting < 228) {
+		scheduler.schedule(GBAScheduler::kEventVCounterMatch, _nextTime(vCountSetting * kCyclesPerScanline, kCyclesPerFrame));
+	} else {
+		scheduler.cancel(GBAScheduler::kEventVCounterMatch);
 	}
+}
 
-	// fire interrupts
-	
-	uint16_t interrupts = 0;
+void GBAVideoController::_beginHBlank(uint64_t time) {
+	_gba->interruptRequest(GameBoyAdvance::kInterruptHBlank);
+	_gba->scheduler().schedule(GBAScheduler::kEventHBlank, time + kCyclesPerScanline);
+}
 
-	if (_refreshCoordinate.x == 240 && (_statusRegister & kStatusFlagHBlankIRQEnable)) {
-		interrupts |= GameBoyAdvance::kInterruptHBlank;
+void GBAVideoController::_beginVBlank(uint64_t time) {
+	{
+		// every drawn scanline has been rendered by now, so the frame is done
+		std::unique_lock<std::mutex> lock(_renderMutex);
+		std::swap(_drawPixelBuffer, _readyPixelBuffer);
 	}
 
-	if (_refreshCoordinate.x == 0) {
-		if (_refreshCoordinate.y == 160 && (_statusRegister & kStatusFlagVBlankIRQEnable)) {
-			interrupts |= GameBoyAdvance::kInterruptVBlank;
-		}
-	
-		if (((_statusRegister & 0xf0) >> 8) == _refreshCoordinate.y && (_statusRegister & kStatusFlagVCounterMatchIRQEnable)) {
-			interrupts |= GameBoyAdvance::kInterruptVCounterMatch;
-		}
-	}
-	
-	if (interrupts) {
-		_gba->interruptRequest(interrupts);
+	if (_statusRegister & kStatusFlagVBlankIRQEnable) {
+		_gba->interruptRequest(GameBoyAdvance::kInterruptVBlank);
 	}
+
+	_gba->scheduler().schedule(GBAScheduler::kEventVBlank, time + kCyclesPerFrame);
+}
+
+void GBAVideoController::_beginVCounterMatch(uint64_t time) {
+	_gba->interruptRequest(GameBoyAdvance::kInterruptVCounterMatch);
+	_gba->scheduler().schedule(GBAScheduler::kEventVCounterMatch, time + kCyclesPerFrame);
 }
 
 void GBAVideoController::render() {
 	glEnable(GL_TEXTURE_2D);
 
 	glActiveTexture(GL_TEXTURE0);
+
+	if (_texture == GL_INVALID_VALUE) {
+		// created here rather than in the constructor so that the controller doesn't need a gl context until it's rendered
+		glGenTextures(1, &_texture);
+		glBindTexture(GL_TEXTURE_2D, _texture);
+
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 240, 160, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
 	glBindTexture(GL_TEXTURE_2D, _texture);
 
 	{
@@ -110,7 +172,7 @@ void GBAVideoController::render() {
 		std::swap(_readyPixelBuffer, _renderPixelBuffer);
 	}
 	
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 240, 160, GL_RGB, GL_UNSIGNED_BYTE, _renderPixelBuffer);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 240, 160, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, _renderPixelBuffer);
 
 	glBegin(GL_TRIANGLE_STRIP);
 
@@ -129,9 +191,19 @@ void GBAVideoController::render() {
 	glEnd();
 }
 
+void GBAVideoController::copyFrame(uint32_t* destination) {
+	std::unique_lock<std::mutex> lock(_renderMutex);
+	memcpy(destination, _readyPixelBuffer, 240 * 160 * sizeof(Pixel));
+}
+
 void GBAVideoController::updateStatusRegister(uint16_t value) {
-	_statusRegister = (_statusRegister & 0x0007) | (value & 0xfff8);
-	printf("video status register update: %08x\n", _statusRegister & 0xfff8);
+	_statusRegister = value & 0xfff8;
+	printf("video status register update: %08x\n", _statusRegister);
+
+	_scheduleInterrupts();
+
+	// the cpu's current run may have been planned around the old events
+	_gba->cpu().requestExit();
 }
 
 void GBAVideoController::setControlRegister(uint16_t value) {
@@ -146,116 +218,151 @@ void GBAVideoController::setBackground(int n, const Background& background) {
 	_backgrounds[n] = background;
 }
 
-void GBAVideoController::_drawPixel(const Window& window, int x, int y, const Pixel& pixel) {
-	if (x >= window.width || x < 0 || y >= window.height || y < 0) { return; }
-	_drawPixelBuffer[window.x + x + (window.y + y) * 240] = pixel;
-}
+void GBAVideoController::_drawScanline(uint64_t time) {
+	auto y = static_cast<uint32_t>((time - _startTime) % kCyclesPerFrame / kCyclesPerScanline);
 
-void GBAVideoController::_drawBitmap(const Window& window, int x, int y, int w, int h, uint32_t frameAddress, int frameWidth) {
-	for (int bx = 0; bx < w; ++bx) {
-		for (int by = 0; by < h; ++by) {
-			auto pixel = *reinterpret_cast<LittleEndian<uint16_t>*>(_videoRAM.storage() + frameAddress) + bx + by * frameWidth;
-			_drawPixel(window, x + bx, y + by, pixel);
-		}
+	// the next drawn scanline's h-blank, skipping over v-blank
+	_gba->scheduler().schedule(GBAScheduler::kEventScanline, time + (y < 159 ? kCyclesPerScanline : kCyclesPerFrame - 159 * kCyclesPerScanline));
+
+	auto row = _drawPixelBuffer + y * 240;
+
+	if (_controlRegister & kControlFlagForcedBlank) {
+		_kernels.fill(row, 0xffffffff, 240);
+		return;
 	}
-}
 
-void GBAVideoController::_drawTileBackground(const Window& window, int bg, bool textMode) {
-	auto& background = _backgrounds[bg];
-	
-	if (textMode) {
-		_drawTextModeBackgroundMap(window, _backgroundXOffsets[bg], _backgroundYOffsets[bg], background.mapBase, background.tiles * 0x4000, background.isFullPalette);
-	} else {
-		// TODO
-		for (int bgx = 0; bgx < window.width; ++bgx) {
-			for (int bgy = 0; bgy < window.height; ++bgy) {
-				_drawPixel(window, window.x + bgx, window.y + bgy, Pixel(100, 150, 100));
+	_updatePalette();
+
+	uint32_t backgrounds = 0;
+	auto mode = _controlRegister & kControlMaskBGMode;
+
+	switch (mode) {
+		case 0:
+		case 1:
+			// TODO: bg 2 is an affine background in mode 1
+			for (int bg = 0; bg < (mode ? 2 : 4); ++bg) {
+				if (_controlRegister & (kControlFlagBG0Enable << bg)) {
+					_drawTextBackgroundLine(bg, y, _backgroundLines[bg]);
+					backgrounds |= (1 << bg);
+				}
 			}
-		}
+			break;
+		case 2:
+			// TODO: affine backgrounds
+			break;
+		case 3:
+		case 4:
+		case 5:
+			if (_controlRegister & kControlFlagBG2Enable) {
+				_drawBitmapLine(y, _backgroundLines[2]);
+				backgrounds |= (1 << 2);
+			}
+			break;
+		default:
+			_kernels.fill(row, 0xff000000, 240);
+			return;
 	}
-}
 
-void GBAVideoController::_drawTextModeBackgroundMap(const Window& window, int x, int y, uint32_t address, uint32_t tiles, bool isFullPalette) {
-	auto entries = reinterpret_cast<LittleEndian<uint16_t>*>(_videoRAM.storage() + address);
-
-	for (int tx = 0; tx < 32; ++tx) {
-		for (int ty = 0; ty < 32; ++ty) {
-			auto entry = entries[tx + ty * 32];
-			auto tile = BITFIELD_UINT16(entry, 9, 0);
-			auto flipHorizontally = BIT10(entry);
-			auto flipVertically = BIT11(entry);
-			auto palette = isFullPalette ? -1 : BITFIELD_UINT16(entry, 15, 12);
-			_drawTile(window, x + tx * 8, y + ty * 8, tiles + tile * (isFullPalette ? 64 : 32), true, palette, flipHorizontally, flipVertically);
-		}
+	_objectPriorityMask = 0;
+	if (_controlRegister & kControlFlagOBJEnable) {
+		_drawObjectLine(y);
 	}
+
+	_compositeLine(y, backgrounds);
 }
 
-void GBAVideoController::_updateDisplay() {
-	Window window(0, 0, 240, 160);
-	
-	for (int x = 0; x < 240; ++x) {
-		for (int y = 0; y < 160; ++y) {
-			_drawPixel(window, x, y, Pixel(*reinterpret_cast<LittleEndian<uint16_t>*>(_paletteRAM.storage())));
+void GBAVideoController::_drawTextBackgroundLine(int bg, uint32_t y, Pixel* line) {
+	auto& background = _backgrounds[bg];
+	auto videoRAM = _videoRAM.storage();
+
+	// screen sizes 1 and 3 are 512 pixels wide, and 2 and 3 are 512 tall. each 256x256 quarter has its own map
+	uint32_t widthMask = (background.screenSize & 1) ? 511 : 255;
+	uint32_t heightMask = (background.screenSize & 2) ? 511 : 255;
+
+	uint32_t by = (y + _backgroundYOffsets[bg]) & heightMask;
+	uint32_t mapRow = background.mapBase * 0x800 + ((by & 255) >> 3) * 64;
+	if (by >= 256) {
+		mapRow += (background.screenSize == 3 ? 0x1000 : 0x800);
+	}
+
+	uint32_t tiles = background.tiles * 0x4000;
+	auto ty = by & 7;
+
+	static const uint8_t kEmptyRow[8] = {0};
+
+	for (uint32_t x = 0; x < 240; ) {
+		uint32_t bx = (x + _backgroundXOffsets[bg]) & widthMask;
+		uint16_t entry = *reinterpret_cast<LittleEndian<uint16_t>*>(videoRAM + mapRow + (bx >= 256 ? 0x800 : 0) + ((bx & 255) >> 3) * 2);
+
+		auto address = tiles + BITFIELD_UINT16(entry, 9, 0) * (background.isFullPalette ? 64 : 32);
+		auto row = address < 0x10000 ? _tileRow(address, background.isFullPalette, BIT10(entry), BIT11(entry) ? 7 - ty : ty) : kEmptyRow;
+		uint32_t paletteBank = background.isFullPalette ? 0 : (BITFIELD_UINT16(entry, 15, 12) << 4);
+
+		for (auto tx = bx & 7; tx < 8 && x < 240; ++tx, ++x) {
+			line[x] = row[tx] ? _palette[paletteBank | row[tx]] : kTransparent;
 		}
 	}
-	
+}
+
+void GBAVideoController::_drawBitmapLine(uint32_t y, Pixel* line) {
+	auto videoRAM = _videoRAM.storage();
+	uint32_t frame = (_controlRegister & kControlFlagDisplayFrame) ? 0xa000 : 0;
+
 	switch (_controlRegister & kControlMaskBGMode) {
-		case 0:
-			// TODO: respect priority
-			if (_controlRegister & kControlFlagBG0Enable) {
-				_drawTileBackground(window, 0, true);
-			}
-			if (_controlRegister & kControlFlagBG1Enable) {
-				_drawTileBackground(window, 1, true);
-			}
-			if (_controlRegister & kControlFlagBG2Enable) {
-				_drawTileBackground(window, 2, true);
-			}
-			if (_controlRegister & kControlFlagBG3Enable) {
-				_drawTileBackground(window, 3, true);
-			}
-		case 1:
-		case 2:
-			// TODO
-			break;
 		case 3:
-			_drawBitmap(window, 0, 0, 240, 160, 0, 240);
+			_convertColors(line, videoRAM + y * 240 * 2, 240);
 			break;
 		case 4:
-			_drawBitmap(window, 0, 0, 240, 160, (_controlRegister & kControlFlagDisplayFrame) ? 0x5000 : 0, 240);
+			_kernels.lookUp(line, videoRAM + frame + y * 240, _palette, 240);
 			break;
 		case 5:
-			_drawBitmap(window, 0, 0, 160, 128, (_controlRegister & kControlFlagDisplayFrame) ? 0x5000 : 0, 160);
-			break;
-		default:
-			for (int x = 0; x < 240; ++x) {
-				for (int y = 0; y < 160; ++y) {
-					_drawPixel(window, x, y, Pixel(0, 0, 0));
-				}
+			// 160x128 in the top left corner
+			if (y < 128) {
+				_convertColors(line, videoRAM + frame + y * 160 * 2, 160);
+				_kernels.fill(line + 160, kTransparent, 80);
+			} else {
+				_kernels.fill(line, kTransparent, 240);
 			}
+			break;
 	}
-	
-	if (_controlRegister & kControlFlagOBJEnable) {
-		_drawObjects(window);
+}
+
+void GBAVideoController::_convertColors(Pixel* destination, const uint8_t* source, uint32_t count) {
+	// the kernels take colors in host order, which is how video ram stores them on little endian hosts
+	uint16_t one = 1;
+	if (_isGammaLinear && *reinterpret_cast<uint8_t*>(&one)) {
+		_kernels.convert(destination, reinterpret_cast<const uint16_t*>(source), count);
+		return;
 	}
 
-	std::unique_lock<std::mutex> lock(_renderMutex);
-	std::swap(_drawPixelBuffer, _readyPixelBuffer);
+	auto colors = reinterpret_cast<const LittleEndian<uint16_t>*>(source);
+	for (uint32_t i = 0; i < count; ++i) {
+		destination[i] = _colors[colors[i] & 0x7fff];
+	}
 }
 
-void GBAVideoController::_drawObjects(const Window& window) {	
+void GBAVideoController::_drawObjectLine(uint32_t y) {
+	auto attributes = reinterpret_cast<LittleEndian<uint16_t>*>(_objectAttributeRAM.storage());
+
+	// in bitmap modes, the first half of the object tiles is taken by the frame buffers
+	bool isBitmapMode = (_controlRegister & kControlMaskBGMode) >= 3;
+
+	std::fill(_objectPriorities, _objectPriorities + 240, 4);
+
 	for (int i = 0; i < 128; ++i) {
-		uint16_t attributes0 = *reinterpret_cast<LittleEndian<uint16_t>*>(reinterpret_cast<uint8_t*>(_objectAttributeRAM.storage()) + i * 8);
-		uint16_t attributes1 = *reinterpret_cast<LittleEndian<uint16_t>*>(reinterpret_cast<uint8_t*>(_objectAttributeRAM.storage()) + i * 8 + 2);
-		uint16_t attributes2 = *reinterpret_cast<LittleEndian<uint16_t>*>(reinterpret_cast<uint8_t*>(_objectAttributeRAM.storage()) + i * 8 + 4);
+		uint16_t attributes0 = attributes[i * 4];
+		uint16_t attributes1 = attributes[i * 4 + 1];
+		uint16_t attributes2 = attributes[i * 4 + 2];
 
 		if (!BIT8(attributes0) && BIT9(attributes0)) {
 			// hidden
 			continue;
 		}
 
-		auto x = BITFIELD_UINT32(attributes1, 8, 0);
-		auto y = BITFIELD_UINT32(attributes0, 7, 0);
+		if (BITFIELD_UINT16(attributes0, 11, 10) == 2) {
+			// TODO: object windows
+			continue;
+		}
 
 		int width = 0;
 		int height = 0;
@@ -266,67 +373,191 @@ void GBAVideoController::_drawObjects(const Window& window) {
 		if (!shape) {
 			// square
 			width = height = (8 << size);
-		} else {
+		} else if (shape < 3) {
 			// horizontal or vertical
-			switch (size) {
-				case 0:
-					width  = 16;
-					height =  8;
-					break;
-				case 1:
-					width  = 32;
-					height =  8;
-					break;
-				case 2:
-					width  = 32;
-					height = 16;
-					break;
-				case 3:
-					width  = 64;
-					height = 32;
-					break;
-			}
+			static const int sizes[4][2] = {{16, 8}, {32, 8}, {32, 16}, {64, 32}};
+			width = sizes[size][0];
+			height = sizes[size][1];
 			if (shape == 2) {
 				std::swap(width, height);
 			}
+		} else {
+			continue;
+		}
+
+		// positions wrap around, so objects can hang off the top and left edges
+		int row = (y - BITFIELD_UINT32(attributes0, 7, 0)) & 0xff;
+		int left = BITFIELD_UINT32(attributes1, 8, 0);
+		if (left >= 240) {
+			left -= 512;
 		}
-		
+
+		// TODO: rotation and scaling. affine objects are drawn untransformed, centered if their bounds are doubled
 		if (BIT8(attributes0) && BIT9(attributes0)) {
-			width <<= 1;
-			height <<= 1;
+			row -= height >> 1;
+			left += width >> 1;
+			if (row < 0) {
+				continue;
+			}
+		}
+
+		if (row >= height) {
+			continue;
 		}
 
-		auto tilesAddress = (_controlRegister & kControlMaskBGMode) < 3 ? 0x00010000 : 0x00014000;
-		auto tileBase = BITFIELD_UINT32(attributes2, 9, 0);
-
-		for (int row = 0; row < (height >> 3); ++row) {
-			int rowTile = tileBase + (
-				(_controlRegister & kControlFlagOBJTileMapping)
-					// one dimensional mapping
-					? (row * (width >> (BIT13(attributes0) ? 2 : 3)))
-					// two dimensional mapping
-					: (row * 0x20)
-			);
-			for (int col = 0; col < (width >> 3); ++col) {
-				int tile = rowTile + (col << (BIT13(attributes0) ? 1 : 0));
-				_drawTile(window, x + (col << 3), y + (row << 3), tilesAddress + tile * 32, false, BIT13(attributes0) ? -1 : BITFIELD_UINT32(attributes2, 15, 12));
+		bool flipHorizontally = !BIT8(attributes0) && BIT12(attributes1);
+		if (!BIT8(attributes0) && BIT13(attributes1)) {
+			row = height - 1 - row;
+		}
+
+		bool isFullPalette = BIT13(attributes0);
+		uint8_t priority = BITFIELD_UINT16(attributes2, 11, 10);
+		uint32_t paletteBank = BITFIELD_UINT16(attributes2, 15, 12) << 4;
+
+		int rowTile = BITFIELD_UINT32(attributes2, 9, 0) + (
+			(_controlRegister & kControlFlagOBJTileMapping)
+				// one dimensional mapping
+				? ((row >> 3) * (width >> 3) << (isFullPalette ? 1 : 0))
+				// two dimensional mapping
+				: ((row >> 3) * 0x20)
+		);
+
+		for (int col = 0; col < width; col += 8) {
+			if (left + col + 8 <= 0 || left + col >= 240) {
+				continue;
+			}
+
+			int tile = (rowTile + (((flipHorizontally ? width - 8 - col : col) >> 3) << (isFullPalette ? 1 : 0))) & 0x3ff;
+			if (isBitmapMode && tile < 512) {
+				continue;
+			}
+
+			auto tileRow = _tileRow(0x10000 + tile * 32, isFullPalette, flipHorizontally, row & 7);
+
+			for (int tx = std::max(0, -(left + col)); tx < 8 && left + col + tx < 240; ++tx) {
+				int x = left + col + tx;
+				if (!tileRow[tx] || _objectPriorities[x] <= priority) {
+					// transparent, or an earlier object or one with a higher priority is already here
+					continue;
+				}
+
+				_objectLine[x] = _palette[0x100 | (isFullPalette ? tileRow[tx] : paletteBank | tileRow[tx])];
+				_objectPriorities[x] = priority;
+				_objectPriorityMask |= (1 << priority);
 			}
 		}
 	}
 }
 
-void GBAVideoController::_drawTile(const Window& window, int x, int y, uint32_t address, bool isBackground, int palette, bool flipHorizontally, bool flipVertically) {
-	auto tileData = _videoRAM.storage() + address;
-	auto paletteData = reinterpret_cast<LittleEndian<uint16_t>*>(_paletteRAM.storage()) + (isBackground ? 0 : 0x100) + (palette < 0 ? 0 : (palette << 4));
-	for (int ty = 0; ty < 8; ++ty) {
-		for (int tx = 0; tx < 8; ++tx) {
-			int pixel = ty * 8 + tx;
-			int color = palette < 0 ? *(tileData + pixel) : ((pixel & 1) ? ((*(tileData + (pixel >> 1)) & 0xf0) >> 4) : (*(tileData + (pixel >> 1)) & 0x0f));
-			if (color || isBackground) {
-				_drawPixel(window, x + (flipHorizontally ? (8 - tx) : tx), y + (flipVertically ? (8 - ty) : ty), Pixel(paletteData[color]));
-			}
+const uint8_t* GBAVideoController::_tileRow(uint32_t address, bool isFullPalette, bool flipHorizontally, uint32_t row) {
+	static const uint32_t kDirtyBlockSize = MemoryInterface<uint32_t>::kDirtyBlockSize;
+
+	auto entry = address / 32;
+	auto lastBlock = std::min(address + (isFullPalette ? 63 : 31), _videoRAM.size() - 1) / kDirtyBlockSize;
+	for (auto block = address / kDirtyBlockSize; block <= lastBlock; ++block) {
+		if (_videoRAM.isDirty(block * kDirtyBlockSize, kDirtyBlockSize)) {
+			_invalidateTiles(block);
 		}
 	}
+
+	if (!_isTileCached[isFullPalette][entry]) {
+		_decodeTile(entry, isFullPalette);
+	}
+
+	return _tileCache[isFullPalette] + entry * 128 + (flipHorizontally ? 64 : 0) + row * 8;
+}
+
+void GBAVideoController::_invalidateTiles(uint32_t block) {
+	static const uint32_t kDirtyBlockSize = MemoryInterface<uint32_t>::kDirtyBlockSize;
+	static const uint32_t kEntriesPerBlock = kDirtyBlockSize / 32;
+
+	auto first = block * kEntriesPerBlock;
+	std::fill(_isTileCached[0] + first, _isTileCached[0] + first + kEntriesPerBlock, 0);
+
+	// 8bpp tiles are 64 bytes, so the one starting just before the block reaches into it
+	std::fill(_isTileCached[1] + (first ? first - 1 : 0), _isTileCached[1] + first + kEntriesPerBlock, 0);
+
+	_videoRAM.clearDirty(block * kDirtyBlockSize, kDirtyBlockSize);
+}
+
+void GBAVideoController::_decodeTile(uint32_t entry, bool isFullPalette) {
+	auto videoRAM = _videoRAM.storage();
+	auto address = entry * 32;
+	auto tile = _tileCache[isFullPalette] + entry * 128;
+
+	for (uint32_t i = 0; i < 64; ++i) {
+		if (isFullPalette) {
+			tile[i] = address + i < _videoRAM.size() ? videoRAM[address + i] : 0;
+		} else {
+			tile[i] = (videoRAM[address + (i >> 1)] >> ((i & 1) << 2)) & 0xf;
+		}
+	}
+
+	auto flipped = tile + 64;
+	for (uint32_t row = 0; row < 8; ++row) {
+		for (uint32_t col = 0; col < 8; ++col) {
+			flipped[row * 8 + col] = tile[row * 8 + 7 - col];
+		}
+	}
+
+	_isTileCached[isFullPalette][entry] = 1;
+}
+
+void GBAVideoController::_compositeLine(uint32_t y, uint32_t backgrounds) {
+	auto line = _drawPixelBuffer + y * 240;
+	_kernels.fill(line, _palette[0], 240);
+
+	if (!backgrounds && !_objectPriorityMask) {
+		// nothing on this line but the backdrop
+		return;
+	}
+
+	// lower priority values go on top. at equal priorities, objects go over backgrounds and lower numbered backgrounds
+	// go over higher numbered ones
+	for (int priority = 3; priority >= 0; --priority) {
+		for (int bg = 3; bg >= 0; --bg) {
+			if (!(backgrounds & (1 << bg)) || _backgrounds[bg].priority != priority) { continue; }
+
+			_kernels.merge(line, _backgroundLines[bg], 240);
+		}
+
+		if (!(_objectPriorityMask & (1 << priority))) { continue; }
+
+		_kernels.mergeMatching(line, _objectLine, _objectPriorities, priority, 240);
+	}
+}
+
+void GBAVideoController::_updatePalette() {
+	static const uint32_t kDirtyBlockSize = MemoryInterface<uint32_t>::kDirtyBlockSize;
+
+	auto entries = reinterpret_cast<LittleEndian<uint16_t>*>(_paletteRAM.storage());
+
+	for (uint32_t block = 0; block < _paletteRAM.size() / kDirtyBlockSize; ++block) {
+		if (!_paletteRAM.isDirty(block * kDirtyBlockSize, kDirtyBlockSize)) { continue; }
+
+		for (uint32_t i = block * kDirtyBlockSize / 2; i < (block + 1) * kDirtyBlockSize / 2; ++i) {
+			_palette[i] = _colors[entries[i] & 0x7fff];
+		}
+	}
+
+	_paletteRAM.clearDirtyBlocks();
+}
+
+void GBAVideoController::setGamma(double gamma) {
+	uint8_t levels[32];
+	for (int i = 0; i < 32; ++i) {
+		levels[i] = static_cast<uint8_t>(std::round(255.0 * std::pow(i / 31.0, gamma)));
+	}
+
+	_isGammaLinear = (gamma == 1.0);
+
+	// colors are 5 bits each of red, green, and blue from the least significant bits up
+	for (uint32_t color = 0; color < 0x8000; ++color) {
+		_colors[color] = 0xff000000 | (levels[color & 0x1f] << 16) | (levels[(color >> 5) & 0x1f] << 8) | levels[(color >> 10) & 0x1f];
+	}
+
+	// the whole palette needs converting again
+	_paletteRAM.markDirty(0, _paletteRAM.size());
 }
 
 GBAVideoController::Background::Background(uint16_t data)
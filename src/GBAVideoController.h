@@ -1,5 +1,6 @@
 #pragma once
 
+#include "GBAVideoKernels.h"
 #include "Memory.h"
 
 #include <OpenGL/OpenGL.h>
@@ -15,14 +16,24 @@ class GBAVideoController {
 		GBAVideoController(GameBoyAdvance* gba);
 		virtual ~GBAVideoController();
 	
-		void cycle();
-
 		/**
 		* Can be called from any thread.
 		*/
 		void render();
 
-		uint16_t currentScanline() const { return _refreshCoordinate.y; }
+		/**
+		* Copies the most recently finished frame that hasn't been rendered yet, as 240x160 0xAARRGGBB pixels. Can be
+		* called from any thread.
+		*/
+		void copyFrame(uint32_t* destination);
+
+		uint16_t currentScanline() const;
+
+		/**
+		* Sets the gamma applied to colors on their way to the display. The default of 1.0 leaves them linear. This must
+		* be called from the thread running the emulation.
+		*/
+		void setGamma(double gamma);
 		
 		enum StatusFlag : uint16_t {
 			kStatusFlagVBlank                 = (1 << 0),
@@ -33,7 +44,21 @@ class GBAVideoController {
 			kStatusFlagVCounterMatchIRQEnable = (1 << 5),
 		};
 		
-		uint16_t statusRegister() const { return _statusRegister; }
+		/**
+		* The blank and v-counter flags are worked out from the current cycle when this is called.
+		*/
+		uint16_t statusRegister() const;
+
+		/**
+		* Returns the next time VCOUNT or the flags in the status register change.
+		*/
+		uint64_t nextStatusChangeTime() const;
+
+		/**
+		* Returns the next time a drawn scanline's h-blank begins, or the v-blank period begins.
+		*/
+		uint64_t nextHBlankTime() const;
+		uint64_t nextVBlankTime() const;
 		void updateStatusRegister(uint16_t value);
 
 		enum ControlFlag : uint16_t {
@@ -81,9 +106,9 @@ class GBAVideoController {
 	private:
 		GameBoyAdvance* const _gba = nullptr;
 	
-		Memory<uint32_t> _paletteRAM{0x400};
-		Memory<uint32_t> _videoRAM{0x18000};
-		Memory<uint32_t> _objectAttributeRAM{0x400};
+		Memory<uint32_t> _paletteRAM{0x400, Memory<uint32_t>::kFlagDirtyTracking};
+		Memory<uint32_t> _videoRAM{0x18000, Memory<uint32_t>::kFlagMappable | Memory<uint32_t>::kFlagDirtyTracking};
+		Memory<uint32_t> _objectAttributeRAM{0x400, Memory<uint32_t>::kFlagDirtyTracking};
 		
 		GLuint _texture = GL_INVALID_VALUE;
 		
@@ -92,45 +117,94 @@ class GBAVideoController {
 		
 		std::mutex _renderMutex;
 		
-		struct PixelCoordinate {
-			PixelCoordinate(uint16_t x, uint16_t y) : x(x), y(y) {}
-			uint16_t x, y;
-		};
+		/**
+		* Pixels are 0xAARRGGBB, which is the host's native texture format. The alpha is always 0xff, so layers use 0 for
+		* the pixels they don't cover.
+		*/
+		typedef uint32_t Pixel;
 
-		struct Pixel {
-			Pixel() : red(0), green(0), blue(0) {}
-			Pixel(uint16_t packed) : red(((packed >> 10) & 0x1f) << 3), green(((packed >> 5) & 0x1f) << 3), blue((packed & 0x1f) << 3) {}
-			Pixel(uint8_t red, uint8_t green, uint8_t blue) : red(red), green(green), blue(blue) {}
-			uint8_t red, green, blue;
-		};
+		static const Pixel kTransparent = 0;
 
-		PixelCoordinate _refreshCoordinate{0, 0};
+		/**
+		* Maps 15-bit colors to pixels, with the gamma applied.
+		*/
+		Pixel _colors[0x8000];
+
+		/**
+		* With no gamma, the kernels can convert colors arithmetically and give the same results as the table.
+		*/
+		bool _isGammaLinear = true;
+
+		const GBAVideoKernels& _kernels = GBAVideoKernels::best();
+
+		/**
+		* The palette converted to pixels. Writes to palette ram mark their blocks dirty, and those entries are converted
+		* again before the next scanline is drawn.
+		*/
+		Pixel _palette[0x200];
+
+		void _updatePalette();
+
+		/**
+		* Each scanline is 308 pixels of four cycles each. The first 240 pixels are drawn, and the rest are horizontal
+		* blank. Each frame is 228 scanlines, and the last 68 are vertical blank.
+		*/
+		static const uint32_t kCyclesPerScanline = 308 * 4;
+		static const uint32_t kCyclesPerScanlineDraw = 240 * 4;
+		static const uint32_t kCyclesPerFrame = 228 * kCyclesPerScanline;
+
+		/**
+		* The display position isn't stored. It's worked out from the time elapsed since _startTime, so the only events
+		* scheduled are the ones that raise interrupts or refresh the display.
+		*/
+		uint64_t _startTime = 0;
+
+		uint32_t _frameCycle() const;
+		uint64_t _nextTime(uint32_t offset, uint32_t period) const;
+
+		void _scheduleInterrupts();
+		void _beginHBlank(uint64_t time);
+		void _beginVBlank(uint64_t time);
+		void _beginVCounterMatch(uint64_t time);
 			
 		Background _backgrounds[4];
 		uint16_t _backgroundXOffsets[4]{0};
 		uint16_t _backgroundYOffsets[4]{0};
 
-		void _updateDisplay();
-		
-		struct Window {
-			Window() {}
-			Window(int x, int y, int width, int height) : x(x), y(y), width(width), height(height) {}
-			
-			int x = 0;
-			int y = 0;
-			int width = 0;
-			int height = 0;
-		};
-		
-		void _drawObjects(const Window& window);
-		void _drawTile(const Window& window, int x, int y, uint32_t address, bool isBackground, int palette = -1, bool flipHorizontally = false, bool flipVertically = false);
-		void _drawPixel(const Window& window, int x, int y, const Pixel& pixel);
-		void _drawBitmap(const Window& window, int x, int y, int w, int h, uint32_t frameAddress, int frameWidth);
-		void _drawTileBackground(const Window& window, int bg, bool textMode);
-		void _drawTextModeBackgroundMap(const Window& window, int x, int y, uint32_t address, uint32_t tiles, bool isFullPalette);
-
-		int _cycleCounter = 0;
-		
+		/**
+		* Each drawn scanline is rendered when its h-blank begins, so register changes made between scanlines show up.
+		* Layers are drawn into line buffers, with kTransparent marking the pixels they don't cover, and then composited
+		* into the frame being drawn.
+		*/
+		Pixel _backgroundLines[4][240];
+		Pixel _objectLine[240];
+		uint8_t _objectPriorities[240];
+		uint32_t _objectPriorityMask = 0;
+
+		/**
+		* Tiles decoded to one byte per pixel, each followed by its horizontally flipped copy. Every 32-byte boundary in
+		* video ram has an entry for each color depth. Writes to video ram invalidate the entries they touch, and
+		* entries are decoded again the next time they're used.
+		*/
+		static const uint32_t kTileCacheEntries = 0x18000 / 32;
+
+		uint8_t* _tileCache[2] = {nullptr, nullptr};
+		uint8_t _isTileCached[2][kTileCacheEntries];
+
+		/**
+		* Returns the eight color indices of one row of the tile at the given address.
+		*/
+		const uint8_t* _tileRow(uint32_t address, bool isFullPalette, bool flipHorizontally, uint32_t row);
+		void _invalidateTiles(uint32_t block);
+		void _decodeTile(uint32_t entry, bool isFullPalette);
+
+		void _drawScanline(uint64_t time);
+		void _drawTextBackgroundLine(int bg, uint32_t y, Pixel* line);
+		void _drawBitmapLine(uint32_t y, Pixel* line);
+		void _convertColors(Pixel* destination, const uint8_t* source, uint32_t count);
+		void _drawObjectLine(uint32_t y);
+		void _compositeLine(uint32_t y, uint32_t backgrounds);
+
 		// protected by _renderMutex
 		Pixel* _readyPixelBuffer = nullptr;
 
@@ -0,0 +1,253 @@
+#include "GBAVideoKernels.h"
+
+#include <initializer_list>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define GBA_VIDEO_KERNELS_X86 1
+#else
+#define GBA_VIDEO_KERNELS_X86 0
+#endif
+
+namespace {
+
+/**
+* Scales a 5-bit component to 8 bits, rounding to nearest. This is round(c * 255 / 31) without the division.
+*/
+inline uint32_t Scale(uint32_t component) {
+	return (component * 527 + 23) >> 6;
+}
+
+void ConvertPortable(uint32_t* destination, const uint16_t* source, uint32_t count) {
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t color = source[i];
+		destination[i] = 0xff000000 | (Scale(color & 0x1f) << 16) | (Scale((color >> 5) & 0x1f) << 8) | Scale((color >> 10) & 0x1f);
+	}
+}
+
+void LookUpPortable(uint32_t* destination, const uint8_t* source, const uint32_t* palette, uint32_t count) {
+	for (uint32_t i = 0; i < count; ++i) {
+		destination[i] = source[i] ? palette[source[i]] : 0;
+	}
+}
+
+void FillPortable(uint32_t* destination, uint32_t value, uint32_t count) {
+	for (uint32_t i = 0; i < count; ++i) {
+		destination[i] = value;
+	}
+}
+
+void MergePortable(uint32_t* destination, const uint32_t* source, uint32_t count) {
+	for (uint32_t i = 0; i < count; ++i) {
+		if (source[i]) {
+			destination[i] = source[i];
+		}
+	}
+}
+
+void MergeMatchingPortable(uint32_t* destination, const uint32_t* source, const uint8_t* keys, uint8_t key, uint32_t count) {
+	for (uint32_t i = 0; i < count; ++i) {
+		if (keys[i] == key) {
+			destination[i] = source[i];
+		}
+	}
+}
+
+const GBAVideoKernels kPortable = {
+	GBAVideoKernels::kInstructionSetPortable,
+	&ConvertPortable,
+	&LookUpPortable,
+	&FillPortable,
+	&MergePortable,
+	&MergeMatchingPortable,
+};
+
+#if GBA_VIDEO_KERNELS_X86
+
+/**
+* Converts eight 15-bit colors at a time. The components are scaled in 16-bit lanes, then red and alpha are
+* interleaved with green and blue to form the pixels.
+*/
+inline void ConvertSSE2(__m128i colors, __m128i* destination) {
+	auto mask = _mm_set1_epi16(0x1f);
+	auto multiplier = _mm_set1_epi16(527);
+	auto bias = _mm_set1_epi16(23);
+
+	auto red = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(colors, mask), multiplier), bias), 6);
+	auto green = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(colors, 5), mask), multiplier), bias), 6);
+	auto blue = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(colors, 10), mask), multiplier), bias), 6);
+
+	auto greenBlue = _mm_or_si128(_mm_slli_epi16(green, 8), blue);
+	auto alphaRed = _mm_or_si128(red, _mm_set1_epi16(static_cast<int16_t>(0xff00)));
+
+	_mm_storeu_si128(destination, _mm_unpacklo_epi16(greenBlue, alphaRed));
+	_mm_storeu_si128(destination + 1, _mm_unpackhi_epi16(greenBlue, alphaRed));
+}
+
+void ConvertSSE2(uint32_t* destination, const uint16_t* source, uint32_t count) {
+	uint32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		ConvertSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i)), reinterpret_cast<__m128i*>(destination + i));
+	}
+	ConvertPortable(destination + i, source + i, count - i);
+}
+
+void FillSSE2(uint32_t* destination, uint32_t value, uint32_t count) {
+	auto vector = _mm_set1_epi32(static_cast<int32_t>(value));
+	uint32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), vector);
+	}
+	FillPortable(destination + i, value, count - i);
+}
+
+void MergeSSE2(uint32_t* destination, const uint32_t* source, uint32_t count) {
+	uint32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+		auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(destination + i));
+		auto isTransparent = _mm_cmpeq_epi32(s, _mm_setzero_si128());
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_or_si128(_mm_and_si128(isTransparent, d), _mm_andnot_si128(isTransparent, s)));
+	}
+	MergePortable(destination + i, source + i, count - i);
+}
+
+void MergeMatchingSSE2(uint32_t* destination, const uint32_t* source, const uint8_t* keys, uint8_t key, uint32_t count) {
+	auto keyVector = _mm_set1_epi8(static_cast<char>(key));
+	uint32_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		// widen the byte masks to one per pixel
+		auto matches = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), keyVector);
+		__m128i masks16[2] = {_mm_unpacklo_epi8(matches, matches), _mm_unpackhi_epi8(matches, matches)};
+		for (int j = 0; j < 4; ++j) {
+			auto mask = (j & 1) ? _mm_unpackhi_epi16(masks16[j >> 1], masks16[j >> 1]) : _mm_unpacklo_epi16(masks16[j >> 1], masks16[j >> 1]);
+			auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + j * 4));
+			auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(destination + i + j * 4));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + j * 4), _mm_or_si128(_mm_and_si128(mask, s), _mm_andnot_si128(mask, d)));
+		}
+	}
+	MergeMatchingPortable(destination + i, source + i, keys + i, key, count - i);
+}
+
+const GBAVideoKernels kSSE2 = {
+	GBAVideoKernels::kInstructionSetSSE2,
+	&ConvertSSE2,
+	// sse2 has no gather, and a portable lookup is as good as any shuffle-based one for 256-entry palettes
+	&LookUpPortable,
+	&FillSSE2,
+	&MergeSSE2,
+	&MergeMatchingSSE2,
+};
+
+__attribute__((target("avx2")))
+void ConvertAVX2(uint32_t* destination, const uint16_t* source, uint32_t count) {
+	auto mask = _mm256_set1_epi16(0x1f);
+	auto multiplier = _mm256_set1_epi16(527);
+	auto bias = _mm256_set1_epi16(23);
+	auto alpha = _mm256_set1_epi16(static_cast<int16_t>(0xff00));
+
+	uint32_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		// the unpacks below work within 128-bit lanes, so put colors 0-3 and 4-7 in the low halves of the two lanes
+		auto colors = _mm256_permute4x64_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i)), 0xd8);
+
+		auto red = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(colors, mask), multiplier), bias), 6);
+		auto green = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(colors, 5), mask), multiplier), bias), 6);
+		auto blue = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(colors, 10), mask), multiplier), bias), 6);
+
+		auto greenBlue = _mm256_or_si256(_mm256_slli_epi16(green, 8), blue);
+		auto alphaRed = _mm256_or_si256(red, alpha);
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_unpacklo_epi16(greenBlue, alphaRed));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i + 8), _mm256_unpackhi_epi16(greenBlue, alphaRed));
+	}
+	ConvertPortable(destination + i, source + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void LookUpAVX2(uint32_t* destination, const uint8_t* source, const uint32_t* palette, uint32_t count) {
+	uint32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		auto indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(source + i)));
+		auto pixels = _mm256_i32gather_epi32(reinterpret_cast<const int*>(palette), indices, 4);
+		auto isTransparent = _mm256_cmpeq_epi32(indices, _mm256_setzero_si256());
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_andnot_si256(isTransparent, pixels));
+	}
+	LookUpPortable(destination + i, source + i, palette, count - i);
+}
+
+__attribute__((target("avx2")))
+void FillAVX2(uint32_t* destination, uint32_t value, uint32_t count) {
+	auto vector = _mm256_set1_epi32(static_cast<int32_t>(value));
+	uint32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), vector);
+	}
+	FillPortable(destination + i, value, count - i);
+}
+
+__attribute__((target("avx2")))
+void MergeAVX2(uint32_t* destination, const uint32_t* source, uint32_t count) {
+	uint32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+		auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(destination + i));
+		auto isTransparent = _mm256_cmpeq_epi32(s, _mm256_setzero_si256());
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_blendv_epi8(s, d, isTransparent));
+	}
+	MergePortable(destination + i, source + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void MergeMatchingAVX2(uint32_t* destination, const uint32_t* source, const uint8_t* keys, uint8_t key, uint32_t count) {
+	auto keyVector = _mm256_set1_epi32(key);
+	uint32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		auto matches = _mm256_cmpeq_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(keys + i))), keyVector);
+		auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+		auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(destination + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_blendv_epi8(d, s, matches));
+	}
+	MergeMatchingPortable(destination + i, source + i, keys + i, key, count - i);
+}
+
+const GBAVideoKernels kAVX2 = {
+	GBAVideoKernels::kInstructionSetAVX2,
+	&ConvertAVX2,
+	&LookUpAVX2,
+	&FillAVX2,
+	&MergeAVX2,
+	&MergeMatchingAVX2,
+};
+
+#endif
+
+}
+
+const GBAVideoKernels* GBAVideoKernels::get(InstructionSet instructionSet) {
+	switch (instructionSet) {
+		case kInstructionSetPortable:
+			return &kPortable;
+#if GBA_VIDEO_KERNELS_X86
+		case kInstructionSetSSE2:
+			// every x86-64 cpu has sse2
+			return &kSSE2;
+		case kInstructionSetAVX2:
+			return __builtin_cpu_supports("avx2") ? &kAVX2 : nullptr;
+#endif
+		default:
+			return nullptr;
+	}
+}
+
+const GBAVideoKernels& GBAVideoKernels::best() {
+	static const GBAVideoKernels* kernels = [] {
+		for (auto instructionSet : {kInstructionSetAVX2, kInstructionSetSSE2}) {
+			if (auto kernels = get(instructionSet)) {
+				return kernels;
+			}
+		}
+		return &kPortable;
+	}();
+	return *kernels;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+* Row kernels for the video controller. Each has a portable version, and x86 builds also have SSE2 and AVX2 versions.
+* best() picks the fastest ones the cpu supports at runtime.
+*
+* Pixels are 0xAARRGGBB words, and 0 is a transparent pixel.
+*/
+struct GBAVideoKernels {
+	enum InstructionSet {
+		kInstructionSetPortable,
+		kInstructionSetSSE2,
+		kInstructionSetAVX2,
+	};
+
+	InstructionSet instructionSet;
+
+	/**
+	* Converts 15-bit colors to opaque pixels, scaling each 5-bit component linearly to 8 bits.
+	*/
+	void (*convert)(uint32_t* destination, const uint16_t* source, uint32_t count);
+
+	/**
+	* Looks up color indices in a palette. Index 0 is transparent.
+	*/
+	void (*lookUp)(uint32_t* destination, const uint8_t* source, const uint32_t* palette, uint32_t count);
+
+	void (*fill)(uint32_t* destination, uint32_t value, uint32_t count);
+
+	/**
+	* Copies the source's opaque pixels over the destination.
+	*/
+	void (*merge)(uint32_t* destination, const uint32_t* source, uint32_t count);
+
+	/**
+	* Copies the source's pixels over the destination wherever keys matches key.
+	*/
+	void (*mergeMatching)(uint32_t* destination, const uint32_t* source, const uint8_t* keys, uint8_t key, uint32_t count);
+
+	/**
+	* Returns the kernels for the given instruction set, or nullptr if this build or cpu doesn't support it.
+	*/
+	static const GBAVideoKernels* get(InstructionSet instructionSet);
+
+	static const GBAVideoKernels& best();
+};
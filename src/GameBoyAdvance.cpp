@@ -5,27 +5,102 @@
 
 #include <cassert>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define LOG_DMA(...) // printf(__VA_ARGS__)
+#define LOG_FAULTS 0
+
+namespace {
+
+/**
+* Fills length bytes by repeating the size bytes at pattern. size must divide 16 and length.
+*/
+void FillPattern(uint8_t* destination, const uint8_t* pattern, uint32_t size, uint32_t length) {
+	uint8_t repeated[16];
+	for (uint32_t i = 0; i < sizeof(repeated); ++i) {
+		repeated[i] = pattern[i % size];
+	}
+
+	uint32_t i = 0;
+#if defined(__SSE2__)
+	auto vector = _mm_loadu_si128(reinterpret_cast<const __m128i*>(repeated));
+	for (; i + 16 <= length; i += 16) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), vector);
+	}
+#endif
+	for (; i < length; i += size) {
+		memcpy(destination + i, repeated, size);
+	}
+}
+
+}
+
 GameBoyAdvance::GameBoyAdvance() : _videoController(this), _io(this) {
 	_cpu.mmu().attach(0x0, &_systemROM, 0, _systemROM.size());
-	_cpu.mmu().attach(0x02000000, &_onBoardRAM, 0, _onBoardRAM.size());
-	_cpu.mmu().attach(0x03000000, &_onChipRAM, 0, _onChipRAM.size());
-	_cpu.mmu().attach(0x03ffff00, &_onChipRAM, 0x7f00, 0x100);
+	_cpu.mmu().attach(0x02000000, &_onBoardRAM, 0, 0x01000000, _onBoardRAM.size() - 1);
+	_cpu.mmu().attach(0x03000000, &_onChipRAM, 0, 0x01000000, _onChipRAM.size() - 1);
 
 	_cpu.mmu().attach(0x04000000, &_io, 0x00, 0x01000000);
+
+	_cpu.mmu().setOpenBusHandler([this](uint32_t) {
+		return _cpu.openBusValue();
+	});
+
+#if LOG_FAULTS
+	// games touch rom and unmapped memory on purpose, such as when probing for hardware, so faults are only reported
+	// when debugging
+	_cpu.mmu().setFaultHandler([](uint32_t address, uint32_t size, MMU<uint32_t>::Fault fault) {
+		printf("attempt to %s %08x bytes of %s memory at %08x\n", fault == MMU<uint32_t>::kFaultReadOnly ? "write" : "access",
+			size, fault == MMU<uint32_t>::kFaultReadOnly ? "read-only" : "unmapped", address);
+	});
+#endif
 }
 
 void GameBoyAdvance::loadBIOS(const void* data, size_t size) {
-	memcpy(_systemROM.storage(), data, size);
+	memcpy(_systemROM.storage(), data, std::min<size_t>(size, _systemROM.size()));
 }
 
 void GameBoyAdvance::loadGamePak(const void* rom, size_t size, size_t eeprom) {
 	assert(size <= 0x02000000);
-	
-	memcpy(_gamePakROM.storage(), rom, size);
 
-	_cpu.mmu().attach(0x08000000, &_gamePakROM, 0, _gamePakROM.size());
-	_cpu.mmu().attach(0x0a000000, &_gamePakROM, 0, _gamePakROM.size());
-	_cpu.mmu().attach(0x0c000000, &_gamePakROM, 0, std::min<uint32_t>(eeprom ? (size < 0x01000000 ? 0x01000000 : 0x01ffff00) : 0x02000000, _gamePakROM.size()));
+	_gamePakROM.reset(new Memory<uint32_t>(size, Memory<uint32_t>::kFlagReadOnly));
+	memcpy(_gamePakROM->storage(), rom, size);
+	_gamePakROMFile.reset();
+
+	_attachGamePak(eeprom);
+}
+
+void GameBoyAdvance::loadBIOSFile(const char* path) {
+	MappedFile file(path);
+	loadBIOS(file.data(), file.size());
+}
+
+void GameBoyAdvance::loadGamePakFile(const char* path, size_t eeprom) {
+	std::unique_ptr<MappedFile> file(new MappedFile(path));
+	assert(file->size() <= 0x02000000);
+
+	_gamePakROM.reset(new Memory<uint32_t>(file->data(), file->size(), file->descriptor()));
+	_gamePakROMFile = std::move(file);
+
+	_attachGamePak(eeprom);
+}
+
+void GameBoyAdvance::_attachGamePak(size_t eeprom) {
+	auto size = _gamePakROM->size();
+
+	// each rom region is padded out with open bus
+	auto attachROM = [&](uint32_t address, uint32_t regionSize) {
+		_cpu.mmu().attach(address, _gamePakROM.get(), 0, std::min(size, regionSize));
+		if (regionSize > size) {
+			_cpu.mmu().attach(address + size, &_gamePakOpenBus, size, regionSize - size);
+		}
+	};
+
+	attachROM(0x08000000, 0x02000000);
+	attachROM(0x0a000000, 0x02000000);
+	attachROM(0x0c000000, eeprom ? (size < 0x01000000 ? 0x01000000 : 0x01ffff00) : 0x02000000);
 	_cpu.mmu().attach(0x0e000000, &_gamePakSRAM, 0, _gamePakSRAM.size());
 
 	if (eeprom) {
@@ -38,17 +113,45 @@ void GameBoyAdvance::loadGamePak(const void* rom, size_t size, size_t eeprom) {
 	}
 }
 
+void GameBoyAdvance::GamePakOpenBus::load(void* destination, uint32_t address, uint32_t size) const {
+	auto bytes = reinterpret_cast<uint8_t*>(destination);
+	for (uint32_t i = 0; i < size; ++i) {
+		auto halfword = static_cast<uint16_t>((address + i) >> 1);
+		bytes[i] = ((address + i) & 1) ? (halfword >> 8) : (halfword & 0xff);
+	}
+}
+
+void GameBoyAdvance::GamePakOpenBus::store(uint32_t address, const void* data, uint32_t size) {}
+
 void GameBoyAdvance::run() {
 	_cpu.reset();
 
 	while (true) {
-		// TODO: timing / actual power saving
-		if (!_isInHaltMode) {
-			_cpu.step();
+		uint64_t cycles = _scheduler.nextEventTime() - _scheduler.now();
+
+		if (_isInHaltMode) {
+			// halt only ends on an interrupt, and only scheduled events can raise one, so the cpu can't do anything before
+			// the next event
+			_scheduler.advance(cycles);
+			continue;
+		}
+
+		cycles = _cpu.run(static_cast<uint32_t>(std::min<uint64_t>(cycles, UINT32_MAX)));
+		_schedulerCPUCycleCount = _cpu.cycleCount();
+		_scheduler.advance(cycles);
+
+		if (_cpu.isIdle()) {
+			// the cpu is spinning until something changes, so skip ahead like halt mode does. reads of registers that
+			// change over time limit how far
+			auto target = std::min(_scheduler.nextEventTime(), _idleSkipLimit);
+			if (target > _scheduler.now()) {
+				_scheduler.advance(target - _scheduler.now());
+			}
+
+			// the limit covers the reads made since the last time around the loop, which might have been in an earlier
+			// slice, so it's only reset once the loop has gone around
+			_idleSkipLimit = UINT64_MAX;
 		}
-		_videoController.cycle();
-		_videoController.cycle();
-		_videoController.cycle();
 	}
 }
 
@@ -58,6 +161,42 @@ void GameBoyAdvance::interruptRequest(uint16_t interrupts) {
 
 GameBoyAdvance::IO::IO(GameBoyAdvance* gba) : _gba(gba) {
 	_storage = reinterpret_cast<uint8_t*>(calloc(_storageSize, 1));
+
+	// everything not listed here is plain storage
+	_setRegister(0x0000, 0xffff, 0xffff, &IO::_readDisplayControl, &IO::_writeDisplayControl);
+	_setRegister(0x0004, 0xffff, 0xffff, &IO::_readDisplayStatus, &IO::_writeDisplayStatus);
+	_setRegister(0x0006, 0xffff, 0x0000, &IO::_readVerticalCounter);
+
+	for (uint32_t i = 0; i < 4; ++i) {
+		_setRegister(0x0008 + i * 2, 0xffff, 0xffff, &IO::_readBackgroundControl, &IO::_writeBackgroundControl);
+		_setRegister(0x0010 + i * 4, 0x0000, 0xffff, nullptr, &IO::_writeBackgroundOffset);
+		_setRegister(0x0012 + i * 4, 0x0000, 0xffff, nullptr, &IO::_writeBackgroundOffset);
+		_setRegister(0x00ba + i * 12, 0xffff, 0xffff, nullptr, &IO::_writeDMAControl);
+	}
+
+	for (uint32_t i = 0; i < 4; ++i) {
+		_setRegister(0x0100 + i * 4, 0xffff, 0xffff, &IO::_readTimerCounter, &IO::_writeTimerReload);
+		_setRegister(0x0102 + i * 4, 0x00c7, 0x00c7, nullptr, &IO::_writeTimerControl);
+	}
+
+	_setRegister(0x0202, 0xffff, 0x0000, nullptr, &IO::_writeInterruptRequests);
+	_setRegister(0x0300, 0xffff, 0x00ff, nullptr, &IO::_writeHaltControl);
+
+	auto& scheduler = _gba->scheduler();
+	scheduler.setHandler(GBAScheduler::kEventHBlankDMA, [this](uint64_t time) {
+		_runDMAs(_hBlankDMAs);
+		_scheduleDMAs();
+	});
+	scheduler.setHandler(GBAScheduler::kEventVBlankDMA, [this](uint64_t time) {
+		_runDMAs(_vBlankDMAs);
+		_scheduleDMAs();
+	});
+	for (uint32_t i = 0; i < 4; ++i) {
+		scheduler.setHandler(static_cast<GBAScheduler::Event>(GBAScheduler::kEventTimer0Overflow + i), [this](uint64_t time) {
+			_updateTimers(time);
+			_scheduleTimers();
+		});
+	}
 }
 
 GameBoyAdvance::IO::~IO() {
@@ -76,196 +215,458 @@ void GameBoyAdvance::IO::interruptRequest(uint16_t interrupts) {
 }
 
 void GameBoyAdvance::IO::load(void* destination, uint32_t address, uint32_t size) const {
-	#define GBA_IO_LOAD_ADVANCE(x) address += x; size -= x; destination = reinterpret_cast<uint8_t*>(destination) + x
-	
+	auto bytes = reinterpret_cast<uint8_t*>(destination);
+
+	// aligned accesses to registers take one lookup per halfword
+	if (!(address & (size - 1)) && (size == 2 || size == 4) && address < _storageSize) {
+		*reinterpret_cast<LittleEndian<uint16_t>*>(bytes) = _readRegister(address);
+		if (size == 4) {
+			*reinterpret_cast<LittleEndian<uint16_t>*>(bytes + 2) = _readRegister(address + 2);
+		}
+		return;
+	}
+
 	while (size) {
-		auto& destinationUInt8  = *reinterpret_cast<uint8_t*>(destination);
-		auto& destinationUInt16 = *reinterpret_cast<LittleEndian<uint16_t>*>(destination);
-	
-		if (address > 0x0800) {
-			address = 0x0800 + (address & 0xffff);
+		// nothing past the registers is implemented, so it reads as open bus
+		uint16_t value = 0;
+		if (address < _storageSize) {
+			value = _readRegister(address & ~1);
+		} else {
+			value = static_cast<uint16_t>(_gba->_cpu.openBusValue() >> ((address & 2) * 8));
 		}
 
-		switch (address) {
-			case 0x0000: // DISPCNT
-				if (size < 2) { throw IOError(); }
-				destinationUInt16 = _gba->videoController().controlRegister();
-				GBA_IO_LOAD_ADVANCE(2);
-				break;
-			case 0x0004: // DISPSTAT
-				if (size < 2) { throw IOError(); }
-				destinationUInt16 = _gba->videoController().statusRegister();
-				GBA_IO_LOAD_ADVANCE(2);
-				break;
-			case 0x0006: // VCOUNT (low byte)
-				destinationUInt8 = static_cast<uint8_t>(_gba->_videoController.currentScanline());
-				GBA_IO_LOAD_ADVANCE(1);
-				break;
-			case 0x0007: // VCOUNT (high byte)
-				destinationUInt8 = static_cast<uint8_t>(_gba->_videoController.currentScanline() >> 8);
-				GBA_IO_LOAD_ADVANCE(1);
-				break;
-			case 0x0008: // BGXCNT
-			case 0x000a:
-			case 0x000c:
-			case 0x000e:
-				if (size < 2) { throw IOError(); }
-				destinationUInt16 = static_cast<uint16_t>(_gba->videoController().background((address - 0x0008) >> 1));
-				GBA_IO_LOAD_ADVANCE(2);
-				break;
-			default:
-				if (address >= _storageSize) { throw IOError(); }
-				destinationUInt8 = _storage[address];
-				GBA_IO_LOAD_ADVANCE(1);
+		if (!(address & 1) && size >= 2) {
+			*reinterpret_cast<LittleEndian<uint16_t>*>(bytes) = value;
+			address += 2; bytes += 2; size -= 2;
+		} else {
+			*bytes = static_cast<uint8_t>(value >> ((address & 1) * 8));
+			address += 1; bytes += 1; size -= 1;
 		}
 	}
 }
 
 void GameBoyAdvance::IO::store(uint32_t address, const void* data, uint32_t size) {
-	#define GBA_IO_STORE_ADVANCE(x) address += x; size -= x; data = reinterpret_cast<const uint8_t*>(data) + x
+	auto bytes = reinterpret_cast<const uint8_t*>(data);
+
+	if (!(address & (size - 1)) && (size == 2 || size == 4) && address < _storageSize) {
+		_writeRegister(address, *reinterpret_cast<const LittleEndian<uint16_t>*>(bytes), 0xffff);
+		if (size == 4) {
+			_writeRegister(address + 2, *reinterpret_cast<const LittleEndian<uint16_t>*>(bytes + 2), 0xffff);
+		}
+		return;
+	}
 
 	while (size) {
-		auto& dataUInt8 = *reinterpret_cast<const uint8_t*>(data);
-		auto& dataUInt16 = *reinterpret_cast<const LittleEndian<uint16_t>*>(data);
+		if (!(address & 1) && size >= 2) {
+			if (address < _storageSize) {
+				_writeRegister(address, *reinterpret_cast<const LittleEndian<uint16_t>*>(bytes), 0xffff);
+			}
+			address += 2; bytes += 2; size -= 2;
+		} else {
+			if (address < _storageSize) {
+				auto shift = (address & 1) * 8;
+				_writeRegister(address & ~1, static_cast<uint16_t>(*bytes << shift), static_cast<uint16_t>(0xff << shift));
+			}
+			address += 1; bytes += 1; size -= 1;
+		}
+	}
+}
+
+void GameBoyAdvance::IO::_setRegister(uint32_t address, uint16_t readMask, uint16_t writeMask, RegisterReadHandler read, RegisterWriteHandler write) {
+	auto& r = _registers[address >> 1];
+	r.readMask = readMask;
+	r.writeMask = writeMask;
+	r.read = read;
+	r.write = write;
+}
+
+uint16_t GameBoyAdvance::IO::_readRegister(uint32_t address) const {
+	auto& r = _registers[address >> 1];
+	uint16_t value = r.read ? (this->*r.read)(address) : static_cast<uint16_t>(*reinterpret_cast<const LittleEndian<uint16_t>*>(_storage + address));
+	return value & r.readMask;
+}
+
+void GameBoyAdvance::IO::_writeRegister(uint32_t address, uint16_t value, uint16_t mask) {
+	auto& r = _registers[address >> 1];
+	auto& stored = *reinterpret_cast<LittleEndian<uint16_t>*>(_storage + address);
+
+	uint16_t merged = (stored & ~mask) | (value & mask);
+	stored = (stored & ~r.writeMask) | (merged & r.writeMask);
+
+	if (r.write) {
+		(this->*r.write)(address, merged, mask);
+	}
+}
+
+uint16_t GameBoyAdvance::IO::_readDisplayControl(uint32_t address) const {
+	return _gba->_videoController.controlRegister();
+}
+
+void GameBoyAdvance::IO::_writeDisplayControl(uint32_t address, uint16_t value, uint16_t mask) {
+	_gba->_videoController.setControlRegister(value);
+}
+
+uint16_t GameBoyAdvance::IO::_readDisplayStatus(uint32_t address) const {
+	_gba->_limitIdleSkip(_gba->_videoController.nextStatusChangeTime());
+	return _gba->_videoController.statusRegister();
+}
+
+void GameBoyAdvance::IO::_writeDisplayStatus(uint32_t address, uint16_t value, uint16_t mask) {
+	_gba->_videoController.updateStatusRegister(value);
+}
+
+uint16_t GameBoyAdvance::IO::_readVerticalCounter(uint32_t address) const {
+	_gba->_limitIdleSkip(_gba->_videoController.nextStatusChangeTime());
+	return static_cast<uint16_t>(_gba->_videoController.currentScanline());
+}
+
+uint16_t GameBoyAdvance::IO::_readBackgroundControl(uint32_t address) const {
+	return static_cast<uint16_t>(_gba->_videoController.background((address - 0x0008) >> 1));
+}
+
+void GameBoyAdvance::IO::_writeBackgroundControl(uint32_t address, uint16_t value, uint16_t mask) {
+	_gba->_videoController.setBackground((address - 0x0008) >> 1, value);
+}
+
+void GameBoyAdvance::IO::_writeBackgroundOffset(uint32_t address, uint16_t value, uint16_t mask) {
+	if (address & 2) {
+		_gba->_videoController.setBackgroundYOffset((address - 0x0012) >> 2, value);
+	} else {
+		_gba->_videoController.setBackgroundXOffset((address - 0x0010) >> 2, value);
+	}
+}
+
+void GameBoyAdvance::IO::_writeDMAControl(uint32_t address, uint16_t value, uint16_t mask) {
+	uint32_t dma = (address - 0x00ba) / 12;
+	auto& registers = _dmaRegisters[dma];
+
+	if (!BIT15(value)) {
+		_disableDMA(dma);
+		_scheduleDMAs();
+		return;
+	}
+
+	if (!registers.isEnabled) {
+		auto dmaBase = _storage + 0x00b0 + dma * 12;
+		registers.source = *reinterpret_cast<LittleEndian<uint32_t>*>(dmaBase + 0) & 0x0fffffff;
+		registers.destination = *reinterpret_cast<LittleEndian<uint32_t>*>(dmaBase + 4) & 0x0fffffff;
+		registers.count = *reinterpret_cast<LittleEndian<uint16_t>*>(dmaBase + 8);
+		registers.isEnabled = true;
+	}
+
+	_hBlankDMAs &= ~(1 << dma);
+	_vBlankDMAs &= ~(1 << dma);
+
+	switch (BITFIELD_UINT16(value, 13, 12)) {
+		case 0:
+			_runDMA(dma);
+			break;
+		case 1:
+			_vBlankDMAs |= (1 << dma);
+			break;
+		case 2:
+			_hBlankDMAs |= (1 << dma);
+			break;
+		case 3:
+			// TODO: sound fifo dmas
+			_disableDMA(dma);
+			break;
+	}
+
+	_scheduleDMAs();
+}
+
+void GameBoyAdvance::IO::_writeInterruptRequests(uint32_t address, uint16_t value, uint16_t mask) {
+	// writing 1s acknowledges interrupts
+	auto& requests = *reinterpret_cast<LittleEndian<uint16_t>*>(_storage + address);
+	requests = requests & ~(value & mask);
+}
+
+void GameBoyAdvance::IO::_writeHaltControl(uint32_t address, uint16_t value, uint16_t mask) {
+	if ((mask & 0xff00) && !BIT15(value) && !_gba->_isInHaltMode) {
+		_gba->_isInHaltMode = true;
+		_gba->cpu().requestExit();
+	}
+}
+
+void GameBoyAdvance::IO::_runDMA(uint32_t i) {
+	auto dmaBase = _storage + 0x00b0 + i * 12;
+	auto& control = *reinterpret_cast<LittleEndian<uint16_t>*>(dmaBase + 10);
+
+	if (BIT11(control)) {
+		throw UnimplementedFeature();
+	}
 	
-		auto destination = _storage + address;
-		auto& destinationUInt8 = *destination;
-		auto& destinationUInt16 = *reinterpret_cast<LittleEndian<uint16_t>*>(destination);
+	if (BIT7(control) && BIT8(control)) {
+		throw IOError();
+	}
+
+	auto& registers = _dmaRegisters[i];
 
-		if (address > 0x0800) {
-			address = 0x0800 + (address & 0xffff);
+	uint32_t count = registers.count & (i == 3 ? 0xffff : 0x3fff);
+	if (!count) {
+		count = (i == 3 ? 0x10000 : 0x4000);
+	}
+
+	uint32_t size = BIT10(control) ? 4 : 2;
+	int32_t destinationStep = BIT5(control) == BIT6(control) ? size : (!BIT6(control) ? -size : 0);
+	int32_t sourceStep = !BIT7(control) && !BIT8(control) ? size : (!BIT8(control) ? -size : 0);
+
+	LOG_DMA("dma transfer: %08x %s words from %08x to %08x\n", count, size == 4 ? "32-bit" : "16-bit", registers.source, registers.destination);
+
+	if (_transferDirectly(registers.source & ~(size - 1), registers.destination & ~(size - 1), count, size, sourceStep, destinationStep)) {
+		registers.source += sourceStep * count;
+		registers.destination += destinationStep * count;
+	} else {
+		auto& mmu = _gba->cpu().mmu();
+		while (count) {
+			if (size == 4) {
+				mmu.store32(registers.destination & ~3, mmu.load32(registers.source & ~3));
+			} else {
+				mmu.store16(registers.destination & ~1, mmu.load16(registers.source & ~1));
+			}
+			registers.destination += destinationStep;
+			registers.source += sourceStep;
+			--count;
 		}
+	}
+	
+	if (BIT5(control) && BIT6(control)) {
+		registers.destination = *reinterpret_cast<LittleEndian<uint32_t>*>(dmaBase + 4) & 0x0fffffff;
+	}
 
-		switch (address) {
-			case 0x0000: // DISPCNT
-				if (size < 2) { throw IOError(); }
-				_gba->videoController().setControlRegister(dataUInt16);
-				GBA_IO_STORE_ADVANCE(2);
-				break;
-			case 0x0004: // DISPSTAT
-				if (size < 2) { throw IOError(); }
-				_gba->videoController().updateStatusRegister(dataUInt16);
-				GBA_IO_STORE_ADVANCE(2);
-				break;
-			case 0x0008: // BGXCNT
-			case 0x000a:
-			case 0x000c:
-			case 0x000e:
-				if (size < 2) { throw IOError(); }
-				_gba->videoController().setBackground((address - 0x0008) >> 1, static_cast<uint16_t>(dataUInt16));
-				GBA_IO_STORE_ADVANCE(2);
-				break;
-			case 0x0010: // bg x offsets
-			case 0x0014:
-			case 0x0018:
-			case 0x001c:
-				if (size < 2) { throw IOError(); }
-				_gba->videoController().setBackgroundXOffset((address - 0x0010) >> 2, static_cast<uint16_t>(dataUInt16));
-				GBA_IO_STORE_ADVANCE(2);
-				break;
-			case 0x0012: // bg y offsets
-			case 0x0016:
-			case 0x001a:
-			case 0x001e:
-				if (size < 2) { throw IOError(); }
-				_gba->videoController().setBackgroundYOffset((address - 0x0012) >> 2, static_cast<uint16_t>(dataUInt16));
-				GBA_IO_STORE_ADVANCE(2);
-				break;
-			case 0x00ba: // dma control
-			case 0x00c6:
-			case 0x00d2:
-			case 0x00de:
-				if (size < 2) { throw IOError(); }
-				destinationUInt16 = dataUInt16;
-				if (BIT15(dataUInt16)) {
-					uint32_t dma = (address - 0x00ba) / 12;
-					auto& registers = _dmaRegisters[dma];
-					auto dmaBase = _storage + 0x00b0 + dma * 12;
-					registers.source = *reinterpret_cast<LittleEndian<uint32_t>*>(dmaBase + 0) & 0x0fffffff;
-					registers.destination = *reinterpret_cast<LittleEndian<uint32_t>*>(dmaBase + 4) & 0x0fffffff;
-					registers.count = *reinterpret_cast<LittleEndian<uint16_t>*>(dmaBase + 8);
-				}
-				GBA_IO_STORE_ADVANCE(2);
-				checkDMATransfers();
-				break;
-			case 0x0202: // IF - clears bits to acknowledge interrupts
-			case 0x0203:
-				destinationUInt8 = (destinationUInt8 & ~dataUInt8);
-				GBA_IO_STORE_ADVANCE(1);
-				break;
-			case 0x0301:
-				if (!BIT7(dataUInt8) && !_gba->_isInHaltMode) {
-					_gba->_isInHaltMode = true;
-				}
-				GBA_IO_STORE_ADVANCE(1);
-				break;
-			default:
-				if (address >= _storageSize) { throw IOError(); }
-				destinationUInt8 = dataUInt8;
-				GBA_IO_STORE_ADVANCE(1);
+	if (BIT9(control) && BITFIELD_UINT16(control, 13, 12)) {
+		// repeating channels stay armed and start over with a fresh count
+		registers.count = *reinterpret_cast<LittleEndian<uint16_t>*>(dmaBase + 8);
+	} else {
+		_disableDMA(i);
+	}
+
+	if (BIT14(control)) {
+		_gba->interruptRequest(kInterruptDMA0 << i);
+	}
+}
+
+void GameBoyAdvance::IO::_runDMAs(uint8_t channels) {
+	// lower channels have priority
+	for (uint32_t i = 0; channels; ++i, channels >>= 1) {
+		if ((channels & 1) && _dmaRegisters[i].isEnabled) {
+			_runDMA(i);
 		}
 	}
 }
 
-void GameBoyAdvance::IO::checkDMATransfers() {
-	for (uint32_t i = 0; i < 4; ++i) {
-		auto dmaBase = _storage + 0x00b0 + i * 12;
-		auto& control = *reinterpret_cast<LittleEndian<uint16_t>*>(dmaBase + 10);
+void GameBoyAdvance::IO::_disableDMA(uint32_t channel) {
+	auto& control = *reinterpret_cast<LittleEndian<uint16_t>*>(_storage + 0x00ba + channel * 12);
+	control = control & 0x7fff;
+	_dmaRegisters[channel].isEnabled = false;
+	_hBlankDMAs &= ~(1 << channel);
+	_vBlankDMAs &= ~(1 << channel);
+}
 
-		if (!BIT15(control)) { continue; }
+void GameBoyAdvance::IO::_scheduleDMAs() {
+	auto& scheduler = _gba->scheduler();
 
-		uint16_t start = BITFIELD_UINT16(control, 13, 12);
+	if (!_hBlankDMAs) {
+		scheduler.cancel(GBAScheduler::kEventHBlankDMA);
+	} else if (!scheduler.isScheduled(GBAScheduler::kEventHBlankDMA)) {
+		scheduler.schedule(GBAScheduler::kEventHBlankDMA, _gba->_videoController.nextHBlankTime());
+	}
+
+	if (!_vBlankDMAs) {
+		scheduler.cancel(GBAScheduler::kEventVBlankDMA);
+	} else if (!scheduler.isScheduled(GBAScheduler::kEventVBlankDMA)) {
+		scheduler.schedule(GBAScheduler::kEventVBlankDMA, _gba->_videoController.nextVBlankTime());
+	}
+}
 
-		auto displayStatus = _gba->videoController().statusRegister();
+uint32_t GameBoyAdvance::IO::_timerShift(uint32_t timer) const {
+	static const uint32_t shifts[4] = {0, 6, 8, 10};
+	return shifts[BITFIELD_UINT16(_timers[timer].control, 1, 0)];
+}
 
-		if (start == 1 && !(displayStatus & GBAVideoController::kStatusFlagVBlank)) {
-			continue;
+void GameBoyAdvance::IO::_timerState(uint64_t time, uint16_t* counters, uint64_t* overflows) const {
+	for (uint32_t i = 0; i < 4; ++i) {
+		auto& timer = _timers[i];
+
+		uint64_t total = timer.counter;
+		if (!_isTimerRunning(i)) {
+			// stopped timers don't move
+		} else if (_isTimerCascading(i)) {
+			total += overflows[i - 1];
+		} else if (time > timer.startTime) {
+			total += (time - timer.startTime) >> _timerShift(i);
 		}
 
-		if (start == 2 && ((displayStatus & GBAVideoController::kStatusFlagVBlank) || !(displayStatus & GBAVideoController::kStatusFlagHBlank))) {
-			continue;
+		if (total < 0x10000) {
+			counters[i] = static_cast<uint16_t>(total);
+			overflows[i] = 0;
+		} else {
+			auto excess = total - 0x10000;
+			counters[i] = static_cast<uint16_t>(timer.reload + excess % _timerPeriod(i));
+			overflows[i] = 1 + excess / _timerPeriod(i);
 		}
-		
-		if (start == 3) {
-			// TODO: sound fifo dmas
-			control = control & 0x7fff;
-			continue;
+	}
+}
+
+void GameBoyAdvance::IO::_updateTimers(uint64_t time) {
+	uint16_t counters[4];
+	uint64_t overflows[4];
+	_timerState(time, counters, overflows);
+
+	uint16_t interrupts = 0;
+
+	for (uint32_t i = 0; i < 4; ++i) {
+		auto& timer = _timers[i];
+
+		if (_isTimerRunning(i) && !_isTimerCascading(i) && time > timer.startTime) {
+			// keep the prescaler's phase
+			auto shift = _timerShift(i);
+			timer.startTime += ((time - timer.startTime) >> shift) << shift;
+		} else {
+			timer.startTime = time;
 		}
-		
-		if (BIT9(control) || BIT11(control)) {
-			throw UnimplementedFeature();
+
+		timer.counter = counters[i];
+
+		if (overflows[i] && _isTimerInterruptEnabled(i)) {
+			interrupts |= kInterruptTimer0Overflow << i;
 		}
-		
-		if (BIT7(control) && BIT8(control)) {
-			throw IOError();
+	}
+
+	if (interrupts) {
+		_gba->interruptRequest(interrupts);
+	}
+}
+
+void GameBoyAdvance::IO::_scheduleTimers() {
+	// caps the look-ahead so the arithmetic below can't overflow. chains that go further just get an extra event
+	static const uint64_t kMaxRootOverflows = 1ull << 32;
+
+	auto& scheduler = _gba->scheduler();
+
+	for (uint32_t root = 0; root < 4; ++root) {
+		auto event = static_cast<GBAScheduler::Event>(GBAScheduler::kEventTimer0Overflow + root);
+
+		if (!_isTimerRunning(root) || _isTimerCascading(root)) {
+			scheduler.cancel(event);
+			continue;
 		}
 
-		auto& registers = _dmaRegisters[i];
+		// need is the number of root overflows until timer i overflows. span is the number of root overflows between
+		// timer i's overflows
+		uint64_t need = 1;
+		uint64_t span = 1;
+		uint64_t earliest = UINT64_MAX;
+
+		for (uint32_t i = root; ; ++i) {
+			if (_isTimerInterruptEnabled(i)) {
+				earliest = std::min(earliest, need);
+			}
 
-		uint32_t count = registers.count ? registers.count : (i == 3 ? 0x10000 : 0x4000);
+			if (i == 3 || !_isTimerRunning(i + 1) || !_isTimerCascading(i + 1)) {
+				break;
+			}
 
-		printf("dma transfer: %08x %s words from %08x to %08x\n", count, BIT10(control) ? "32-bit" : "16-bit", registers.source, registers.destination);
+			need += (0x10000 - _timers[i + 1].counter - 1) * span;
+			span *= _timerPeriod(i + 1);
 
-		while (count) {
-			if (BIT10(control)) {
-				_gba->cpu().mmu().store<uint32_t>(registers.destination & ~3, _gba->cpu().mmu().load<uint32_t>(registers.source & ~3));
-			} else {
-				_gba->cpu().mmu().store<uint16_t>(registers.destination & ~1, _gba->cpu().mmu().load<uint16_t>(registers.source & ~1));
+			if (need > kMaxRootOverflows || span > kMaxRootOverflows) {
+				earliest = std::min(earliest, std::min(need, kMaxRootOverflows));
+				break;
 			}
-			auto size = BIT10(control) ? 4 : 2;
-			registers.destination += (BIT5(control) == BIT6(control) ? size : (!BIT6(control) ? -size : 0));
-			registers.source += (!BIT7(control) && !BIT8(control) ? size : (!BIT8(control) ? -size : 0));
-			--count;
 		}
-		
-		if (BIT5(control) && BIT6(control)) {
-			registers.destination = *reinterpret_cast<LittleEndian<uint32_t>*>(dmaBase + 4) & 0x0fffffff;
-		}		
-		
-		control = control & 0x7fff;
-
-		if (BIT14(control)) {
-			_gba->interruptRequest(kInterruptDMA0 << i);
+
+		if (earliest == UINT64_MAX) {
+			scheduler.cancel(event);
+			continue;
+		}
+
+		auto& timer = _timers[root];
+		auto shift = _timerShift(root);
+		auto time = timer.startTime + (static_cast<uint64_t>(0x10000 - timer.counter) << shift) + ((earliest - 1) * _timerPeriod(root) << shift);
+
+		if (!scheduler.isScheduled(event) || scheduler.scheduledTime(event) != time) {
+			scheduler.schedule(event, time);
 		}
 	}
 }
+
+uint16_t GameBoyAdvance::IO::_readTimerCounter(uint32_t address) const {
+	auto i = (address - 0x0100) >> 2;
+	auto now = _gba->currentCycle();
+
+	uint16_t counters[4];
+	uint64_t overflows[4];
+	_timerState(now, counters, overflows);
+
+	// let idle loops that poll the counter skip ahead only until it changes
+	auto root = i;
+	while (_isTimerRunning(root) && _isTimerCascading(root)) {
+		--root;
+	}
+
+	if (_isTimerRunning(root)) {
+		auto& timer = _timers[root];
+		auto shift = _timerShift(root);
+		auto ticks = now > timer.startTime ? (now - timer.startTime) >> shift : 0;
+		auto untilChange = root == i ? 1 : 0x10000 - counters[root];
+		_gba->_limitIdleSkip(timer.startTime + ((ticks + untilChange) << shift));
+	}
+
+	return counters[i];
+}
+
+void GameBoyAdvance::IO::_writeTimerReload(uint32_t address, uint16_t value, uint16_t mask) {
+	_updateTimers(_gba->currentCycle());
+	_timers[(address - 0x0100) >> 2].reload = value;
+	_scheduleTimers();
+}
+
+void GameBoyAdvance::IO::_writeTimerControl(uint32_t address, uint16_t value, uint16_t mask) {
+	auto i = (address - 0x0102) >> 2;
+	auto now = _gba->currentCycle();
+
+	_updateTimers(now);
+
+	auto& timer = _timers[i];
+	auto wasRunning = _isTimerRunning(i);
+	timer.control = value;
+
+	if (!wasRunning && _isTimerRunning(i)) {
+		timer.counter = timer.reload;
+		timer.startTime = now;
+	}
+
+	_scheduleTimers();
+}
+
+bool GameBoyAdvance::IO::_transferDirectly(uint32_t source, uint32_t destination, uint32_t count, uint32_t size, int32_t sourceStep, int32_t destinationStep) {
+	// only incrementing destinations with incrementing or fixed sources have a fast path
+	if (destinationStep != static_cast<int32_t>(size) || (sourceStep != static_cast<int32_t>(size) && sourceStep)) {
+		return false;
+	}
+
+	auto& mmu = _gba->cpu().mmu();
+	auto length = count * size;
+
+	auto to = mmu.directPointer(destination, length, true);
+	auto from = mmu.directPointer(source, sourceStep ? length : size, false);
+	if (!to || !from) {
+		return false;
+	}
+
+	if (sourceStep) {
+		// a unit by unit copy to a destination just past the source keeps repeating the first units, which memmove
+		// doesn't do
+		if (to > from && to < from + length) {
+			return false;
+		}
+		memmove(to, from, length);
+	} else {
+		FillPattern(to, from, size, length);
+	}
+
+	mmu.didStoreDirectly(destination, length);
+	return true;
+}
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "ARM7TDMI.h"
+#include "MappedFile.h"
 #include "Memory.h"
 
 #include "GBAEEPROM.h"
+#include "GBAScheduler.h"
 #include "GBAVideoController.h"
 
 class GameBoyAdvance {
@@ -12,10 +14,23 @@ class GameBoyAdvance {
 		
 		void loadBIOS(const void* data, size_t size);
 		void loadGamePak(const void* rom, size_t size, size_t eeprom = 0);
+
+		/**
+		* Loads directly from files. The rom is used in place rather than copied. Throws MappedFile::OpenFailure if a file
+		* can't be opened.
+		*/
+		void loadBIOSFile(const char* path);
+		void loadGamePakFile(const char* path, size_t eeprom = 0);
 		
 		void run();
 		
 		ARM7TDMI& cpu() { return _cpu; }
+		GBAScheduler& scheduler() { return _scheduler; }
+
+		/**
+		* The current time in cycles. This includes the cycles the cpu has run since the scheduler last caught up.
+		*/
+		uint64_t currentCycle() const { return _scheduler.now() + (_cpu.cycleCount() - _schedulerCPUCycleCount); }
 		GBAVideoController& videoController() { return _videoController; }
 			
 		enum Interrupt : uint16_t {
@@ -38,22 +53,42 @@ class GameBoyAdvance {
 		void interruptRequest(uint16_t interrupts);
 		
 	private:
-		// the order here is important. the cpu MUST come first
+		// the order here is important. the cpu and scheduler MUST come first
 		ARM7TDMI _cpu;
+		GBAScheduler _scheduler;
+		uint64_t _schedulerCPUCycleCount = 0; // the cpu's cycle count when the scheduler last caught up
 		GBAVideoController _videoController;
 
 		// general memory
 		Memory<uint32_t> _systemROM{0x4000, Memory<uint32_t>::kFlagReadOnly};
-		Memory<uint32_t> _onBoardRAM{0x1000000};
-		Memory<uint32_t> _onChipRAM{0x00ffff00};
+		Memory<uint32_t> _onBoardRAM{0x40000, Memory<uint32_t>::kFlagMappable};
+		Memory<uint32_t> _onChipRAM{0x8000, Memory<uint32_t>::kFlagMappable};
 
 		// gamepak memory
-		Memory<uint32_t> _gamePakROM{0x2000000, Memory<uint32_t>::kFlagReadOnly};
-		Memory<uint32_t> _gamePakSRAM{0x10000};
+		std::unique_ptr<MappedFile> _gamePakROMFile;
+		std::unique_ptr<Memory<uint32_t>> _gamePakROM;
+		Memory<uint32_t> _gamePakSRAM{0x10000, Memory<uint32_t>::kFlagMappable};
 		std::unique_ptr<GBAEEPROM> _gamePakEEPROM;
 
 		bool _isInHaltMode = false;
 
+		/**
+		* How far ahead time can be skipped when the cpu is idle. Reads of registers that are worked out from the current
+		* time lower this to when their value next changes. It's reset each time an idle loop goes around.
+		*/
+		uint64_t _idleSkipLimit = UINT64_MAX;
+		void _limitIdleSkip(uint64_t time) { _idleSkipLimit = std::min(_idleSkipLimit, time); }
+
+		void _attachGamePak(size_t eeprom);
+
+		/**
+		* Reads past the end of the rom see the lower bits of the address, which are all that's left on the bus.
+		*/
+		struct GamePakOpenBus : MemoryInterface<uint32_t> {
+			virtual void load(void* destination, uint32_t address, uint32_t size) const override;
+			virtual void store(uint32_t address, const void* data, uint32_t size) override;
+		} _gamePakOpenBus;
+
 		struct IO : MemoryInterface<uint32_t> {			
 			IO(GameBoyAdvance* gba);
 			virtual ~IO();
@@ -66,15 +101,105 @@ class GameBoyAdvance {
 			virtual void load(void* destination, uint32_t address, uint32_t size) const override;
 			virtual void store(uint32_t address, const void* data, uint32_t size) override;
 
+			typedef uint16_t (IO::*RegisterReadHandler)(uint32_t address) const;
+			typedef void (IO::*RegisterWriteHandler)(uint32_t address, uint16_t value, uint16_t mask);
+
+			/**
+			* Describes one halfword of the register space. Bits outside the read mask read as zero, and bits outside the
+			* write mask aren't stored. Registers without handlers are plain storage. Write handlers run after the store
+			* and get the register's new value along with a mask of the bits that were written.
+			*/
+			struct Register {
+				uint16_t readMask = 0xffff;
+				uint16_t writeMask = 0xffff;
+				RegisterReadHandler read = nullptr;
+				RegisterWriteHandler write = nullptr;
+			};
+
+			Register _registers[0x400];
+
+			void _setRegister(uint32_t address, uint16_t readMask, uint16_t writeMask, RegisterReadHandler read = nullptr, RegisterWriteHandler write = nullptr);
+
+			uint16_t _readRegister(uint32_t address) const;
+			void _writeRegister(uint32_t address, uint16_t value, uint16_t mask);
+
+			uint16_t _readDisplayControl(uint32_t address) const;
+			void _writeDisplayControl(uint32_t address, uint16_t value, uint16_t mask);
+			uint16_t _readDisplayStatus(uint32_t address) const;
+			void _writeDisplayStatus(uint32_t address, uint16_t value, uint16_t mask);
+			uint16_t _readVerticalCounter(uint32_t address) const;
+			uint16_t _readBackgroundControl(uint32_t address) const;
+			void _writeBackgroundControl(uint32_t address, uint16_t value, uint16_t mask);
+			void _writeBackgroundOffset(uint32_t address, uint16_t value, uint16_t mask);
+			void _writeDMAControl(uint32_t address, uint16_t value, uint16_t mask);
+			void _writeInterruptRequests(uint32_t address, uint16_t value, uint16_t mask);
+			void _writeHaltControl(uint32_t address, uint16_t value, uint16_t mask);
+
+			/**
+			* The registers are latched when a channel is enabled. Channels that wait for a blank are armed by setting their
+			* bit in one of the masks, and run when the blank's event fires.
+			*/
 			struct DMARegisters {
 				uint32_t source = 0;
 				uint32_t destination = 0;
-				uint16_t count = 0;
+				uint32_t count = 0;
+				bool isEnabled = false;
 			};
 			
 			DMARegisters _dmaRegisters[4];
-			
-			void checkDMATransfers();
+			uint8_t _hBlankDMAs = 0;
+			uint8_t _vBlankDMAs = 0;
+
+			void _runDMA(uint32_t channel);
+			void _runDMAs(uint8_t channels);
+			void _disableDMA(uint32_t channel);
+			void _scheduleDMAs();
+
+			/**
+			* Does a transfer with a single copy or fill if both ends are plain memory. Returns false if it can't.
+			*/
+			bool _transferDirectly(uint32_t source, uint32_t destination, uint32_t count, uint32_t size, int32_t sourceStep, int32_t destinationStep);
+
+			/**
+			* Timers aren't ticked. Each one keeps the counter's value as of startTime, and the current value is worked out
+			* from the time when it's needed. Timers that count up on the previous timer's overflow are kept up to date
+			* along with the rest of their chain, so they share its startTime.
+			*/
+			struct Timer {
+				uint16_t reload = 0;
+				uint16_t control = 0;
+				uint16_t counter = 0;
+				uint64_t startTime = 0;
+			};
+
+			Timer _timers[4];
+
+			bool _isTimerRunning(uint32_t timer) const { return _timers[timer].control & 0x80; }
+			bool _isTimerCascading(uint32_t timer) const { return timer && (_timers[timer].control & 0x04); }
+			bool _isTimerInterruptEnabled(uint32_t timer) const { return _timers[timer].control & 0x40; }
+			uint32_t _timerShift(uint32_t timer) const;
+			uint32_t _timerPeriod(uint32_t timer) const { return 0x10000 - _timers[timer].reload; }
+
+			/**
+			* Works out the counters and the number of times each timer has overflowed between the timers' start time and
+			* the given time.
+			*/
+			void _timerState(uint64_t time, uint16_t* counters, uint64_t* overflows) const;
+
+			/**
+			* Brings the timers up to the given time and requests interrupts for the overflows along the way.
+			*/
+			void _updateTimers(uint64_t time);
+
+			/**
+			* Schedules an overflow event for each timer at the start of a chain, for the first overflow in the chain
+			* that requests an interrupt. Chains that can't request interrupts don't need events.
+			*/
+			void _scheduleTimers();
+
+			uint16_t _readTimerCounter(uint32_t address) const;
+			void _writeTimerReload(uint32_t address, uint16_t value, uint16_t mask);
+			void _writeTimerControl(uint32_t address, uint16_t value, uint16_t mask);
 
 			GameBoyAdvance* const _gba = nullptr;
 			uint8_t* _storage = nullptr;
@@ -2,82 +2,548 @@
 
 #include "MemoryInterface.h"
 
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 template <typename AddressType>
 class MMU : public MemoryInterface<AddressType> {
 	public:
-		void attach(AddressType address, MemoryInterface<AddressType>* memory, AddressType offset, AddressType size) {
-			_attachedMemory[address] = AttachedMemory(memory, offset, size);
+		MMU() {
+			_watchedPages = reinterpret_cast<uint8_t*>(calloc(kWatchPageCount, 1));
+			_pages = reinterpret_cast<Page*>(calloc(kPageCount, sizeof(Page)));
+		}
+
+		~MMU() {
+			free(_watchedPages);
+			free(_pages);
+			if (_fastmemBase) {
+				munmap(_fastmemBase, kPageCount * kPageSize);
+			}
+		}
+
+		/**
+		* Maps size bytes of memory starting at offset into the address space. If a mirror mask is given, only the address
+		* bits in the mask are used, so the memory repeats every mirrorMask + 1 bytes across the attachment.
+		*/
+		void attach(AddressType address, MemoryInterface<AddressType>* memory, AddressType offset, AddressType size, AddressType mirrorMask = std::numeric_limits<AddressType>::max()) {
+			_attachedMemory[address] = AttachedMemory(memory, offset, size, mirrorMask);
+			++_attachmentGeneration;
+
+			// the new attachment takes over everything up to the next one, even past its own end
+			auto next = _attachedMemory.upper_bound(address);
+			auto end = next == _attachedMemory.end() ? kPageCount : next->first / kPageSize + 1;
+			for (size_t page = address / kPageSize; page < end; ++page) {
+				_updatePage(page);
+			}
+		}
+
+		using MemoryInterface<AddressType>::kDirtyBlockSize;
+
+		/**
+		* Loads and stores are looked up in a flat table of pages this size.
+		*/
+		static const AddressType kPageSize = 0x4000;
+		static const size_t kPageCount = (static_cast<size_t>(std::numeric_limits<AddressType>::max()) + 1) / kPageSize;
+
+		/**
+		* Reserves a range of host address space the size of the guest's, and keeps every page that's wholly backed by
+		* mappable memory mapped at fastmem base + guest address. Mirrors are mapped as many times as they appear. Everything
+		* else is left inaccessible, so accesses to it fault. Returns false if the host can't do this.
+		*/
+		bool enableFastmem() {
+			if (_fastmemBase) { return true; }
+
+			auto hostPageSize = sysconf(_SC_PAGESIZE);
+			if (sizeof(void*) < 8 || hostPageSize <= 0 || kPageSize % hostPageSize) { return false; }
+
+			auto base = mmap(nullptr, kPageCount * kPageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (base == MAP_FAILED) { return false; }
+			_fastmemBase = reinterpret_cast<uint8_t*>(base);
+
+			for (size_t page = 0; page < kPageCount; ++page) {
+				if (_pages[page].memory) {
+					_updateFastmemPage(page);
+				}
+			}
+
+			++_attachmentGeneration;
+			return true;
+		}
+
+		/**
+		* Returns nullptr unless fastmem is enabled.
+		*/
+		uint8_t* fastmemBase() const { return _fastmemBase; }
+
+		/**
+		* Incremented whenever the memory map changes.
+		*/
+		uint32_t attachmentGeneration() const { return _attachmentGeneration; }
+
+		/**
+		* A range of the address space that's backed by a plain byte array, after accounting for overlapping attachments.
+		*/
+		struct DirectRegion {
+			AddressType address;
+			AddressType size;
+			uint8_t* storage;
+			bool isWritable;
+		};
+
+		std::vector<DirectRegion> directRegions() const {
+			std::vector<DirectRegion> regions;
+
+			for (auto it = _attachedMemory.begin(); it != _attachedMemory.end(); ++it) {
+				auto storage = it->second.memory->directStorage();
+				if (!storage.data || it->second.offset >= storage.size) { continue; }
+
+				auto size = std::min<AddressType>(it->second.size, storage.size - it->second.offset);
+				if (size && it->second.mirrorMask < size - 1) {
+					// only the first copy is contiguous
+					size = it->second.mirrorMask + 1;
+				}
+				auto next = std::next(it);
+				if (next != _attachedMemory.end() && next->first - it->first < size) {
+					size = next->first - it->first;
+				}
+
+				// stores to tracked memory need to go through the mmu so that they get marked
+				regions.push_back(DirectRegion{it->first, size, storage.data + it->second.offset, storage.isWritable && !storage.dirtyBlocks});
+			}
+
+			return regions;
 		}
 		
-		using typename MemoryInterface<AddressType>::AccessViolation;
-		using typename MemoryInterface<AddressType>::ReadOnlyViolation;
-		
+		/**
+		* Returns the host address of size bytes at address if they're all plain memory laid out contiguously, or nullptr if
+		* they aren't. Code that writes through the pointer must call didStoreDirectly afterwards.
+		*/
+		uint8_t* directPointer(AddressType address, AddressType size, bool isWrite) const {
+			auto page = address / kPageSize;
+			auto pageOffset = address % kPageSize;
+			auto& first = _pages[page];
+
+			if (!size || !first.data || pageOffset >= first.size || (isWrite && !first.isWritable)) { return nullptr; }
+
+			auto ret = first.data + pageOffset;
+			AddressType available = first.size - pageOffset;
+
+			while (available < size) {
+				if (_pages[page].size != kPageSize || ++page >= kPageCount) { return nullptr; }
+				auto& next = _pages[page];
+				if (next.data != ret + available || next.memory != first.memory || (isWrite && !next.isWritable)) { return nullptr; }
+				available += next.size;
+			}
+
+			return ret;
+		}
+
+		/**
+		* Marks dirty blocks and invokes the watch handler for a store made through directPointer.
+		*/
+		void didStoreDirectly(AddressType address, AddressType size) {
+			if (!size) { return; }
+
+			for (auto page = address / kPageSize; page <= (address + size - 1) / kPageSize; ++page) {
+				auto& entry = _pages[page];
+				if (entry.dirtyBlocks) {
+					auto start = std::max<AddressType>(address, page * kPageSize);
+					auto end = std::min<AddressType>(address + size - 1, page * kPageSize + kPageSize - 1);
+					_markDirty(entry, start % kPageSize, end - start + 1);
+				}
+			}
+
+			if (_watchHandler && _isWatched(address, size)) {
+				_watchHandler(canonicalAddress(address), size);
+			}
+		}
+
+		/**
+		* Returns the address of the first copy of mirrored memory, so that every mirror of a byte has the same canonical
+		* address. Anything else is its own canonical address.
+		*/
+		AddressType canonicalAddress(AddressType address) const {
+			auto it = _findAttachedMemory(address, 1);
+			if (it == _attachedMemory.end()) { return address; }
+			return it->first + ((address - it->first) & it->second.mirrorMask);
+		}
+
+		/**
+		* Stores that touch a watched page invoke the watch handler after the store completes. Watching a page watches all
+		* of its mirrors, and the handler is given canonical addresses.
+		*/
+		static const AddressType kWatchPageSize = 0x400;
+		static const size_t kWatchPageCount = (static_cast<size_t>(std::numeric_limits<AddressType>::max()) + 1) / kWatchPageSize;
+
+		void setWatchHandler(std::function<void(AddressType address, AddressType size)> handler) {
+			_watchHandler = handler;
+		}
+
+		void watch(AddressType address, AddressType size) {
+			for (size_t page = address / kWatchPageSize; page <= (address + size - 1) / kWatchPageSize; ++page) {
+				auto canonical = _canonicalWatchPage(page);
+				if (_canonicalWatchedPages.insert(canonical).second) {
+					_setWatched(canonical, 1);
+				}
+			}
+		}
+
+		void unwatch(AddressType address, AddressType size) {
+			for (size_t page = address / kWatchPageSize; page <= (address + size - 1) / kWatchPageSize; ++page) {
+				auto canonical = _canonicalWatchPage(page);
+				if (_canonicalWatchedPages.erase(canonical)) {
+					_setWatched(canonical, 0);
+				}
+			}
+		}
+
+		void unwatchAll() {
+			for (auto page : _canonicalWatchedPages) {
+				_setWatched(page, 0);
+			}
+			_canonicalWatchedPages.clear();
+		}
+
+		/**
+		* One byte per watch page, non-zero if the page or any of its mirrors is watched. The pointer is stable for the
+		* lifetime of the MMU.
+		*/
+		const uint8_t* watchedPages() const { return _watchedPages; }
+
+		/**
+		* Accesses to unmapped memory and stores to read-only memory don't throw. Unmapped loads see the open bus value, and
+		* the stores are dropped. Either way, the fault handler is told about it.
+		*/
+		enum Fault {
+			kFaultUnmapped,
+			kFaultReadOnly,
+		};
+
+		void setFaultHandler(std::function<void(AddressType address, AddressType size, Fault fault)> handler) {
+			_faultHandler = handler;
+		}
+
+		/**
+		* Returns the value on the bus for unmapped loads. Each byte of the load is taken from the byte lane its address
+		* falls on. Without a handler, unmapped loads read zero.
+		*/
+		void setOpenBusHandler(std::function<uint32_t(AddressType address)> handler) {
+			_openBusHandler = handler;
+		}
+
+		bool isMapped(AddressType address, AddressType size) const {
+			return (address % kPageSize) + size <= _pages[address / kPageSize].size || _findAttachedMemory(address, size) != _attachedMemory.end();
+		}
+
+		/**
+		* Accesses that fit in a page backed by a plain byte array are handled inline. Everything else takes the virtual
+		* path.
+		*/
 		template <typename T>
-		T load(AddressType address) {
+		T load(AddressType address) const {
+			auto& page = _pages[address / kPageSize];
+			auto pageOffset = address % kPageSize;
+
 			T ret;
-			load(&ret, address, static_cast<AddressType>(sizeof(ret)));
+			if (page.data && pageOffset + sizeof(T) <= page.size) {
+				memcpy(&ret, page.data + pageOffset, sizeof(T));
+			} else {
+				load(&ret, address, static_cast<AddressType>(sizeof(ret)));
+			}
 			return ret;
 		}
 
-		virtual void load(void* destination, AddressType address, AddressType size) const override {
-			if (_attachedMemory.empty()) { throw AccessViolation(); }
+		uint8_t load8(AddressType address) const { return load<uint8_t>(address); }
+		uint16_t load16(AddressType address) const { return load<LittleEndian<uint16_t>>(address); }
+		uint32_t load32(AddressType address) const { return load<LittleEndian<uint32_t>>(address); }
 
-			auto it = _attachedMemory.lower_bound(address);
+		virtual void load(void* destination, AddressType address, AddressType size) const override {
+			auto& page = _pages[address / kPageSize];
+			auto pageOffset = address % kPageSize;
 
-			if (it->first != address) {
-				if (it == _attachedMemory.begin()) {
-					throw AccessViolation();
+			if (pageOffset + size <= page.size) {
+				if (page.data) {
+					memcpy(destination, page.data + pageOffset, size);
+					return;
 				}
-				--it;
+				return page.memory->load(destination, page.offset + pageOffset, size);
 			}
-			
-			if (address - it->first + size > it->second.size) {
-				throw AccessViolation();
+
+			auto it = _findAttachedMemory(address, size);
+			if (it == _attachedMemory.end()) {
+				return _loadOpenBus(destination, address, size);
 			}
-			
-			return it->second.memory->load(destination, address - it->first + it->second.offset, size);
+			if (_crossesMirror(it, address, size)) {
+				auto bytes = reinterpret_cast<uint8_t*>(destination);
+				for (AddressType i = 0; i < size; ++i) {
+					it->second.memory->load(bytes + i, _memoryAddress(it, address + i), 1);
+				}
+				return;
+			}
+			return it->second.memory->load(destination, _memoryAddress(it, address), size);
 		}
 
 		template <typename T>
 		void store(AddressType address, T data) {
-			store(address, &data, static_cast<AddressType>(sizeof(T)));
+			auto& page = _pages[address / kPageSize];
+			auto pageOffset = address % kPageSize;
+
+			if (page.isWritable && pageOffset + sizeof(T) <= page.size) {
+				memcpy(page.data + pageOffset, &data, sizeof(T));
+				if (page.dirtyBlocks) {
+					_markDirty(page, pageOffset, sizeof(T));
+				}
+				if (_watchHandler && _isWatched(address, sizeof(T))) {
+					_watchHandler(canonicalAddress(address), sizeof(T));
+				}
+			} else {
+				store(address, &data, static_cast<AddressType>(sizeof(T)));
+			}
 		}
 
+		void store8(AddressType address, uint8_t value) { store<uint8_t>(address, value); }
+		void store16(AddressType address, uint16_t value) { store<LittleEndian<uint16_t>>(address, value); }
+		void store32(AddressType address, uint32_t value) { store<LittleEndian<uint32_t>>(address, value); }
+
 		virtual void store(AddressType address, const void* data, AddressType size) override {
-			if (_attachedMemory.empty()) { throw AccessViolation(); }
+			auto& page = _pages[address / kPageSize];
+			auto pageOffset = address % kPageSize;
 
-			auto it = _attachedMemory.lower_bound(address);
+			if (pageOffset + size <= page.size && page.isWritable) {
+				memcpy(page.data + pageOffset, data, size);
+				if (page.dirtyBlocks) {
+					_markDirty(page, pageOffset, size);
+				}
+			} else {
+				MemoryInterface<AddressType>* memory = page.memory;
+				AddressType memoryAddress = page.offset + pageOffset;
+				bool isReadOnly = page.data && !page.isWritable;
+				bool isSplit = false;
+
+				if (pageOffset + size > page.size) {
+					auto it = _findAttachedMemory(address, size);
+					if (it == _attachedMemory.end()) {
+						return _fault(address, size, kFaultUnmapped);
+					}
+					memory = it->second.memory;
+					memoryAddress = _memoryAddress(it, address);
+					isReadOnly = it->second.isReadOnly;
 
-			if (it->first != address) {
-				if (it == _attachedMemory.begin()) {
-					throw AccessViolation();
+					if (!isReadOnly && _crossesMirror(it, address, size)) {
+						auto bytes = reinterpret_cast<const uint8_t*>(data);
+						for (AddressType i = 0; i < size; ++i) {
+							memory->store(_memoryAddress(it, address + i), bytes + i, 1);
+						}
+						isSplit = true;
+					}
+				}
+
+				if (isReadOnly) {
+					return _fault(address, size, kFaultReadOnly);
+				}
+
+				if (!isSplit) {
+					memory->store(memoryAddress, data, size);
 				}
-				--it;
-			}
-			
-			if (address - it->first + size > it->second.size) {
-				throw AccessViolation();
 			}
-			
-			try {
-				return it->second.memory->store(address - it->first + it->second.offset, data, size);
-			} catch (ReadOnlyViolation e) {
-				printf("warning: attempt to write %08x bytes to read-only memory at %08x\n", size, address);
+
+			if (_watchHandler && _isWatched(address, size)) {
+				_watchHandler(canonicalAddress(address), size);
 			}
 		}
 		
 	private:
 		struct AttachedMemory {
 			AttachedMemory() {}
-			AttachedMemory(MemoryInterface<AddressType>* memory, AddressType offset, AddressType size)
-				: memory(memory), offset(offset), size(size) {}
+			AttachedMemory(MemoryInterface<AddressType>* memory, AddressType offset, AddressType size, AddressType mirrorMask)
+				: memory(memory), offset(offset), size(size), mirrorMask(mirrorMask) {
+				auto storage = memory->directStorage();
+				isReadOnly = storage.data && !storage.isWritable;
+			}
 			
 			MemoryInterface<AddressType>* memory = nullptr;
 			AddressType offset = 0;
 			AddressType size = 0;
+			AddressType mirrorMask = std::numeric_limits<AddressType>::max();
+			bool isReadOnly = false;
 		};
 	
 		std::map<AddressType, AttachedMemory> _attachedMemory;
+
+		/**
+		* The first size bytes of each page belong to a single attachment. If that attachment is a plain byte array, data
+		* points directly at it. Accesses past size or across pages fall back to searching _attachedMemory. If the memory
+		* tracks writes, dirtyBlocks points at the byte for the page's first block.
+		*/
+		struct Page {
+			uint8_t* data;
+			uint8_t* dirtyBlocks;
+			MemoryInterface<AddressType>* memory;
+			AddressType offset;
+			AddressType size;
+			bool isWritable;
+		};
+
+		Page* _pages = nullptr;
+		uint8_t* _fastmemBase = nullptr;
+
+		uint32_t _attachmentGeneration = 0;
+
+		std::function<void(AddressType address, AddressType size, Fault fault)> _faultHandler;
+		std::function<uint32_t(AddressType address)> _openBusHandler;
+
+		std::function<void(AddressType address, AddressType size)> _watchHandler;
+		uint8_t* _watchedPages = nullptr;
+		std::unordered_set<size_t> _canonicalWatchedPages;
+
+		typename std::map<AddressType, AttachedMemory>::const_iterator _findAttachedMemory(AddressType address, AddressType size) const {
+			auto it = _attachedMemory.upper_bound(address);
+
+			if (it == _attachedMemory.begin()) {
+				return _attachedMemory.end();
+			}
+			--it;
+
+			if (address - it->first + size > it->second.size) {
+				return _attachedMemory.end();
+			}
+
+			return it;
+		}
+
+		void _fault(AddressType address, AddressType size, Fault fault) const {
+			if (_faultHandler) {
+				_faultHandler(address, size, fault);
+			}
+		}
+
+		void _loadOpenBus(void* destination, AddressType address, AddressType size) const {
+			_fault(address, size, kFaultUnmapped);
+
+			uint32_t value = _openBusHandler ? _openBusHandler(address) : 0;
+			auto bytes = reinterpret_cast<uint8_t*>(destination);
+			for (AddressType i = 0; i < size; ++i) {
+				bytes[i] = static_cast<uint8_t>(value >> (((address + i) & 3) * 8));
+			}
+		}
+
+		/**
+		* Accesses that run past the end of a mirrored memory's period wrap back around to its start a byte at a time,
+		* rather than running off the end of the memory.
+		*/
+		static bool _crossesMirror(typename std::map<AddressType, AttachedMemory>::const_iterator it, AddressType address, AddressType size) {
+			return it->second.mirrorMask - ((address - it->first) & it->second.mirrorMask) < size - 1;
+		}
+
+		static AddressType _memoryAddress(typename std::map<AddressType, AttachedMemory>::const_iterator it, AddressType address) {
+			return ((address - it->first) & it->second.mirrorMask) + it->second.offset;
+		}
+
+		void _updatePage(size_t page) {
+			auto address = static_cast<AddressType>(page * kPageSize);
+			auto entry = Page();
+
+			auto next = _attachedMemory.upper_bound(address);
+			if (next != _attachedMemory.begin()) {
+				auto it = std::prev(next);
+				auto mirrorOffset = (address - it->first) & it->second.mirrorMask;
+
+				if (address - it->first < it->second.size) {
+					auto size = std::min<AddressType>(kPageSize, it->second.size - (address - it->first));
+					if (next != _attachedMemory.end() && next->first - address < size) {
+						size = next->first - address;
+					}
+					if (it->second.mirrorMask - mirrorOffset < size - 1) {
+						size = it->second.mirrorMask - mirrorOffset + 1;
+					}
+
+					entry.memory = it->second.memory;
+					entry.offset = mirrorOffset + it->second.offset;
+					entry.size = size;
+
+					auto storage = entry.memory->directStorage();
+					// tracked blocks have to line up with the page. if they don't, everything takes the slow path
+					bool isAligned = !storage.dirtyBlocks || entry.offset % kDirtyBlockSize == 0;
+					if (storage.data && isAligned && entry.offset < storage.size && storage.size - entry.offset >= size) {
+						entry.data = storage.data + entry.offset;
+						entry.isWritable = storage.isWritable;
+						if (storage.dirtyBlocks) {
+							entry.dirtyBlocks = storage.dirtyBlocks + entry.offset / kDirtyBlockSize;
+						}
+					}
+				}
+			}
+
+			// most of the address space is unmapped. leaving those pages untouched keeps them from taking up memory
+			if (entry.memory || _pages[page].memory) {
+				_pages[page] = entry;
+				if (_fastmemBase) {
+					_updateFastmemPage(page);
+				}
+			}
+		}
+
+		void _updateFastmemPage(size_t page) {
+			auto& entry = _pages[page];
+			auto host = _fastmemBase + page * kPageSize;
+
+			if (entry.data && entry.size == kPageSize && entry.offset % kPageSize == 0) {
+				auto storage = entry.memory->directStorage();
+				if (storage.descriptor >= 0) {
+					// stores to tracked memory fault so that they take the slow path and get marked
+					auto protection = PROT_READ | (entry.isWritable && !entry.dirtyBlocks ? PROT_WRITE : 0);
+					if (mmap(host, kPageSize, protection, MAP_SHARED | MAP_FIXED, storage.descriptor, entry.offset) != MAP_FAILED) {
+						return;
+					}
+				}
+			}
+
+			mmap(host, kPageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+		}
+
+		static void _markDirty(const Page& page, AddressType pageOffset, AddressType size) {
+			for (auto block = pageOffset / kDirtyBlockSize; block <= (pageOffset + size - 1) / kDirtyBlockSize; ++block) {
+				page.dirtyBlocks[block] = 1;
+			}
+		}
+
+		/**
+		* Mirrors shorter than a watch page can't be told apart, so those pages are left as they are.
+		*/
+		size_t _canonicalWatchPage(size_t page) const {
+			auto address = static_cast<AddressType>(page * kWatchPageSize);
+			auto it = _findAttachedMemory(address, 1);
+			if (it == _attachedMemory.end() || it->second.mirrorMask < kWatchPageSize - 1) { return page; }
+			return (it->first + ((address - it->first) & it->second.mirrorMask)) / kWatchPageSize;
+		}
+
+		void _setWatched(size_t canonicalPage, uint8_t value) {
+			auto address = static_cast<AddressType>(canonicalPage * kWatchPageSize);
+			auto it = _findAttachedMemory(address, 1);
+			if (it == _attachedMemory.end() || it->second.mirrorMask < kWatchPageSize - 1 || it->second.mirrorMask >= it->second.size - 1) {
+				_watchedPages[canonicalPage] = value;
+				return;
+			}
+
+			// mark every copy so that the table can be indexed by the address as written
+			uint64_t period = static_cast<uint64_t>(it->second.mirrorMask) + 1;
+			for (uint64_t offset = address - it->first; offset < it->second.size; offset += period) {
+				_watchedPages[(it->first + offset) / kWatchPageSize] = value;
+			}
+		}
+
+		bool _isWatched(AddressType address, AddressType size) const {
+			for (size_t page = address / kWatchPageSize; page <= (address + size - 1) / kWatchPageSize; ++page) {
+				if (_watchedPages[page]) { return true; }
+			}
+			return false;
+		}
 };
\ No newline at end of file
@@ -0,0 +1,37 @@
+#include "MappedFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char* path) {
+	auto fd = open(path, O_RDONLY);
+	if (fd < 0) { throw OpenFailure(); }
+
+	struct stat status;
+	if (fstat(fd, &status)) {
+		close(fd);
+		throw OpenFailure();
+	}
+
+	_size = static_cast<size_t>(status.st_size);
+
+	if (_size) {
+		auto data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			throw OpenFailure();
+		}
+		_data = reinterpret_cast<uint8_t*>(data);
+	}
+
+	_descriptor = fd;
+}
+
+MappedFile::~MappedFile() {
+	if (_data) {
+		munmap(_data, _size);
+	}
+	close(_descriptor);
+}
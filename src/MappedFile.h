@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* A read-only view of a file's contents. The file is mapped rather than read, so it's only paged in as it's used, and the
+* pages are shared with anything else that has the same file open.
+*/
+class MappedFile {
+	public:
+		struct OpenFailure {};
+
+		explicit MappedFile(const char* path);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const uint8_t* data() const { return _data; }
+		size_t size() const { return _size; }
+
+		/**
+		* A descriptor that can be passed to mmap to map the file again.
+		*/
+		int descriptor() const { return _descriptor; }
+
+	private:
+		uint8_t* _data = nullptr;
+		size_t _size = 0;
+		int _descriptor = -1;
+};
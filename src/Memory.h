@@ -1,46 +1,158 @@
 #pragma once
 
+#include <cassert>
 #include <cstring>
 #include <cstdlib>
+#include <algorithm>
+#include <memory>
 #include <stdint.h>
+#include <vector>
 
 #include "MemoryInterface.h"
+#include "SharedMemory.h"
 
 template <typename AddressType>
 class Memory : public MemoryInterface<AddressType> {
 	public:
 		enum {
 			kFlagReadOnly = (1 << 0),
+			kFlagMappable = (1 << 1), // storage is shared memory that the mmu can map into its fastmem arena
+			kFlagDirtyTracking = (1 << 2), // stores mark the blocks they touch as dirty
 		};
 
+		using MemoryInterface<AddressType>::kDirtyBlockSize;
+
 		Memory(AddressType size, int flags = 0) : _size(size), _flags(flags) {
-			_storage = reinterpret_cast<uint8_t*>(calloc(size, 1));
+			if (flags & kFlagMappable) {
+				_sharedMemory.reset(new SharedMemory(size));
+				_storage = _sharedMemory->data();
+				_descriptor = _sharedMemory->descriptor();
+			}
+
+			if (!_storage) {
+				_sharedMemory.reset();
+				_storage = reinterpret_cast<uint8_t*>(calloc(size, 1));
+			}
+
+			if (flags & kFlagDirtyTracking) {
+				_dirtyBlocks.resize((size + kDirtyBlockSize - 1) / kDirtyBlockSize);
+			}
 		}
+
+		/**
+		* Wraps existing storage instead of allocating it. The memory is read-only, and the storage must outlive it. If
+		* the storage can also be mapped from a file descriptor, passing it lets the memory be mapped into fastmem arenas.
+		*/
+		Memory(const uint8_t* storage, AddressType size, int descriptor = -1) : _storage(const_cast<uint8_t*>(storage)), _size(size), _flags(kFlagReadOnly), _ownsStorage(false), _descriptor(descriptor) {}
 		
 		~Memory() {
-			free(_storage);
+			if (_ownsStorage && !_sharedMemory) {
+				free(_storage);
+			}
 		}
 		
-		using typename MemoryInterface<AddressType>::AccessViolation;
-		using typename MemoryInterface<AddressType>::ReadOnlyViolation;
-
 		AddressType size() const { return _size; }
 		
-		void load(void* destination, AddressType address, AddressType size) const override {
-			if (address + size > _size) { throw AccessViolation(); }
+		/**
+		* Accesses must be within the memory's bounds. Stores to read-only memory are dropped.
+		*/
+		void load(void* destination, AddressType address, AddressType size) const noexcept override {
+			assert(address + size <= _size);
 			memcpy(destination, _storage + address, size);
 		}
 
-		void store(AddressType address, const void* data, AddressType size) override {
-			if (_flags & kFlagReadOnly) { throw ReadOnlyViolation(); }
-			if (address + size > _size) { throw AccessViolation(); }
+		void store(AddressType address, const void* data, AddressType size) noexcept override {
+			if (_flags & kFlagReadOnly) { return; }
+			assert(address + size <= _size);
 			memcpy(_storage + address, data, size);
+			markDirty(address, size);
 		}
 		
+		uint8_t load8(AddressType address) const { return _load<uint8_t>(address); }
+		uint16_t load16(AddressType address) const { return _load<LittleEndian<uint16_t>>(address); }
+		uint32_t load32(AddressType address) const { return _load<LittleEndian<uint32_t>>(address); }
+
+		void store8(AddressType address, uint8_t value) { _store<uint8_t>(address, value); }
+		void store16(AddressType address, uint16_t value) { _store<LittleEndian<uint16_t>>(address, value); }
+		void store32(AddressType address, uint32_t value) { _store<LittleEndian<uint32_t>>(address, value); }
+
 		uint8_t* storage() { return _storage; }
 
+		/**
+		* Writes made through storage() aren't tracked, so their writers need to mark them. Does nothing unless the memory
+		* was created with kFlagDirtyTracking.
+		*/
+		void markDirty(AddressType address, AddressType size) noexcept {
+			if (_dirtyBlocks.empty() || !size) { return; }
+			for (auto block = address / kDirtyBlockSize; block <= (address + size - 1) / kDirtyBlockSize; ++block) {
+				_dirtyBlocks[block] = 1;
+			}
+		}
+
+		bool isDirty(AddressType address, AddressType size) const noexcept {
+			if (_dirtyBlocks.empty() || !size) { return false; }
+			for (auto block = address / kDirtyBlockSize; block <= (address + size - 1) / kDirtyBlockSize; ++block) {
+				if (_dirtyBlocks[block]) { return true; }
+			}
+			return false;
+		}
+
+		/**
+		* Returns one byte per block, non-zero for the blocks written since the last call, and starts tracking afresh.
+		* The bitmap itself stays put since mmus point into it.
+		*/
+		std::vector<uint8_t> takeDirtyBlocks() {
+			auto blocks = _dirtyBlocks;
+			clearDirtyBlocks();
+			return blocks;
+		}
+
+		void clearDirtyBlocks() {
+			std::fill(_dirtyBlocks.begin(), _dirtyBlocks.end(), 0);
+		}
+
+		/**
+		* Clears the blocks that overlap the given range, for readers that catch up on a block at a time.
+		*/
+		void clearDirty(AddressType address, AddressType size) noexcept {
+			if (_dirtyBlocks.empty() || !size) { return; }
+			for (auto block = address / kDirtyBlockSize; block <= (address + size - 1) / kDirtyBlockSize; ++block) {
+				_dirtyBlocks[block] = 0;
+			}
+		}
+
+		typename MemoryInterface<AddressType>::DirectStorage directStorage() const override {
+			typename MemoryInterface<AddressType>::DirectStorage storage;
+			storage.data = _storage;
+			storage.size = _size;
+			storage.isWritable = !(_flags & kFlagReadOnly);
+			storage.descriptor = _descriptor;
+			storage.dirtyBlocks = _dirtyBlocks.empty() ? nullptr : const_cast<uint8_t*>(_dirtyBlocks.data());
+			return storage;
+		}
+
 	private:
 		uint8_t* _storage = nullptr;
 		AddressType _size = 0;
 		int _flags = 0;
+		bool _ownsStorage = true;
+		std::unique_ptr<SharedMemory> _sharedMemory;
+		int _descriptor = -1;
+		std::vector<uint8_t> _dirtyBlocks;
+
+		template <typename T>
+		T _load(AddressType address) const noexcept {
+			assert(address + sizeof(T) <= _size);
+			T ret;
+			memcpy(&ret, _storage + address, sizeof(T));
+			return ret;
+		}
+
+		template <typename T>
+		void _store(AddressType address, T value) noexcept {
+			if (_flags & kFlagReadOnly) { return; }
+			assert(address + sizeof(T) <= _size);
+			memcpy(_storage + address, &value, sizeof(T));
+			markDirty(address, sizeof(T));
+		}
 };
\ No newline at end of file
@@ -1,13 +1,65 @@
 #pragma once
 
+#include <stdint.h>
+
+#include "FixedEndian.h"
+
 template <typename AddressType>
 class MemoryInterface {
 	public:
 		virtual ~MemoryInterface() {}
 
-		struct AccessViolation {};
-		struct ReadOnlyViolation {};
-
 		virtual void load(void* destination, AddressType address, AddressType size) const = 0;
 		virtual void store(AddressType address, const void* data, AddressType size) = 0;
+
+		/**
+		* Typed accesses. Multi-byte values are little-endian. These go through load and store, so subclasses that can do
+		* better hide them with their own versions.
+		*/
+		uint8_t load8(AddressType address) const { return _load<uint8_t>(address); }
+		uint16_t load16(AddressType address) const { return _load<LittleEndian<uint16_t>>(address); }
+		uint32_t load32(AddressType address) const { return _load<LittleEndian<uint32_t>>(address); }
+
+		void store8(AddressType address, uint8_t value) { _store<uint8_t>(address, value); }
+		void store16(AddressType address, uint16_t value) { _store<LittleEndian<uint16_t>>(address, value); }
+		void store32(AddressType address, uint32_t value) { _store<LittleEndian<uint32_t>>(address, value); }
+
+		/**
+		* Memory that tracks writes keeps one byte per block of this many bytes, set whenever the block is stored to.
+		*/
+		static const AddressType kDirtyBlockSize = 0x100;
+
+		/**
+		* Memory that's nothing more than a byte array can expose it so that hot paths can bypass load and store.
+		*/
+		struct DirectStorage {
+			uint8_t* data = nullptr;
+			AddressType size = 0;
+			bool isWritable = false;
+
+			/**
+			* If the memory tracks writes, hot paths that store to data directly must also set the blocks' bytes here.
+			*/
+			uint8_t* dirtyBlocks = nullptr;
+
+			/**
+			* If the storage can also be mapped with mmap, this is the descriptor to map, starting from offset 0.
+			*/
+			int descriptor = -1;
+		};
+
+		virtual DirectStorage directStorage() const { return DirectStorage(); }
+
+	private:
+		template <typename T>
+		T _load(AddressType address) const {
+			T ret;
+			load(&ret, address, static_cast<AddressType>(sizeof(ret)));
+			return ret;
+		}
+
+		template <typename T>
+		void _store(AddressType address, T value) {
+			store(address, &value, static_cast<AddressType>(sizeof(value)));
+		}
 };
\ No newline at end of file
@@ -0,0 +1,59 @@
+#include "SharedMemory.h"
+
+#include <atomic>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+namespace {
+	int CreateSharedMemoryObject() {
+#if defined(__linux__) && defined(SYS_memfd_create)
+		return static_cast<int>(syscall(SYS_memfd_create, "gba-emu", 0));
+#else
+		// shm_open needs a name, but it's unlinked right away so nothing else can open it
+		static std::atomic<unsigned int> counter;
+		char name[64];
+		snprintf(name, sizeof(name), "/gba-emu-%d-%u", static_cast<int>(getpid()), counter++);
+		auto fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			shm_unlink(name);
+		}
+		return fd;
+#endif
+	}
+}
+
+SharedMemory::SharedMemory(size_t size) {
+	if (!size) { return; }
+
+	auto fd = CreateSharedMemoryObject();
+	if (fd < 0) { return; }
+
+	if (ftruncate(fd, static_cast<off_t>(size))) {
+		close(fd);
+		return;
+	}
+
+	auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+
+	_data = reinterpret_cast<uint8_t*>(data);
+	_size = size;
+	_descriptor = fd;
+}
+
+SharedMemory::~SharedMemory() {
+	if (_data) {
+		munmap(_data, _size);
+		close(_descriptor);
+	}
+}
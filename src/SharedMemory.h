@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* Zero-filled memory backed by an anonymous shared memory object instead of the heap, so that the same bytes can be
+* mapped at more than one address.
+*/
+class SharedMemory {
+	public:
+		explicit SharedMemory(size_t size);
+		~SharedMemory();
+
+		SharedMemory(const SharedMemory&) = delete;
+		SharedMemory& operator=(const SharedMemory&) = delete;
+
+		/**
+		* Returns nullptr if the host couldn't create the object.
+		*/
+		uint8_t* data() const { return _data; }
+		size_t size() const { return _size; }
+
+		/**
+		* A descriptor that can be passed to mmap to map the memory again.
+		*/
+		int descriptor() const { return _descriptor; }
+
+	private:
+		uint8_t* _data = nullptr;
+		size_t _size = 0;
+		int _descriptor = -1;
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+/**
+* A minimal x86-64 assembler. It only knows the handful of instructions the recompiler needs. Unless noted, register
+* operations are 32-bit.
+*/
+class X86Assembler {
+	public:
+		enum Register : uint8_t {
+			kRAX, kRCX, kRDX, kRBX, kRSP, kRBP, kRSI, kRDI,
+			kR8, kR9, kR10, kR11, kR12, kR13, kR14, kR15,
+			kRegisterNone = 0xff,
+		};
+
+		enum Condition : uint8_t {
+			kConditionOverflow     = 0x0,
+			kConditionNoOverflow   = 0x1,
+			kConditionCarry        = 0x2,
+			kConditionNoCarry      = 0x3,
+			kConditionZero         = 0x4,
+			kConditionNotZero      = 0x5,
+			kConditionBelowOrEqual = 0x6,
+			kConditionAbove        = 0x7,
+			kConditionSign         = 0x8,
+			kConditionNoSign       = 0x9,
+			kConditionLess         = 0xc,
+			kConditionGreaterEqual = 0xd,
+			kConditionLessEqual    = 0xe,
+			kConditionGreater      = 0xf,
+		};
+
+		enum ALUOperation : uint8_t {
+			kALUOperationADD = 0,
+			kALUOperationOR  = 1,
+			kALUOperationADC = 2,
+			kALUOperationSBB = 3,
+			kALUOperationAND = 4,
+			kALUOperationSUB = 5,
+			kALUOperationXOR = 6,
+			kALUOperationCMP = 7,
+		};
+
+		enum ShiftOperation : uint8_t {
+			kShiftOperationROL = 0,
+			kShiftOperationROR = 1,
+			kShiftOperationSHL = 4,
+			kShiftOperationSHR = 5,
+			kShiftOperationSAR = 7,
+		};
+
+		/**
+		* A memory operand of the form [base + index * scale + displacement].
+		*/
+		struct Address {
+			Address(Register base, int32_t displacement = 0) : base(base), displacement(displacement) {}
+			Address(Register base, Register index, uint8_t scale, int32_t displacement = 0)
+				: base(base), index(index), scale(scale), displacement(displacement) {}
+
+			Register base;
+			Register index = kRegisterNone;
+			uint8_t scale = 1;
+			int32_t displacement = 0;
+		};
+
+		struct Label {
+			size_t position = kUnbound;
+			std::vector<size_t> fixups;
+
+			static const size_t kUnbound = ~static_cast<size_t>(0);
+		};
+
+		const std::vector<uint8_t>& code() const { return _code; }
+		size_t size() const { return _code.size(); }
+
+		void bind(Label& label) {
+			assert(label.position == Label::kUnbound);
+			label.position = _code.size();
+			for (auto fixup : label.fixups) {
+				_patch32(fixup, static_cast<uint32_t>(label.position - (fixup + 4)));
+			}
+			label.fixups.clear();
+		}
+
+		void mov(Register dst, Register src) { _rex(false, src, dst); _byte(0x89); _modRM(3, src, dst); }
+		void mov64(Register dst, Register src) { _rex(true, src, dst); _byte(0x89); _modRM(3, src, dst); }
+		void mov(Register dst, uint32_t imm) { _rex(false, 0, dst); _byte(0xb8 + (dst & 7)); _imm32(imm); }
+
+		void mov64(Register dst, uint64_t imm) {
+			_rex(true, 0, dst);
+			_byte(0xb8 + (dst & 7));
+			_imm32(static_cast<uint32_t>(imm));
+			_imm32(static_cast<uint32_t>(imm >> 32));
+		}
+
+		void mov(Register dst, const Address& src) { _rex(false, dst, src); _byte(0x8b); _address(dst, src); }
+		void mov64(Register dst, const Address& src) { _rex(true, dst, src); _byte(0x8b); _address(dst, src); }
+		void mov(const Address& dst, Register src) { _rex(false, src, dst); _byte(0x89); _address(src, dst); }
+		void mov(const Address& dst, uint32_t imm) { _rex(false, 0, dst); _byte(0xc7); _address(0, dst); _imm32(imm); }
+		void mov8(const Address& dst, Register src) { _rex(false, src, dst, src >= kRSP); _byte(0x88); _address(src, dst); }
+		void mov16(const Address& dst, Register src) { _byte(0x66); _rex(false, src, dst); _byte(0x89); _address(src, dst); }
+
+		void movzx8(Register dst, const Address& src) { _rex(false, dst, src); _byte(0x0f); _byte(0xb6); _address(dst, src); }
+		void movzx16(Register dst, const Address& src) { _rex(false, dst, src); _byte(0x0f); _byte(0xb7); _address(dst, src); }
+		void movsx8(Register dst, const Address& src) { _rex(false, dst, src); _byte(0x0f); _byte(0xbe); _address(dst, src); }
+		void movsx16(Register dst, const Address& src) { _rex(false, dst, src); _byte(0x0f); _byte(0xbf); _address(dst, src); }
+		void movzx8(Register dst, Register src) { _rex(false, dst, src, src >= kRSP); _byte(0x0f); _byte(0xb6); _modRM(3, dst, src); }
+
+		void lea64(Register dst, const Address& src) { _rex(true, dst, src); _byte(0x8d); _address(dst, src); }
+
+		void alu(ALUOperation op, Register dst, Register src) { _rex(false, src, dst); _byte((op << 3) | 1); _modRM(3, src, dst); }
+		void alu64(ALUOperation op, Register dst, Register src) { _rex(true, src, dst); _byte((op << 3) | 1); _modRM(3, src, dst); }
+		void alu(ALUOperation op, Register dst, const Address& src) { _rex(false, dst, src); _byte((op << 3) | 3); _address(dst, src); }
+		void alu(ALUOperation op, Register dst, uint32_t imm) { _aluImmediate(false, op, dst, imm); }
+		void alu64(ALUOperation op, Register dst, uint32_t imm) { _aluImmediate(true, op, dst, imm); }
+
+		void cmp8(const Address& dst, uint8_t imm) { _rex(false, 0, dst); _byte(0x80); _address(kALUOperationCMP, dst); _byte(imm); }
+
+		void test(Register a, Register b) { _rex(false, b, a); _byte(0x85); _modRM(3, b, a); }
+
+		void shift(ShiftOperation op, Register dst, uint8_t amount) {
+			_rex(false, 0, dst);
+			if (amount == 1) {
+				_byte(0xd1);
+				_modRM(3, op, dst);
+			} else {
+				_byte(0xc1);
+				_modRM(3, op, dst);
+				_byte(amount);
+			}
+		}
+
+		void shift64(ShiftOperation op, Register dst, uint8_t amount) { _rex(true, 0, dst); _byte(0xc1); _modRM(3, op, dst); _byte(amount); }
+
+		void not_(Register dst) { _rex(false, 0, dst); _byte(0xf7); _modRM(3, 2, dst); }
+		void neg(Register dst) { _rex(false, 0, dst); _byte(0xf7); _modRM(3, 3, dst); }
+		void imul(Register dst, Register src) { _rex(false, dst, src); _byte(0x0f); _byte(0xaf); _modRM(3, dst, src); }
+
+		void bt(Register src, uint8_t bit) { _rex(false, 0, src); _byte(0x0f); _byte(0xba); _modRM(3, 4, src); _byte(bit); }
+		void bt64(Register src, uint8_t bit) { _rex(true, 0, src); _byte(0x0f); _byte(0xba); _modRM(3, 4, src); _byte(bit); }
+		void bt(const Address& src, uint8_t bit) { _rex(false, 0, src); _byte(0x0f); _byte(0xba); _address(4, src); _byte(bit); }
+		void cmc() { _byte(0xf5); }
+
+		void setcc(Condition condition, Register dst) { _rex(false, 0, dst, dst >= kRSP); _byte(0x0f); _byte(0x90 + condition); _modRM(3, 0, dst); }
+
+		void pushfq() { _byte(0x9c); }
+		void push(Register src) { _rex(false, 0, src); _byte(0x50 + (src & 7)); }
+		void pop(Register dst) { _rex(false, 0, dst); _byte(0x58 + (dst & 7)); }
+
+		void call(Register target) { _rex(false, 0, target); _byte(0xff); _modRM(3, 2, target); }
+		void ret() { _byte(0xc3); }
+		void nop() { _byte(0x90); }
+
+		void jmp(Label& label) { _byte(0xe9); _label(label); }
+		void jcc(Condition condition, Label& label) { _byte(0x0f); _byte(0x80 + condition); _label(label); }
+
+	private:
+		std::vector<uint8_t> _code;
+
+		void _byte(uint8_t b) { _code.push_back(b); }
+
+		void _imm32(uint32_t imm) {
+			for (int i = 0; i < 4; ++i) {
+				_byte(static_cast<uint8_t>(imm >> (i * 8)));
+			}
+		}
+
+		void _patch32(size_t position, uint32_t value) {
+			for (int i = 0; i < 4; ++i) {
+				_code[position + i] = static_cast<uint8_t>(value >> (i * 8));
+			}
+		}
+
+		void _label(Label& label) {
+			if (label.position != Label::kUnbound) {
+				_imm32(static_cast<uint32_t>(label.position - (_code.size() + 4)));
+			} else {
+				label.fixups.push_back(_code.size());
+				_imm32(0);
+			}
+		}
+
+		void _rex(bool w, uint8_t reg, uint8_t rm, bool force = false) {
+			uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+			if (rex != 0x40 || force) {
+				_byte(rex);
+			}
+		}
+
+		void _rex(bool w, uint8_t reg, const Address& address, bool force = false) {
+			uint8_t index = address.index == kRegisterNone ? 0 : address.index;
+			uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((address.base & 8) ? 1 : 0);
+			if (rex != 0x40 || force) {
+				_byte(rex);
+			}
+		}
+
+		void _modRM(uint8_t mod, uint8_t reg, uint8_t rm) { _byte(static_cast<uint8_t>((mod << 6) | ((reg & 7) << 3) | (rm & 7))); }
+
+		void _address(uint8_t reg, const Address& address) {
+			uint8_t mod = 2;
+			if (address.displacement == 0 && (address.base & 7) != kRBP) {
+				mod = 0;
+			} else if (address.displacement >= -128 && address.displacement <= 127) {
+				mod = 1;
+			}
+
+			if (address.index == kRegisterNone && (address.base & 7) != kRSP) {
+				_modRM(mod, reg, address.base);
+			} else {
+				uint8_t scale = address.scale == 8 ? 3 : address.scale == 4 ? 2 : address.scale == 2 ? 1 : 0;
+				uint8_t index = address.index == kRegisterNone ? kRSP : address.index;
+				_modRM(mod, reg, kRSP);
+				_byte(static_cast<uint8_t>((scale << 6) | ((index & 7) << 3) | (address.base & 7)));
+			}
+
+			if (mod == 1) {
+				_byte(static_cast<uint8_t>(address.displacement));
+			} else if (mod == 2) {
+				_imm32(static_cast<uint32_t>(address.displacement));
+			}
+		}
+
+		void _aluImmediate(bool w, ALUOperation op, Register dst, uint32_t imm) {
+			_rex(w, 0, dst);
+			if (static_cast<int32_t>(imm) >= -128 && static_cast<int32_t>(imm) <= 127) {
+				_byte(0x83);
+				_modRM(3, op, dst);
+				_byte(static_cast<uint8_t>(imm));
+			} else {
+				_byte(0x81);
+				_modRM(3, op, dst);
+				_imm32(imm);
+			}
+		}
+};
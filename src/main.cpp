@@ -1,10 +1,10 @@
 #include "GameBoyAdvance.h"
 
 #include <stdint.h>
-#include <string>
-#include <fstream>
-#include <streambuf>
+#include <cstring>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
@@ -24,8 +24,36 @@ static void RenderScreen() {
 int main(int argc, char* argv[]) {
 	glutInit(&argc, argv);
 
+	auto executionMode = ARM7TDMI::kExecutionModeInterpreter;
+	bool isIdleLoopDetectionEnabled = true;
+	bool isFastmemEnabled = false;
+	std::vector<std::pair<uint32_t, bool>> idleLoopOverrides;
+
+	while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+		if (!strcmp(argv[1], "--cached")) {
+			executionMode = ARM7TDMI::kExecutionModeCachedInterpreter;
+		} else if (!strcmp(argv[1], "--recompiler")) {
+			executionMode = ARM7TDMI::kExecutionModeRecompiler;
+		} else if (!strcmp(argv[1], "--lockstep")) {
+			executionMode = ARM7TDMI::kExecutionModeRecompilerLockstep;
+		} else if (!strcmp(argv[1], "--fastmem")) {
+			isFastmemEnabled = true;
+		} else if (!strcmp(argv[1], "--no-idle-loops")) {
+			isIdleLoopDetectionEnabled = false;
+		} else if (argc > 2 && (!strcmp(argv[1], "--idle-loop") || !strcmp(argv[1], "--no-idle-loop"))) {
+			// per-game overrides for loops that detection gets wrong
+			idleLoopOverrides.emplace_back(static_cast<uint32_t>(strtoul(argv[2], nullptr, 16)), !strcmp(argv[1], "--idle-loop"));
+			--argc;
+			++argv;
+		} else {
+			break;
+		}
+		--argc;
+		++argv;
+	}
+
 	if (argc < 3) {
-		printf("usage: %s bios rom\n", argv[0]);
+		printf("usage: %s [--cached | --recompiler | --lockstep] [--fastmem] [--no-idle-loops] [--idle-loop address]... [--no-idle-loop address]... bios rom\n", argv[0]);
 		return 1;
 	}
 
@@ -38,16 +66,21 @@ int main(int argc, char* argv[]) {
 
 	gGBA.reset(new GameBoyAdvance());
 
-	{
-		std::ifstream ifs(argv[1]);
-		std::string fileContents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
-		gGBA->loadBIOS(fileContents.data(), fileContents.size());
+	gGBA->cpu().setExecutionMode(executionMode);
+	if (isFastmemEnabled && !gGBA->cpu().mmu().enableFastmem()) {
+		printf("warning: fastmem isn't supported on this host\n");
+	}
+	gGBA->cpu().setIdleLoopDetectionEnabled(isIdleLoopDetectionEnabled);
+	for (auto& override : idleLoopOverrides) {
+		gGBA->cpu().setIdleLoopOverride(override.first, override.second);
 	}
 
-	{
-		std::ifstream ifs(argv[2]);
-		std::string fileContents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
-		gGBA->loadGamePak(fileContents.data(), fileContents.size(), 8192);
+	try {
+		gGBA->loadBIOSFile(argv[1]);
+		gGBA->loadGamePakFile(argv[2], 8192);
+	} catch (MappedFile::OpenFailure) {
+		printf("unable to open %s or %s\n", argv[1], argv[2]);
+		return 1;
 	}
 
 	std::thread gbaThread([] {
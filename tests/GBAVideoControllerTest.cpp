@@ -0,0 +1,377 @@
+#include "GameBoyAdvance.h"
+
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+
+/**
+* Renders random scenes, changing video ram, palette ram, and registers between scanlines, and compares every frame
+* against a reference renderer. The reference works a pixel at a time straight from memory, the way the renderer did
+* before tiles and palettes were cached, so any entry that outlives the memory it came from shows up as a mismatch.
+*/
+
+namespace {
+
+const uint64_t kCyclesPerScanline = 1232;
+const uint64_t kCyclesPerScanlineDraw = 960;
+const uint64_t kCyclesPerFrame = 228 * kCyclesPerScanline;
+
+struct Registers {
+	uint16_t control = 0;
+	uint16_t backgrounds[4] = {0};
+	uint16_t xOffsets[4] = {0};
+	uint16_t yOffsets[4] = {0};
+};
+
+class Reference {
+	public:
+		Reference(GameBoyAdvance* gba) : _mmu(gba->cpu().mmu()) {}
+
+		/**
+		* Draws scanline y with whatever is in memory right now.
+		*/
+		void drawLine(const Registers& registers, uint32_t y, uint32_t* line) const {
+			auto mode = registers.control & 7;
+
+			for (uint32_t x = 0; x < 240; ++x) {
+				uint32_t objectColor = 0;
+				int objectPriority = 4;
+				if (registers.control & (1 << 12)) {
+					_objectPixel(registers, x, y, &objectColor, &objectPriority);
+				}
+
+				line[x] = _color(_palette(0));
+
+				bool isDone = false;
+				for (int priority = 0; priority < 4 && !isDone; ++priority) {
+					if (objectPriority == priority) {
+						line[x] = objectColor;
+						break;
+					}
+					for (int bg = 0; bg < 4; ++bg) {
+						if (!(registers.control & (0x100 << bg)) || (registers.backgrounds[bg] & 3) != priority) { continue; }
+
+						uint32_t color = 0;
+						bool isOpaque = false;
+						if (mode == 0) {
+							isOpaque = _textPixel(registers, bg, x, y, &color);
+						} else if (bg == 2) {
+							isOpaque = _bitmapPixel(registers, x, y, &color);
+						}
+
+						if (isOpaque) {
+							line[x] = color;
+							isDone = true;
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		void setGamma(double gamma) { _gamma = gamma; }
+
+	private:
+		MMU<uint32_t>& _mmu;
+		double _gamma = 1.0;
+
+		uint8_t _videoRAM(uint32_t offset) const {
+			return offset < 0x18000 ? _mmu.load8(0x06000000 + offset) : 0;
+		}
+
+		uint16_t _palette(uint32_t index) const {
+			return _mmu.load16(0x05000000 + index * 2);
+		}
+
+		uint32_t _color(uint16_t color) const {
+			uint32_t ret = 0xff000000;
+			for (int i = 0; i < 3; ++i) {
+				double level = ((color >> (i * 5)) & 0x1f) / 31.0;
+				ret |= static_cast<uint32_t>(std::round(255.0 * std::pow(level, _gamma))) << (16 - i * 8);
+			}
+			return ret;
+		}
+
+		uint8_t _tilePixel(uint32_t address, bool isFullPalette, uint32_t x, uint32_t y) const {
+			if (isFullPalette) {
+				return _videoRAM(address + y * 8 + x);
+			}
+			return (_videoRAM(address + y * 4 + x / 2) >> ((x & 1) * 4)) & 0xf;
+		}
+
+		bool _textPixel(const Registers& registers, int bg, uint32_t x, uint32_t y, uint32_t* color) const {
+			uint16_t control = registers.backgrounds[bg];
+			uint32_t screenSize = control >> 14;
+			bool isFullPalette = control & 0x80;
+
+			uint32_t bx = (x + registers.xOffsets[bg]) & ((screenSize & 1) ? 511 : 255);
+			uint32_t by = (y + registers.yOffsets[bg]) & ((screenSize & 2) ? 511 : 255);
+
+			uint32_t screenBlock = ((control >> 8) & 0x1f) + (bx >= 256 ? 1 : 0) + (by >= 256 ? (screenSize == 3 ? 2 : 1) : 0);
+			uint32_t entryAddress = screenBlock * 0x800 + ((by & 255) / 8) * 64 + ((bx & 255) / 8) * 2;
+			uint16_t entry = _videoRAM(entryAddress) | (_videoRAM(entryAddress + 1) << 8);
+
+			uint32_t address = ((control >> 2) & 3) * 0x4000 + (entry & 0x3ff) * (isFullPalette ? 64 : 32);
+			if (address >= 0x10000) {
+				// backgrounds can't reach the object tiles
+				return false;
+			}
+
+			uint32_t px = (entry & 0x400) ? 7 - (bx & 7) : (bx & 7);
+			uint32_t py = (entry & 0x800) ? 7 - (by & 7) : (by & 7);
+			uint8_t index = _tilePixel(address, isFullPalette, px, py);
+			if (!index) { return false; }
+
+			*color = _color(_palette(isFullPalette ? index : ((entry >> 12) << 4) | index));
+			return true;
+		}
+
+		bool _bitmapPixel(const Registers& registers, uint32_t x, uint32_t y, uint32_t* color) const {
+			uint32_t frame = (registers.control & 0x10) ? 0xa000 : 0;
+
+			switch (registers.control & 7) {
+				case 3:
+					*color = _color(_videoRAM(y * 480 + x * 2) | (_videoRAM(y * 480 + x * 2 + 1) << 8));
+					return true;
+				case 4: {
+					uint8_t index = _videoRAM(frame + y * 240 + x);
+					*color = _color(_palette(index));
+					return index != 0;
+				}
+				case 5:
+					if (x >= 160 || y >= 128) { return false; }
+					*color = _color(_videoRAM(frame + y * 320 + x * 2) | (_videoRAM(frame + y * 320 + x * 2 + 1) << 8));
+					return true;
+			}
+
+			return false;
+		}
+
+		void _objectPixel(const Registers& registers, uint32_t x, uint32_t y, uint32_t* color, int* priority) const {
+			static const int kSizes[3][4][2] = {
+				{{8, 8}, {16, 16}, {32, 32}, {64, 64}},
+				{{16, 8}, {32, 8}, {32, 16}, {64, 32}},
+				{{8, 16}, {8, 32}, {16, 32}, {32, 64}},
+			};
+
+			for (int i = 0; i < 128; ++i) {
+				uint16_t attributes0 = _mmu.load16(0x07000000 + i * 8);
+				uint16_t attributes1 = _mmu.load16(0x07000000 + i * 8 + 2);
+				uint16_t attributes2 = _mmu.load16(0x07000000 + i * 8 + 4);
+
+				// only regular objects are generated, so anything else is skipped
+				if ((attributes0 & 0x300) != 0 || (attributes0 >> 14) == 3 || ((attributes0 >> 10) & 3) == 2) { continue; }
+
+				int width = kSizes[attributes0 >> 14][attributes1 >> 14][0];
+				int height = kSizes[attributes0 >> 14][attributes1 >> 14][1];
+
+				int top = attributes0 & 0xff;
+				int left = attributes1 & 0x1ff;
+				int ox = (static_cast<int>(x) - left) & 0x1ff;
+				int oy = (static_cast<int>(y) - top) & 0xff;
+				if (ox >= width || oy >= height) { continue; }
+
+				if (attributes1 & 0x1000) { ox = width - 1 - ox; }
+				if (attributes1 & 0x2000) { oy = height - 1 - oy; }
+
+				bool isFullPalette = attributes0 & 0x2000;
+				int tileStep = isFullPalette ? 2 : 1;
+				int tile = (attributes2 & 0x3ff) + (ox / 8) * tileStep;
+				if (registers.control & 0x40) {
+					tile += (oy / 8) * (width / 8) * tileStep;
+				} else {
+					tile += (oy / 8) * 32;
+				}
+				tile &= 0x3ff;
+
+				if ((registers.control & 7) >= 3 && tile < 512) {
+					// the frame buffers take the first half of the object tiles
+					continue;
+				}
+
+				uint8_t index = _tilePixel(0x10000 + tile * 32, isFullPalette, ox & 7, oy & 7);
+				int objectPriority = (attributes2 >> 10) & 3;
+				if (!index || objectPriority >= *priority) { continue; }
+
+				*color = _color(_palette(0x100 | (isFullPalette ? index : ((attributes2 >> 12) << 4) | index)));
+				*priority = objectPriority;
+			}
+		}
+};
+
+class Test {
+	public:
+		Test() : _gba(new GameBoyAdvance()), _reference(_gba.get()), _random(1) {}
+
+		int run() {
+			for (int scene = 0; scene < 60; ++scene) {
+				_randomizeScene(scene);
+				for (int frame = 0; frame < 3; ++frame) {
+					if (scene % 10 == 4 && frame == 2) {
+						// the cached palette has to follow gamma changes even when palette ram doesn't change
+						_setGamma(2.2);
+					}
+					_drawFrame(scene, frame > 0);
+				}
+			}
+
+			printf("%s (%d frames with mismatches)\n", _failures ? "FAILED" : "OK", _failures);
+			return _failures ? 1 : 0;
+		}
+
+	private:
+		std::unique_ptr<GameBoyAdvance> _gba;
+		Reference _reference;
+		std::mt19937 _random;
+		Registers _registers;
+		int _failures = 0;
+
+		uint32_t _expected[240 * 160];
+		uint32_t _actual[240 * 160];
+
+		uint32_t _next(uint32_t limit) { return _random() % limit; }
+
+		MMU<uint32_t>& _mmu() { return _gba->cpu().mmu(); }
+
+		void _setControl(uint16_t value) {
+			_registers.control = value;
+			_mmu().store16(0x04000000, value);
+		}
+
+		void _setBackground(int bg, uint16_t value) {
+			_registers.backgrounds[bg] = value;
+			_mmu().store16(0x04000008 + bg * 2, value);
+		}
+
+		void _setOffsets(int bg, uint16_t x, uint16_t y) {
+			_registers.xOffsets[bg] = x & 0x1ff;
+			_registers.yOffsets[bg] = y & 0x1ff;
+			_mmu().store16(0x04000010 + bg * 4, x);
+			_mmu().store16(0x04000012 + bg * 4, y);
+		}
+
+		void _randomizeScene(int scene) {
+			// text mode most of the time, since that's where the tile cache is used
+			static const uint16_t kModes[] = {0, 0, 0, 0, 3, 4, 5};
+			uint16_t mode = kModes[_next(sizeof(kModes) / sizeof(*kModes))];
+			_setControl(mode | (_next(2) ? 0x10 : 0) | (_next(2) ? 0x40 : 0) | (mode ? 0x400 : (_next(16) << 8)) | (_next(4) ? 0x1000 : 0));
+
+			for (int bg = 0; bg < 4; ++bg) {
+				_setBackground(bg, _next(4) | (_next(4) << 2) | (_next(2) << 7) | (_next(32) << 8) | (_next(4) << 14));
+				_setOffsets(bg, _next(512), _next(512));
+			}
+
+			// zeros are transparent, so leave plenty of them
+			for (uint32_t address = 0; address < 0x18000; address += 2) {
+				_mmu().store16(0x06000000 + address, _next(3) ? _random() : 0);
+			}
+			for (uint32_t address = 0; address < 0x400; address += 2) {
+				_mmu().store16(0x05000000 + address, _random() & 0x7fff);
+			}
+
+			for (int i = 0; i < 128; ++i) {
+				uint16_t attributes0 = 0x200;
+				if (i < 32) {
+					attributes0 = _next(256) | (_next(2) << 13) | (_next(3) << 14) | (_next(8) ? 0 : 0x400);
+				}
+				_mmu().store16(0x07000000 + i * 8, attributes0);
+				_mmu().store16(0x07000002 + i * 8, _next(512) | (_next(4) << 12) | (_next(4) << 14));
+				_mmu().store16(0x07000004 + i * 8, _random());
+			}
+
+			_setGamma(scene % 10 == 9 ? 2.2 : 1.0);
+		}
+
+		void _setGamma(double gamma) {
+			_gba->videoController().setGamma(gamma);
+			_reference.setGamma(gamma);
+		}
+
+		/**
+		* Makes a few random changes before the next scanline is drawn.
+		*/
+		void _changeMemory() {
+			switch (_next(12)) {
+				case 0:
+					// rewrite part of a tile, sometimes through a mirror of video ram
+					_mmu().store32((_next(2) ? 0x06000000 : 0x06020000) + (_next(0x18000) & ~3), _random());
+					break;
+				case 1:
+					_mmu().store8(0x06000000 + _next(0x10000), _random());
+					break;
+				case 2:
+					_mmu().store16(0x05000000 + _next(0x200) * 2, _random() & 0x7fff);
+					break;
+				case 3: {
+					// copy over a run of tiles with a dma
+					uint32_t source = 0x02000000 + (_next(0x1000) & ~3);
+					for (uint32_t i = 0; i < 64; i += 4) {
+						_mmu().store32(source + i, _next(2) ? _random() : 0);
+					}
+					_mmu().store32(0x040000d4, source);
+					_mmu().store32(0x040000d8, 0x06000000 + (_next(0x17f00) & ~3));
+					_mmu().store16(0x040000dc, 16);
+					_mmu().store16(0x040000de, 0x8400);
+					break;
+				}
+				case 4: {
+					int bg = _next(4);
+					_setOffsets(bg, _next(512), _next(512));
+					break;
+				}
+				case 5:
+					_mmu().store16(0x07000000 + _next(32) * 8 + _next(3) * 2, _random() & ~0x100);
+					break;
+				case 6:
+					// the backdrop, which lines with nothing else on them still use
+					_mmu().store16(0x05000000, _random() & 0x7fff);
+					break;
+				case 7: {
+					// replace a whole palette bank with a dma
+					uint32_t source = 0x02000000 + (_next(0x1000) & ~3);
+					for (uint32_t i = 0; i < 32; i += 2) {
+						_mmu().store16(source + i, _random() & 0x7fff);
+					}
+					_mmu().store32(0x040000d4, source);
+					_mmu().store32(0x040000d8, 0x05000000 + _next(32) * 32);
+					_mmu().store16(0x040000dc, 16);
+					_mmu().store16(0x040000de, 0x8000);
+					break;
+				}
+			}
+		}
+
+		void _drawFrame(int scene, bool isChangingMemory) {
+			auto& scheduler = _gba->scheduler();
+			scheduler.advance(kCyclesPerFrame - scheduler.now() % kCyclesPerFrame);
+			auto frameStart = scheduler.now();
+
+			for (uint32_t y = 0; y < 160; ++y) {
+				if (isChangingMemory) {
+					_changeMemory();
+				}
+
+				// just past the scanline's h-blank, where it gets drawn
+				scheduler.advance(frameStart + y * kCyclesPerScanline + kCyclesPerScanlineDraw + 1 - scheduler.now());
+				_reference.drawLine(_registers, y, _expected + y * 240);
+			}
+
+			scheduler.advance(frameStart + kCyclesPerFrame - scheduler.now());
+			_gba->videoController().copyFrame(_actual);
+
+			for (uint32_t i = 0; i < 240 * 160; ++i) {
+				if (_actual[i] != _expected[i]) {
+					printf("scene %d: pixel (%u, %u) is %08x, expected %08x\n", scene, i % 240, i / 240, _actual[i], _expected[i]);
+					++_failures;
+					break;
+				}
+			}
+		}
+};
+
+}
+
+int main() {
+	return Test().run();
+}
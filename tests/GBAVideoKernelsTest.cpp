@@ -0,0 +1,123 @@
+#include "GBAVideoKernels.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+
+/**
+* Checks the portable kernels against the exact color scaling, then checks every other instruction set the cpu
+* supports against the portable kernels with random inputs. Lengths cover the remainders the vector loops leave.
+*/
+
+namespace {
+
+const uint32_t kMaxLength = 260;
+
+const char* name(GBAVideoKernels::InstructionSet instructionSet) {
+	switch (instructionSet) {
+		case GBAVideoKernels::kInstructionSetPortable: return "portable";
+		case GBAVideoKernels::kInstructionSetSSE2: return "sse2";
+		case GBAVideoKernels::kInstructionSetAVX2: return "avx2";
+	}
+	return "unknown";
+}
+
+class Test {
+	public:
+		Test() : _portable(*GBAVideoKernels::get(GBAVideoKernels::kInstructionSetPortable)), _random(1) {}
+
+		int run() {
+			_testScaling();
+
+			for (auto instructionSet : {GBAVideoKernels::kInstructionSetSSE2, GBAVideoKernels::kInstructionSetAVX2}) {
+				auto kernels = GBAVideoKernels::get(instructionSet);
+				if (!kernels) {
+					printf("%s isn't supported, skipping it\n", name(instructionSet));
+					continue;
+				}
+				for (int trial = 0; trial < 2000; ++trial) {
+					_testRandom(*kernels);
+				}
+			}
+
+			printf("%s (%d failures)\n", _failures ? "FAILED" : "OK", _failures);
+			return _failures ? 1 : 0;
+		}
+
+	private:
+		const GBAVideoKernels& _portable;
+		std::mt19937 _random;
+		int _failures = 0;
+
+		uint32_t _next(uint32_t limit) { return _random() % limit; }
+
+		void _testScaling() {
+			auto level = [](uint32_t component) { return static_cast<uint32_t>(std::floor(255.0 * component / 31.0 + 0.5)); };
+
+			for (uint32_t color = 0; color < 0x10000; ++color) {
+				uint16_t source = color;
+				uint32_t pixel = 0;
+				_portable.convert(&pixel, &source, 1);
+
+				uint32_t expected = 0xff000000 | (level(color & 0x1f) << 16) | (level((color >> 5) & 0x1f) << 8) | level((color >> 10) & 0x1f);
+				if (pixel != expected) {
+					printf("portable convert: %04x is %08x, expected %08x\n", color, pixel, expected);
+					++_failures;
+					return;
+				}
+			}
+		}
+
+		void _testRandom(const GBAVideoKernels& kernels) {
+			uint32_t count = _next(kMaxLength);
+
+			uint16_t colors[kMaxLength];
+			uint8_t indices[kMaxLength];
+			uint8_t keys[kMaxLength];
+			uint32_t source[kMaxLength];
+			uint32_t destination[kMaxLength];
+			uint32_t palette[256];
+
+			// zeros are transparent, so leave plenty of them
+			for (uint32_t i = 0; i < kMaxLength; ++i) {
+				colors[i] = _random();
+				indices[i] = _next(3) ? _random() : 0;
+				keys[i] = _next(5);
+				source[i] = _next(3) ? (_random() | 1) : 0;
+				destination[i] = _random();
+			}
+			for (auto& entry : palette) {
+				entry = _random() | 0xff000000;
+			}
+			uint8_t key = _next(5);
+			uint32_t value = _random();
+
+			// the whole buffer is compared so that writes past count show up too
+			auto compare = [&](const char* kernel, const std::function<void(const GBAVideoKernels&, uint32_t*)>& call) {
+				uint32_t expected[kMaxLength];
+				uint32_t actual[kMaxLength];
+				memcpy(expected, destination, sizeof(expected));
+				memcpy(actual, destination, sizeof(actual));
+				call(_portable, expected);
+				call(kernels, actual);
+				if (memcmp(expected, actual, sizeof(actual))) {
+					printf("%s %s: differs from portable with count %u\n", name(kernels.instructionSet), kernel, count);
+					++_failures;
+				}
+			};
+
+			compare("convert", [&](const GBAVideoKernels& k, uint32_t* d) { k.convert(d, colors, count); });
+			compare("lookUp", [&](const GBAVideoKernels& k, uint32_t* d) { k.lookUp(d, indices, palette, count); });
+			compare("fill", [&](const GBAVideoKernels& k, uint32_t* d) { k.fill(d, value, count); });
+			compare("merge", [&](const GBAVideoKernels& k, uint32_t* d) { k.merge(d, source, count); });
+			compare("mergeMatching", [&](const GBAVideoKernels& k, uint32_t* d) { k.mergeMatching(d, source, keys, key, count); });
+		}
+};
+
+}
+
+int main() {
+	return Test().run();
+}
@@ -0,0 +1,63 @@
+#include "GameBoyAdvance.h"
+
+#include <cstdio>
+#include <memory>
+
+/**
+* Checks that accesses running off the end of a mirrored ram wrap around to its start, the same way accesses that
+* start in the next mirror do.
+*/
+
+namespace {
+
+class Test {
+	public:
+		Test() : _gba(new GameBoyAdvance()) {}
+
+		int run() {
+			_testWrap("ewram", 0x02000000, 0x40000);
+			_testWrap("iwram", 0x03000000, 0x8000);
+
+			printf("%s (%d failures)\n", _failures ? "FAILED" : "OK", _failures);
+			return _failures ? 1 : 0;
+		}
+
+	private:
+		std::unique_ptr<GameBoyAdvance> _gba;
+		int _failures = 0;
+
+		MMU<uint32_t>& _mmu() { return _gba->cpu().mmu(); }
+
+		void _expect(const char* name, const char* what, uint32_t actual, uint32_t expected) {
+			if (actual != expected) {
+				printf("%s: %s is %08x, expected %08x\n", name, what, actual, expected);
+				++_failures;
+			}
+		}
+
+		void _testWrap(const char* name, uint32_t base, uint32_t size) {
+			for (uint32_t i = 0; i < 4; ++i) {
+				_mmu().store8(base + i, 0x10 + i);
+				_mmu().store8(base + size - 4 + i, 0x20 + i);
+			}
+
+			auto end = base + size - 2;
+			_expect(name, "load32 across the end", _mmu().load32(end), 0x11102322);
+			_expect(name, "load16 at the end", _mmu().load16(end + 1), 0x1023);
+
+			_mmu().store32(end, 0xaabbccdd);
+			_expect(name, "first word after storing across the end", _mmu().load32(base), 0x1312aabb);
+			_expect(name, "last word after storing across the end", _mmu().load32(base + size - 4), 0xccdd2120);
+			_expect(name, "mirrored word after storing across the end", _mmu().load32(base + size), 0x1312aabb);
+
+			_mmu().store16(end + 1, 0x5566);
+			_expect(name, "first byte after storing a halfword across the end", _mmu().load8(base), 0x55);
+			_expect(name, "last byte after storing a halfword across the end", _mmu().load8(base + size - 1), 0x66);
+		}
+};
+
+}
+
+int main() {
+	return Test().run();
+}